@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// Benchmark harness for bldd. Runs the binary over a corpus (usually one
+// made by gen_corpus) in each scan mode and reports throughput, bytes read,
+// read/write syscall counts and peak RSS taken from the kernel's accounting
+// of the child process, so bldd itself needs no instrumentation.
+
+#define MAX_PATH 4096
+#define MAX_ARGS 32
+
+typedef struct {
+    const char *name;
+    const char *args[8];      // Extra bldd arguments, NULL-terminated
+    bool fresh_cache;         // Remove the cache file before the run
+} BenchMode;
+
+typedef struct {
+    double wall;
+    unsigned long long rchar;
+    unsigned long long syscr;
+    unsigned long long syscw;
+    long maxrss_kb;
+    int status;
+} BenchResult;
+
+static long corpus_files = 0;
+static unsigned long long corpus_bytes = 0;
+
+void print_help(void);
+int count_file(const char *path, const struct stat *st, int flag, struct FTW *ftw);
+bool run_bldd(const char *bldd, char **argv, BenchResult *result);
+bool read_proc_io(pid_t pid, BenchResult *result);
+
+int main(int argc, char *argv[]) {
+    const char *bldd = NULL;
+    const char *corpus = NULL;
+    int runs = 3;
+    char jobs[24];
+    char work_dir[] = "/tmp/bldd_bench_XXXXXX";
+    char cache_path[MAX_PATH];
+    char output_path[MAX_PATH];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    snprintf(jobs, sizeof(jobs), "%ld", cpus > 0 ? cpus : 1);
+    
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "--runs") == 0 || strcmp(argv[i], "-r") == 0) && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--jobs") == 0 || strcmp(argv[i], "-j") == 0) && i + 1 < argc) {
+            snprintf(jobs, sizeof(jobs), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            print_help();
+            return 0;
+        } else if (argv[i][0] != '-' && bldd == NULL) {
+            bldd = argv[i];
+        } else if (argv[i][0] != '-' && corpus == NULL) {
+            corpus = argv[i];
+        } else {
+            fprintf(stderr, "Error: Unknown option: %s\n", argv[i]);
+            print_help();
+            return 1;
+        }
+    }
+    
+    if (bldd == NULL || corpus == NULL || runs < 1) {
+        print_help();
+        return 1;
+    }
+    
+    if (nftw(corpus, count_file, 64, FTW_PHYS) != 0) {
+        fprintf(stderr, "Error: Cannot walk corpus %s: %s\n", corpus, strerror(errno));
+        return 1;
+    }
+    if (mkdtemp(work_dir) == NULL) {
+        fprintf(stderr, "Error: Cannot create work directory: %s\n", strerror(errno));
+        return 1;
+    }
+    snprintf(cache_path, sizeof(cache_path), "%s/scan.cache", work_dir);
+    snprintf(output_path, sizeof(output_path), "%s/report", work_dir);
+    
+    // cache-warm has to follow cache-cold: it reuses the cache that run wrote
+    const BenchMode modes[] = {
+        { "serial", { "--jobs", "1", NULL }, false },
+        { "parallel", { "--jobs", jobs, NULL }, false },
+        { "cache-cold", { "--jobs", jobs, "--cache", cache_path, NULL }, true },
+        { "cache-warm", { "--jobs", jobs, "--cache", cache_path, NULL }, false },
+    };
+    
+    printf("bldd benchmark: %s\n", bldd);
+    printf("corpus: %s (%ld files, %.1f MiB apparent size), best of %d runs\n\n",
+           corpus, corpus_files, corpus_bytes / (1024.0 * 1024.0), runs);
+    printf("%-12s %10s %12s %14s %10s %10s %12s\n",
+           "mode", "wall (s)", "files/s", "bytes read", "read sys", "write sys", "peak RSS KiB");
+    
+    int failures = 0;
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        const BenchMode *mode = &modes[m];
+        BenchResult best;
+        bool have_best = false;
+    
+        for (int r = 0; r < runs; r++) {
+            char *args[MAX_ARGS];
+            int n = 0;
+            BenchResult result;
+    
+            if (mode->fresh_cache) {
+                unlink(cache_path);
+            }
+    
+            args[n++] = (char *)bldd;
+            args[n++] = "--lib";
+            args[n++] = "libc.so.6";
+            args[n++] = "--lib";
+            args[n++] = "ssl";
+            args[n++] = "--lib";
+            args[n++] = "z";
+            args[n++] = "--dir";
+            args[n++] = (char *)corpus;
+            args[n++] = "--output";
+            args[n++] = output_path;
+            for (int a = 0; mode->args[a] != NULL && n < MAX_ARGS - 1; a++) {
+                args[n++] = (char *)mode->args[a];
+            }
+            args[n] = NULL;
+    
+            if (!run_bldd(bldd, args, &result) || result.status != 0) {
+                fprintf(stderr, "Error: %s run failed (status %d)\n", mode->name, result.status);
+                failures++;
+                break;
+            }
+            if (!have_best || result.wall < best.wall) {
+                best = result;
+                have_best = true;
+            }
+        }
+    
+        if (have_best) {
+            printf("%-12s %10.3f %12.0f %14llu %10llu %10llu %12ld\n",
+                   mode->name, best.wall, corpus_files / best.wall, best.rchar,
+                   best.syscr, best.syscw, best.maxrss_kb);
+        }
+    }
+    
+    unlink(cache_path);
+    snprintf(output_path, sizeof(output_path), "%s/report.txt", work_dir);
+    unlink(output_path);
+    rmdir(work_dir);
+    
+    return failures ? 1 : 0;
+}
+
+void print_help(void) {
+    printf("Usage: bench [OPTIONS] BLDD CORPUS\n");
+    printf("\nRun bldd over CORPUS in every scan mode and report throughput and resource use\n\n");
+    printf("Options:\n");
+    printf("  -r, --runs N               Runs per mode, the fastest one is reported (default: 3)\n");
+    printf("  -j, --jobs N               Threads for the parallel modes (default: online CPUs)\n");
+}
+
+int count_file(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)path;
+    (void)ftw;
+    
+    if (flag == FTW_F && S_ISREG(st->st_mode)) {
+        corpus_files++;
+        corpus_bytes += st->st_size;
+    }
+    return 0;
+}
+
+// Run bldd with stdout and stderr discarded. The child is left as a zombie
+// until its /proc/<pid>/io has been read, then reaped with wait4() for the
+// rusage.
+bool run_bldd(const char *bldd, char **argv, BenchResult *result) {
+    struct timespec start, end;
+    struct rusage usage;
+    siginfo_t info;
+    pid_t pid;
+    
+    memset(result, 0, sizeof(*result));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "Error: fork failed: %s\n", strerror(errno));
+        return false;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            close(null_fd);
+        }
+        execv(bldd, argv);
+        _exit(127);
+    }
+    
+    if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1) {
+        fprintf(stderr, "Error: waitid failed: %s\n", strerror(errno));
+        return false;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    read_proc_io(pid, result);
+    
+    if (wait4(pid, &result->status, 0, &usage) == -1) {
+        fprintf(stderr, "Error: wait4 failed: %s\n", strerror(errno));
+        return false;
+    }
+    
+    result->wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    result->maxrss_kb = usage.ru_maxrss;
+    result->status = WIFEXITED(result->status) ? WEXITSTATUS(result->status) : -1;
+    return true;
+}
+
+bool read_proc_io(pid_t pid, BenchResult *result) {
+    char path[64];
+    char line[256];
+    FILE *fp;
+    
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return false;
+    }
+    
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        sscanf(line, "rchar: %llu", &result->rchar);
+        sscanf(line, "syscr: %llu", &result->syscr);
+        sscanf(line, "syscw: %llu", &result->syscw);
+    }
+    
+    fclose(fp);
+    return true;
+}
@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <elf.h>
+
+// Synthetic tree generator for the bldd benchmark. Produces a reproducible
+// mix of ELF32/ELF64 files in both byte orders for every machine bldd
+// knows, with varying DT_NEEDED counts, plus the kind of noise a real root
+// file system has: scripts, data files, truncated ELF headers, statically
+// linked binaries and non-executable shared objects, spread over a deeply
+// nested directory tree.
+
+#define MAX_PATH 4096
+#define MAX_NEEDED 16
+#define FILES_PER_DIR 24
+
+typedef struct {
+    uint16_t machine;
+    unsigned char elf_class;
+    unsigned char data;
+} Target;
+
+// One entry per (machine, class, byte order) combination bldd classifies
+static const Target targets[] = {
+    { EM_X86_64, ELFCLASS64, ELFDATA2LSB },
+    { EM_386, ELFCLASS32, ELFDATA2LSB },
+    { EM_AARCH64, ELFCLASS64, ELFDATA2LSB },
+    { EM_AARCH64, ELFCLASS64, ELFDATA2MSB },
+    { EM_ARM, ELFCLASS32, ELFDATA2LSB },
+    { EM_ARM, ELFCLASS32, ELFDATA2MSB },
+    { EM_RISCV, ELFCLASS64, ELFDATA2LSB },
+    { EM_PPC64, ELFCLASS64, ELFDATA2LSB },
+    { EM_S390, ELFCLASS64, ELFDATA2MSB },
+    { EM_MIPS, ELFCLASS32, ELFDATA2MSB },
+    { EM_MIPS, ELFCLASS64, ELFDATA2LSB },
+};
+
+static const char *sonames[] = {
+    "libc.so.6", "libm.so.6", "libpthread.so.0", "libdl.so.2", "librt.so.1",
+    "libstdc++.so.6", "libgcc_s.so.1", "libssl.so.3", "libcrypto.so.3",
+    "libssl.so.1.1", "libcrypto.so.1.1", "libz.so.1", "liblzma.so.5",
+    "libbz2.so.1.0", "libzstd.so.1", "libcurl.so.4", "libxml2.so.2",
+    "libsqlite3.so.0", "libpcre2-8.so.0", "libselinux.so.1", "libcap.so.2",
+    "libsystemd.so.0", "libdbus-1.so.3", "libglib-2.0.so.0", "libffi.so.8",
+    "libuuid.so.1", "libblkid.so.1", "libmount.so.1", "libtinfo.so.6",
+    "libreadline.so.8", "libexpat.so.1", "libpng16.so.16", "libjpeg.so.62",
+    "libgmp.so.10", "libidn2.so.0", "libunistring.so.2", "libnghttp2.so.14",
+    "libkrb5.so.3", "libgssapi_krb5.so.2", "liblz4.so.1",
+};
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+typedef struct {
+    int files;
+    int depth;
+    uint64_t seed;
+    const char *root;
+} GenOptions;
+
+static uint64_t rng_state;
+
+void print_help(void);
+uint64_t rng_next(void);
+int rng_range(int n);
+void put16(unsigned char *p, uint16_t v, bool msb);
+void put32(unsigned char *p, uint32_t v, bool msb);
+void put64(unsigned char *p, uint64_t v, bool msb);
+void put_word(unsigned char *p, uint64_t v, bool is64, bool msb);
+void buf_reserve(Buffer *buf, size_t len);
+size_t buf_append(Buffer *buf, const void *data, size_t len);
+size_t build_elf(Buffer *buf, const Target *t, uint16_t type, int needed_count, bool dynamic, bool interp, size_t padding);
+void write_file(const char *path, const void *data, size_t len, mode_t mode, size_t hole_at, size_t hole_len);
+void make_dirs(const char *path);
+
+int main(int argc, char *argv[]) {
+    GenOptions opt = { 20000, 24, 1, NULL };
+    char **dirs;
+    int dir_count, dir_cap;
+    Buffer buf = { NULL, 0, 0 };
+    int counts[6] = { 0 };
+    
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "--files") == 0 || strcmp(argv[i], "-n") == 0) && i + 1 < argc) {
+            opt.files = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--depth") == 0 || strcmp(argv[i], "-d") == 0) && i + 1 < argc) {
+            opt.depth = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--seed") == 0 || strcmp(argv[i], "-s") == 0) && i + 1 < argc) {
+            opt.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            print_help();
+            return 0;
+        } else if (argv[i][0] != '-' && opt.root == NULL) {
+            opt.root = argv[i];
+        } else {
+            fprintf(stderr, "Error: Unknown option: %s\n", argv[i]);
+            print_help();
+            return 1;
+        }
+    }
+    
+    if (opt.root == NULL || opt.files <= 0 || opt.depth <= 0) {
+        print_help();
+        return 1;
+    }
+    
+    rng_state = opt.seed * 0x9e3779b97f4a7c15ULL + 1;
+    make_dirs(opt.root);
+    
+    // Directory tree: one deliberately deep chain, the rest hung off random
+    // existing directories so that nesting varies from 1 to --depth levels
+    dir_cap = opt.files / FILES_PER_DIR + opt.depth + 1;
+    dirs = calloc(dir_cap, sizeof(char *));
+    if (dirs == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    dirs[0] = strdup(opt.root);
+    dir_count = 1;
+    
+    int *depths = calloc(dir_cap, sizeof(int));
+    if (depths == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    
+    for (int d = 0; d < opt.depth && dir_count < dir_cap; d++) {
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "%s/deep%02d", dirs[dir_count - 1], d);
+        make_dirs(path);
+        depths[dir_count] = d + 1;
+        dirs[dir_count++] = strdup(path);
+    }
+    while (dir_count < dir_cap) {
+        int parent = rng_range(dir_count);
+        char path[MAX_PATH];
+    
+        if (depths[parent] >= opt.depth) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/d%05d", dirs[parent], dir_count);
+        make_dirs(path);
+        depths[dir_count] = depths[parent] + 1;
+        dirs[dir_count++] = strdup(path);
+    }
+    
+    for (int i = 0; i < opt.files; i++) {
+        char path[MAX_PATH];
+        const char *dir = dirs[rng_range(dir_count)];
+        const Target *t = &targets[rng_range(sizeof(targets) / sizeof(targets[0]))];
+        int kind = rng_range(100);
+    
+        buf.len = 0;
+        if (kind < 55) {
+            // Dynamically linked executable or PIE
+            bool pie = rng_range(2);
+            size_t padding = (size_t)rng_range(64) * 1024;
+            size_t hole = build_elf(&buf, t, pie ? ET_DYN : ET_EXEC, rng_range(MAX_NEEDED + 1), true, true, padding);
+            snprintf(path, sizeof(path), "%s/bin%06d", dir, i);
+            write_file(path, buf.data, buf.len, 0755, hole, padding);
+            counts[0]++;
+        } else if (kind < 60) {
+            // Statically linked: no PT_DYNAMIC, but large
+            size_t padding = (size_t)(256 + rng_range(1024)) * 1024;
+            size_t hole = build_elf(&buf, t, ET_EXEC, 0, false, false, padding);
+            snprintf(path, sizeof(path), "%s/static%06d", dir, i);
+            write_file(path, buf.data, buf.len, 0755, hole, padding);
+            counts[1]++;
+        } else if (kind < 65) {
+            // Shared object without the x bit
+            size_t padding = (size_t)rng_range(16) * 1024;
+            size_t hole = build_elf(&buf, t, ET_DYN, 1 + rng_range(6), true, false, padding);
+            snprintf(path, sizeof(path), "%s/lib%06d.so.1", dir, i);
+            write_file(path, buf.data, buf.len, 0644, hole, padding);
+            counts[2]++;
+        } else if (kind < 85) {
+            // Executable scripts
+            static const char *scripts[] = {
+                "#!/bin/sh\nexec /usr/bin/true \"$@\"\n",
+                "#!/usr/bin/env python3\nimport sys\nsys.exit(0)\n",
+                "#!/usr/bin/perl\nprint \"ok\\n\";\n",
+            };
+            const char *text = scripts[rng_range(3)];
+            snprintf(path, sizeof(path), "%s/script%06d", dir, i);
+            write_file(path, text, strlen(text), 0755, 0, 0);
+            counts[3]++;
+        } else if (kind < 95) {
+            // Plain data, some of it marked executable by mistake
+            buf_reserve(&buf, 4096);
+            for (int b = 0; b < 4096; b++) {
+                buf.data[b] = (char)rng_next();
+            }
+            buf.len = 512 + rng_range(3584);
+            snprintf(path, sizeof(path), "%s/data%06d.bin", dir, i);
+            write_file(path, buf.data, buf.len, rng_range(2) ? 0755 : 0644, 0, 0);
+            counts[4]++;
+        } else {
+            // ELF magic followed by garbage or nothing
+            build_elf(&buf, t, ET_EXEC, 2, true, true, 0);
+            buf.len = 4 + rng_range(60);
+            snprintf(path, sizeof(path), "%s/trunc%06d", dir, i);
+            write_file(path, buf.data, buf.len, 0755, 0, 0);
+            counts[5]++;
+        }
+    }
+    
+    printf("Generated %d files in %d directories under %s\n", opt.files, dir_count, opt.root);
+    printf("  dynamic ELF: %d, static ELF: %d, shared objects: %d\n", counts[0], counts[1], counts[2]);
+    printf("  scripts: %d, data: %d, truncated ELF: %d\n", counts[3], counts[4], counts[5]);
+    
+    for (int i = 0; i < dir_count; i++) {
+        free(dirs[i]);
+    }
+    free(dirs);
+    free(depths);
+    free(buf.data);
+    return 0;
+}
+
+void print_help(void) {
+    printf("Usage: gen_corpus [OPTIONS] DIR\n");
+    printf("\nGenerate a synthetic file tree for benchmarking bldd\n\n");
+    printf("Options:\n");
+    printf("  -n, --files N              Number of files to create (default: 20000)\n");
+    printf("  -d, --depth N              Maximum directory nesting (default: 24)\n");
+    printf("  -s, --seed N               Random seed; the same seed gives the same tree (default: 1)\n");
+}
+
+// xorshift64*
+uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+int rng_range(int n) {
+    return (int)((rng_next() >> 33) % (uint64_t)n);
+}
+
+void put16(unsigned char *p, uint16_t v, bool msb) {
+    if (msb) {
+        p[0] = v >> 8;
+        p[1] = v;
+    } else {
+        p[0] = v;
+        p[1] = v >> 8;
+    }
+}
+
+void put32(unsigned char *p, uint32_t v, bool msb) {
+    if (msb) {
+        put16(p, v >> 16, true);
+        put16(p + 2, v, true);
+    } else {
+        put16(p, v, false);
+        put16(p + 2, v >> 16, false);
+    }
+}
+
+void put64(unsigned char *p, uint64_t v, bool msb) {
+    if (msb) {
+        put32(p, v >> 32, true);
+        put32(p + 4, v, true);
+    } else {
+        put32(p, v, false);
+        put32(p + 4, v >> 32, false);
+    }
+}
+
+void put_word(unsigned char *p, uint64_t v, bool is64, bool msb) {
+    if (is64) {
+        put64(p, v, msb);
+    } else {
+        put32(p, (uint32_t)v, msb);
+    }
+}
+
+void buf_reserve(Buffer *buf, size_t len) {
+    if (buf->len + len > buf->cap) {
+        while (buf->len + len > buf->cap) {
+            buf->cap = buf->cap ? buf->cap * 2 : 64 * 1024;
+        }
+        buf->data = realloc(buf->data, buf->cap);
+        if (buf->data == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+}
+
+size_t buf_append(Buffer *buf, const void *data, size_t len) {
+    size_t off = buf->len;
+    
+    buf_reserve(buf, len);
+    if (data != NULL) {
+        memcpy(buf->data + off, data, len);
+    } else {
+        memset(buf->data + off, 0, len);
+    }
+    buf->len += len;
+    return off;
+}
+
+// Lay out a minimal but well-formed ELF file: header, program headers, an
+// optional zero-filled gap standing in for code, then the dynamic string
+// table and the dynamic section, all covered by one PT_LOAD. Returns the
+// offset of the gap so the caller can leave it as a hole in the file.
+size_t build_elf(Buffer *buf, const Target *t, uint16_t type, int needed_count, bool dynamic, bool interp, size_t padding) {
+    bool is64 = (t->elf_class == ELFCLASS64);
+    bool msb = (t->data == ELFDATA2MSB);
+    size_t ehsize = is64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+    size_t phentsize = is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+    size_t dynentsize = is64 ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+    int phnum = 1 + (dynamic ? 1 : 0) + (interp ? 1 : 0);
+    uint64_t base = 0x400000;
+    const char *interp_path = is64 ? "/lib64/ld-linux.so.2" : "/lib/ld-linux.so.2";
+    uint32_t needed_off[MAX_NEEDED];
+    
+    buf->len = 0;
+    size_t eh = buf_append(buf, NULL, ehsize);
+    size_t ph = buf_append(buf, NULL, phentsize * phnum);
+    size_t interp_at = 0;
+    if (interp) {
+        interp_at = buf_append(buf, interp_path, strlen(interp_path) + 1);
+    }
+    size_t gap_at = buf_append(buf, NULL, padding);
+    
+    size_t strtab = buf->len, strsz = 0, dyn = 0, dynsz = 0;
+    if (dynamic) {
+        buf_append(buf, "", 1);
+        for (int i = 0; i < needed_count; i++) {
+            const char *name = sonames[rng_range(sizeof(sonames) / sizeof(sonames[0]))];
+            needed_off[i] = (uint32_t)(buf->len - strtab);
+            buf_append(buf, name, strlen(name) + 1);
+        }
+        strsz = buf->len - strtab;
+        buf_append(buf, NULL, (8 - buf->len % 8) % 8);
+    
+        dyn = buf->len;
+        dynsz = dynentsize * (needed_count + 3);
+        buf_append(buf, NULL, dynsz);
+        unsigned char *d = (unsigned char *)buf->data + dyn;
+        for (int i = 0; i < needed_count; i++, d += dynentsize) {
+            put_word(d, DT_NEEDED, is64, msb);
+            put_word(d + dynentsize / 2, needed_off[i], is64, msb);
+        }
+        put_word(d, DT_STRTAB, is64, msb);
+        put_word(d + dynentsize / 2, base + strtab, is64, msb);
+        d += dynentsize;
+        put_word(d, DT_STRSZ, is64, msb);
+        put_word(d + dynentsize / 2, strsz, is64, msb);
+        // The last entry stays DT_NULL
+    }
+    
+    unsigned char *e = (unsigned char *)buf->data + eh;
+    memcpy(e, ELFMAG, SELFMAG);
+    e[EI_CLASS] = t->elf_class;
+    e[EI_DATA] = t->data;
+    e[EI_VERSION] = EV_CURRENT;
+    if (is64) {
+        put16(e + offsetof(Elf64_Ehdr, e_type), type, msb);
+        put16(e + offsetof(Elf64_Ehdr, e_machine), t->machine, msb);
+        put32(e + offsetof(Elf64_Ehdr, e_version), EV_CURRENT, msb);
+        put64(e + offsetof(Elf64_Ehdr, e_entry), base, msb);
+        put64(e + offsetof(Elf64_Ehdr, e_phoff), ph, msb);
+        put16(e + offsetof(Elf64_Ehdr, e_ehsize), ehsize, msb);
+        put16(e + offsetof(Elf64_Ehdr, e_phentsize), phentsize, msb);
+        put16(e + offsetof(Elf64_Ehdr, e_phnum), phnum, msb);
+    } else {
+        put16(e + offsetof(Elf32_Ehdr, e_type), type, msb);
+        put16(e + offsetof(Elf32_Ehdr, e_machine), t->machine, msb);
+        put32(e + offsetof(Elf32_Ehdr, e_version), EV_CURRENT, msb);
+        put32(e + offsetof(Elf32_Ehdr, e_entry), base, msb);
+        put32(e + offsetof(Elf32_Ehdr, e_phoff), ph, msb);
+        put16(e + offsetof(Elf32_Ehdr, e_ehsize), ehsize, msb);
+        put16(e + offsetof(Elf32_Ehdr, e_phentsize), phentsize, msb);
+        put16(e + offsetof(Elf32_Ehdr, e_phnum), phnum, msb);
+    }
+    
+    // Program headers: PT_LOAD over the whole file, then PT_DYNAMIC and PT_INTERP
+    struct { uint32_t type, flags; uint64_t offset, size; } segs[3];
+    int n = 0;
+    segs[n].type = PT_LOAD; segs[n].flags = PF_R | PF_X; segs[n].offset = 0; segs[n++].size = buf->len;
+    if (dynamic) {
+        segs[n].type = PT_DYNAMIC; segs[n].flags = PF_R | PF_W; segs[n].offset = dyn; segs[n++].size = dynsz;
+    }
+    if (interp) {
+        segs[n].type = PT_INTERP; segs[n].flags = PF_R; segs[n].offset = interp_at;
+        segs[n++].size = strlen(interp_path) + 1;
+    }
+    for (int i = 0; i < n; i++) {
+        unsigned char *p = (unsigned char *)buf->data + ph + i * phentsize;
+        if (is64) {
+            put32(p + offsetof(Elf64_Phdr, p_type), segs[i].type, msb);
+            put32(p + offsetof(Elf64_Phdr, p_flags), segs[i].flags, msb);
+            put64(p + offsetof(Elf64_Phdr, p_offset), segs[i].offset, msb);
+            put64(p + offsetof(Elf64_Phdr, p_vaddr), base + segs[i].offset, msb);
+            put64(p + offsetof(Elf64_Phdr, p_paddr), base + segs[i].offset, msb);
+            put64(p + offsetof(Elf64_Phdr, p_filesz), segs[i].size, msb);
+            put64(p + offsetof(Elf64_Phdr, p_memsz), segs[i].size, msb);
+            put64(p + offsetof(Elf64_Phdr, p_align), 0x1000, msb);
+        } else {
+            put32(p + offsetof(Elf32_Phdr, p_type), segs[i].type, msb);
+            put32(p + offsetof(Elf32_Phdr, p_offset), segs[i].offset, msb);
+            put32(p + offsetof(Elf32_Phdr, p_vaddr), base + segs[i].offset, msb);
+            put32(p + offsetof(Elf32_Phdr, p_paddr), base + segs[i].offset, msb);
+            put32(p + offsetof(Elf32_Phdr, p_filesz), segs[i].size, msb);
+            put32(p + offsetof(Elf32_Phdr, p_memsz), segs[i].size, msb);
+            put32(p + offsetof(Elf32_Phdr, p_flags), segs[i].flags, msb);
+            put32(p + offsetof(Elf32_Phdr, p_align), 0x1000, msb);
+        }
+    }
+    
+    return gap_at;
+}
+
+// Write data to path, leaving [hole_at, hole_at + hole_len) unwritten so
+// large synthetic binaries cost no disk space
+void write_file(const char *path, const void *data, size_t len, mode_t mode, size_t hole_at, size_t hole_len) {
+    const char *bytes = data;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    
+    if (fd == -1) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if (hole_len == 0) {
+        hole_at = len;
+    }
+    if (write(fd, bytes, hole_at) != (ssize_t)hole_at ||
+        pwrite(fd, bytes + hole_at + hole_len, len - hole_at - hole_len, hole_at + hole_len) !=
+            (ssize_t)(len - hole_at - hole_len) ||
+        ftruncate(fd, len) == -1) {
+        fprintf(stderr, "Error: Cannot write %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    fchmod(fd, mode);
+    close(fd);
+}
+
+void make_dirs(const char *path) {
+    char tmp[MAX_PATH];
+    
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(tmp, 0755);
+            *p = '/';
+        }
+    }
+    if (mkdir(tmp, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create directory %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
@@ -5,10 +5,25 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <stdbool.h>
 #include <limits.h>
 #include <libgen.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <elf.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fnmatch.h>
+#include <signal.h>
 
 // Define PDF_SUPPORT to 0 if you don't have libhpdf installed
 #ifndef PDF_SUPPORT
@@ -19,58 +34,1096 @@
 #include <hpdf.h>
 #endif
 
-#define MAX_LIBS 100
+// Define IO_URING_SUPPORT to 1 to read file headers through io_uring.
+// Only the kernel headers are needed, not liburing.
+#ifndef IO_URING_SUPPORT
+#define IO_URING_SUPPORT 0
+#endif
+
+#if IO_URING_SUPPORT
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/syscall.h>
+#endif
+
 #define MAX_PATH 4096
-#define MAX_EXECS 10000
 #define MAX_LINE 1024
-#define MAX_ARCH 4
+#define MAX_JOBS 1024
 #define MAX_HEADER_SIZE 100
+#define ELF_HEAD_SIZE 4096  // First read of every candidate: file header plus program headers
+#define ELF_MAX_VIEWS 4     // Program headers, dynamic section, NEEDED strings (plus one retry)
+#define MAX_ELF_TABLE (64 * 1024 * 1024)  // Upper bound for any single table read from an ELF file
+#define ELF_MMAP_THRESHOLD (256 * 1024)   // Views at least this large are mapped, not copied
+#define ELF_LARGE_FILE (8 * 1024 * 1024)  // Files above this size get readahead disabled
+#define ELF_SONAME_SLACK 1024             // Bytes read past the last NEEDED offset for its string
 #define SEPARATOR "----------"
+#define HASH_EMPTY UINT32_MAX
+#define PATH_NO_DIR (UINT32_MAX - 1)  // PathNode.parent of a first component
+#define CACHE_MAGIC "BLDDCACH"
+#define CACHE_VERSION 3
+#define CACHE_ELF 0x01
+#define CACHE_PATHS 0x02    // needed[] ends with DT_RPATH and DT_RUNPATH, "" if absent
+#define PDF_EXEC_FONT_SIZE 10
+#define REPORT_MAGIC "BLDDREPT"
+#define REPORT_VERSION 2
+#define REPORT_SHARED 0x01  // ReportHeader.flags: the scan included shared objects
+#define REPORT_BYTE_ORDER 0x01020304
+#define MAX_SEARCH_PATH (4 * MAX_PATH)  // Expanded RPATH/RUNPATH directories of one object
+#define LD_CACHE_OLD_MAGIC "ld.so-1.7.0"
+#define LD_CACHE_MAGIC "glibc-ld.so.cache1.1"
+#define LD_CACHE_HEADER_SIZE 48     // struct cache_file_new in glibc
+#define LD_CACHE_ENTRY_SIZE 24      // struct file_entry_new
+#define ROTATIONAL_DEVICE_JOBS 2    // Default concurrent directory scans per spinning disk
+#define NETWORK_DEVICE_JOBS 4       // ... and per network file system
+#define NFS_FS_MAGIC 0x6969
+#define CIFS_FS_MAGIC 0xFF534D42
+#define SMB2_FS_MAGIC 0xFE534D42
+#define PROC_FS_MAGIC 0x9FA0        // Pseudo file systems, never descended into below a root
+#define SYSFS_FS_MAGIC 0x62656572
+#define DEVPTS_FS_MAGIC 0x1CD1
+#define CGROUP_FS_MAGIC 0x27E0EB
+#define CGROUP2_FS_MAGIC 0x63677270
+#define DEBUGFS_FS_MAGIC 0x64626720
+#define TRACEFS_FS_MAGIC 0x74726163
+#define SECURITYFS_FS_MAGIC 0x73636673
+#define PSTORE_FS_MAGIC 0x6165676C
+#define BPF_FS_MAGIC 0xCAFE4A11
+#define CONFIGFS_FS_MAGIC 0x62656570
+#define FUSECTL_FS_MAGIC 0x65735543
+#define MQUEUE_FS_MAGIC 0x19800202
+#define HUGETLBFS_FS_MAGIC 0x958458F6
+#define BINFMT_FS_MAGIC 0x42494E4D
+#define AUTOFS_FS_MAGIC 0x0187
+#ifndef O_PATH
+#define O_PATH 010000000            // Linux values, hidden by glibc without _GNU_SOURCE
+#endif
+#ifndef AT_NO_AUTOMOUNT
+#define AT_NO_AUTOMOUNT 0x800
+#endif
+#define URING_DEPTH 128             // Files in flight per worker with IO_URING_SUPPORT
+#define URING_SUBMIT_BATCH 32       // Queued operations that trigger a submit without waiting
+#define LATENCY_BUCKETS 512         // --stats histogram: 8 buckets per power of two of ns
+#define STREAM_BUFFER_SIZE (256 * 1024)  // Per-worker --stream buffer, flushed when full
+#define STREAM_FLUSH_MS 100         // ... or once its oldest record has waited this long
+#ifndef EM_LOONGARCH
+#define EM_LOONGARCH 258
+#endif
+#define ELF_MACHINE_COUNT (EM_LOONGARCH + 1)  // e_machine values covered by elf_arch()
+#define WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | \
+                    IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+#define WATCH_SETTLE_MS 100         // --watch writes results once events pause this long
+#define WATCH_MAX_DELAY_MS 500      // ... or at the latest this long after the first change
+#define DEDUPE_STRIPES 64           // Locks in each dedupe table, picked by key hash
+#define SERVE_THREADS 4             // --serve threads, each polling its own clients
+#define SERVE_REQUEST_MAX 4096      // Longest request line a --serve client may send
+#define SERVE_POLL_MS 250           // How often idle server threads check for shutdown
+#define SERVE_SEND_TIMEOUT_S 5      // A client that does not read its reply for this long is dropped
+#define SPILL_MERGE_WAYS 64         // --mem-limit runs merged at once, each with its own stdio buffer
+#define SPILL_CASCADE_WAYS 8        // Runs of one level a worker merges into one while scanning
+#define SPILL_MIN_BUFFER (64 * 1024)  // Smallest match buffer --mem-limit may leave a worker
+#define DEDUPE_LIMIT_SHARE 4        // --mem-limit: each dedupe table may hold SIZE / 4
+#define DEDUPE_MIN_STRIPE_ENTRIES 256  // ... split into fewer stripes if each would not fit this many entries
+#define ARENA_BLOCK_SIZE (256 * 1024)  // Arena blocks; a request over a quarter of this gets its own
+#define ARENA_ALIGN 8               // Enough for every pointer and integer kept in an arena
+
+// Binary report written by --format bin. It is columnar: every column is a
+// flat array starting at an 8-byte aligned offset recorded in the header, so
+// a consumer can mmap the file and use the arrays in place.
+//
+//   ReportHeader
+//   uint64_t arch_name[arch_count]      (offsets into strings)
+//   uint32_t arch_libs[arch_count + 1]  (libraries of arch a are arch_libs[a] .. arch_libs[a + 1] - 1)
+//   uint64_t lib_name[lib_count]        (offsets into strings)
+//   uint32_t lib_execs[lib_count + 1]   (rows of library l in exec_path, same scheme)
+//   uint32_t exec_path[exec_count]      (indices into path_string)
+//   uint64_t path_string[path_count]    (offsets into strings)
+//   uint8_t  path_kind[path_count]      (ElfKind of each path)
+//   char     strings[strings_size]      (NUL-terminated)
+//
+// Architectures and libraries are in the same order as in the TXT report.
+// --build-index writes the same layout with every DT_NEEDED string as a
+// library of its own, which --query then matches against --lib.
+// Fields are in host byte order; byte_order reads as REPORT_BYTE_ORDER only
+// on a machine with the producer's byte order.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t arch_count;
+    uint32_t lib_count;
+    uint32_t exec_count;
+    uint32_t path_count;
+    uint32_t flags;          // REPORT_SHARED
+    uint32_t reserved;
+    uint64_t strings_size;
+    uint64_t arch_name_offset;
+    uint64_t arch_libs_offset;
+    uint64_t lib_name_offset;
+    uint64_t lib_execs_offset;
+    uint64_t exec_path_offset;
+    uint64_t path_string_offset;
+    uint64_t path_kind_offset;
+    uint64_t strings_offset;
+} ReportHeader;
 
-// Structure to hold library information
+// Structure to hold library information. Executables are indices into
+// the path pool, so a path matching several libraries is stored once.
 typedef struct {
-    char name[256];
-    char *execs[MAX_EXECS];
+    char *name;
+    uint32_t uid;       // Unique across architectures, see lib_refs
+    uint32_t *execs;
     int exec_count;
+    int exec_cap;
+    off_t run_offset;   // --mem-limit: first record in merged_run, execs is unused
 } Library;
 
 // Structure to hold architecture information
 typedef struct {
     char name[32];
-    Library libraries[MAX_LIBS];
+    Library *libraries;
     int lib_count;
+    int lib_cap;
+    Library **sorted;   // libraries[] in report order, see build_report_order()
+    int sorted_count;   // Libraries in sorted[]; those left empty by --watch are not
 } Architecture;
 
+// A directory, or an interned path, as its parent directory plus one
+// component. "/usr/bin/ls" is the path "ls" below the directory "bin",
+// below "usr", below the empty first component.
+typedef struct {
+    uint32_t parent;    // Index into PathPool.dirs, PATH_NO_DIR for a first component
+    uint32_t len;       // Length of the whole path up to and including this component
+    size_t name;        // Offset of the component in PathPool.names
+} PathNode;
+
+// Interned executable paths. Each path is kept as its directory node and
+// its file name, so the prefixes most paths share are stored once per
+// directory. Full paths are only put together again by path_at().
+typedef struct {
+    char *names;            // NUL-terminated components of dirs[] and files[]
+    size_t names_len;
+    size_t names_cap;
+    PathNode *dirs;
+    uint32_t dir_count;
+    uint32_t dir_cap;
+    PathNode *files;        // One per path
+    unsigned char *kinds;   // ElfKind of each path
+    uint32_t count;
+    uint32_t cap;
+    uint32_t hint_dir;      // Directory of the last path looked up, text in hint[]
+    size_t hint_len;
+    char hint[MAX_PATH];
+} PathPool;
+
+// Open-addressing hash index from a 64-bit key hash to a uint32_t value.
+// The keys themselves live in the tables above; lookups pass a callback to
+// compare a candidate value against the key being searched for.
+typedef struct {
+    uint64_t *hashes;
+    uint32_t *values;   // HASH_EMPTY marks a free slot
+    uint32_t cap;       // Always a power of two
+    uint32_t count;
+} HashIndex;
+
+typedef bool (*HashKeyEquals)(uint32_t value, const void *key);
+
+// One block of an Arena, allocations follow the header
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+// Bump allocator for data that all goes away at the same time. Allocating
+// moves a pointer, and arena_free() releases everything in one pass over
+// the blocks. An arena takes no lock: each one has a single owner, the
+// thread or the table stripe it belongs to.
+typedef struct {
+    ArenaBlock *head;
+} Arena;
+
+// Open-addressing set of 64-bit keys, UINT64_MAX marks a free slot
+typedef struct {
+    uint64_t *keys;
+    uint32_t cap;
+    uint32_t count;
+} KeySet;
+
+// Reverse mapping from Library.uid to its position in archs[]
+typedef struct {
+    int arch;
+    int lib;
+} LibRef;
+
+// Lookup key for library_map
+typedef struct {
+    int arch;
+    const char *name;
+} LibKey;
+
+// Lookup keys for dir_map and path_map. A directory component is not
+// NUL-terminated where it is looked up, so it comes with its length.
+typedef struct {
+    uint32_t parent;
+    const char *name;
+    size_t len;
+} DirKey;
+
+typedef struct {
+    uint32_t dir;
+    const char *name;
+} PathKey;
+
+// Fields of the ELF file header needed for classification, in host byte order
+typedef struct {
+    unsigned char elf_class;   // ELFCLASS32 or ELFCLASS64
+    unsigned char data;        // ELFDATA2LSB or ELFDATA2MSB
+    uint16_t type;
+    uint16_t machine;
+    uint64_t phoff;
+    uint16_t phentsize;
+    uint16_t phnum;
+} ElfHeader;
+
+// A range of an ELF file outside the initial block: either a heap copy
+// made with pread() or a read-only mapping of the pages covering it
+typedef struct {
+    void *base;
+    size_t len;
+    bool mapped;
+} ElfBuffer;
+
+// An open ELF file: the initial block read from offset 0 plus any extra
+// ranges pulled in while walking the dynamic section
+typedef struct {
+    int fd;
+    uint64_t size;             // From the caller's lstat(); views never go past it
+    ElfHeader hdr;
+    unsigned char head[ELF_HEAD_SIZE];
+    size_t head_len;
+    ElfBuffer bufs[ELF_MAX_VIEWS];
+    int nbufs;
+    uint64_t bytes_read;       // pread() totals, head included, for --stats
+    uint64_t bytes_mapped;
+    bool failed;               // A read or mapping failed, see ElfInfo.unreadable
+} ElfFile;
+
+// One (e_machine, class, byte order) combination bldd knows how to name
+typedef struct {
+    const char *name;       // Architecture shown in the report
+    const char *triplet;    // Debian multiarch directory name, NULL if there is none
+} ArchInfo;
+
+// What an ELF file is, as listed with --include-shared
+typedef enum {
+    ELF_KIND_EXEC,     // ET_EXEC
+    ELF_KIND_PIE,      // ET_DYN meant to be run, see read_elf_needed()
+    ELF_KIND_SHARED    // Any other ET_DYN
+} ElfKind;
+
+// Result of classifying one file
+typedef struct {
+    const char *arch;
+    uint16_t machine;
+    unsigned char elf_class;
+    unsigned char data;
+    unsigned char kind;        // ElfKind
+    char **needed;
+    int needed_count;
+    const char *rpath;         // DT_RPATH and DT_RUNPATH, inside the needed block;
+    const char *runpath;       // only read for --transitive, NULL if absent
+    uint64_t bytes_read;       // What classifying the file cost, 0 for cache hits
+    uint64_t bytes_mapped;
+    bool deduped;              // NEEDED list taken from a file with the same content
+    bool unreadable;           // Open or read failed: no verdict, so never cached
+} ElfInfo;
+
+// On-disk scan cache. The file is mapped read-only and used in place:
+//
+//   CacheHeader
+//   CacheEntry  entries[entry_count]
+//   uint32_t    needed[needed_count]   (offsets into strings)
+//   uint32_t    slots[slot_count]      (open-addressing table, entry index + 1)
+//   char        strings[strings_size]
+//
+// All fields are in host byte order; the cache is meant to stay on the
+// machine that wrote it.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t needed_count;
+    uint32_t slot_count;       // Power of two
+    uint64_t strings_size;
+} CacheHeader;
+
+// One file, identified by (dev, ino) and validated by mtime and size
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+    uint32_t needed_index;
+    uint32_t needed_count;
+    uint16_t machine;
+    uint8_t elf_class;
+    uint8_t data;
+    uint8_t flags;             // CACHE_ELF
+    uint8_t kind;              // ElfKind
+    uint8_t reserved[2];
+} CacheEntry;
+
+typedef struct {
+    void *map;
+    size_t map_size;
+    const CacheHeader *header;
+    const CacheEntry *entries;
+    const uint32_t *needed;
+    const uint32_t *slots;
+    const char *strings;
+} ScanCache;
+
+// A cache entry collected during the scan, with its NEEDED strings packed
+// back to back
+typedef struct {
+    CacheEntry entry;
+    char *needed;
+    size_t needed_len;
+} CacheRecord;
+
+// Lookup key for the string table built by save_scan_cache()
+typedef struct {
+    const char *strings;
+    const char *name;
+} CacheStrings;
+
+// Aho-Corasick automaton over the normalized --lib patterns. Bytes are
+// folded into the classes that actually occur in some pattern, and the goto
+// function is fully expanded into a DFA, so matching one DT_NEEDED string
+// against every pattern is a single table walk.
+typedef struct {
+    unsigned char byte_class[256];  // 0 for bytes not used by any pattern
+    int class_count;
+    int *next;                      // node_count * class_count transitions
+    int *best;                      // Lowest pattern index ending at each node, -1 if none
+    int node_count;
+} LibMatcher;
+
+// Record format for --stream
+typedef enum {
+    STREAM_NONE,
+    STREAM_NDJSON,
+    STREAM_TSV
+} StreamFormat;
+
 // Program options
 typedef struct {
     char **libs;
+    char **lib_patterns;   // libs[] normalized by build_lib_pattern()
+    LibMatcher matcher;
     int lib_count;
-    char dir[MAX_PATH];
+    char **dirs;           // Scan roots, duplicates removed
+    int dir_count;
     char output[MAX_PATH];
     bool txt_format;
     bool pdf_format;
+    bool json_format;
+    bool bin_format;
+    int jobs;
+    int device_jobs;            // --device-jobs, 0 to pick a limit for each device
+    char cache_path[MAX_PATH];  // Empty if --cache was not given
+    StreamFormat stream_format;
+    char index_path[MAX_PATH];  // --build-index output, empty if not given
+    char query_path[MAX_PATH];  // --query input, empty if not given
+    bool transitive;
+    bool fast_reject;           // --fast-reject: skip script and text files by name
+    bool dedupe_content;        // --dedupe-content: reuse NEEDED lists of identical dynamic sections
+    bool include_shared;        // --include-shared: also read *.so files without an x bit, tag kinds
+    bool stats;                 // --stats: time the phases and the per-file work
+    bool watch;                 // --watch: keep the results current until interrupted
+    char serve_path[MAX_PATH];  // --serve socket, empty if not given
+    char sysroot[MAX_PATH];     // Prefix for --transitive library lookups, empty for /
+    size_t mem_limit;           // --mem-limit bytes of matches and dedupe tables, 0 for no limit
+    bool one_filesystem;        // --one-filesystem: stay on the file system of each --dir
+    char **excludes;            // --exclude globs
+    int exclude_count;
+    uint32_t shard_index;       // --shard i/N as i - 1 and N, shard_count 0 without it
+    uint32_t shard_count;
+    char **merge_paths;         // --merge partial reports
+    int merge_count;
 } Options;
 
+// A match found by a worker, merged into archs[] once the scan is done
+typedef struct {
+    const char *arch;   // Static string from elf_arch_name()
+    int lib;            // Index into Options.libs, -1 for --build-index
+    char *soname;       // --build-index: the DT_NEEDED string itself
+    char *path;
+    unsigned char kind; // ElfKind
+} Match;
+
+// Work-stealing deque of directories still to be read. The owner pushes and
+// pops at the tail; other workers steal from the head.
+typedef struct {
+    pthread_mutex_t lock;
+    char **dirs;
+    int head;
+    int tail;
+    int cap;
+} DirQueue;
+
+// Records formatted by one worker for --stream. The buffer goes to stdout
+// in one write() when it fills up, so workers only meet on the output lock
+// once per buffer and a record is never split between writers. On a sparse
+// tree it also goes out after STREAM_FLUSH_MS or when the worker runs out
+// of directories, so consumers are not kept waiting for a full buffer.
+typedef struct {
+    char *data;
+    size_t len;
+    uint64_t pending_ns;     // When the first record still in data was added
+    long records;
+    StreamFormat format;
+    bool kinds;              // Add each file's ElfKind, for --include-shared
+    pthread_mutex_t *lock;   // Shared by all writers of stdout, NULL if there is only one
+} StreamBuffer;
+
+// An ELF file found by a --transitive scan, kept until its dependencies
+// can be resolved after the scan
+typedef struct {
+    char *path;        // Path and info are in the worker's arena
+    ElfInfo info;      // One block holding the NEEDED strings and search paths
+    int *deps;         // Filled in by resolve_transitive(), like SharedObject.deps
+} ScannedElf;
+
+// A directory a worker added to the --watch inotify instance
+typedef struct {
+    int wd;
+    char *path;
+} WatchDir;
+
+// Changes seen by --watch since the results were last written. Files are
+// kept by name, not interned, so churn in temporary files that never match
+// does not grow the path pool.
+typedef struct {
+    char **changed;       // Files created, written, renamed, deleted or chmod'ed
+    int changed_count;
+    int changed_cap;
+    char **removed;       // Directories deleted or moved away, with everything below
+    int removed_count;
+    int removed_cap;
+    char **added;         // Directories created or moved in, to be scanned
+    int added_count;
+    int added_cap;
+    bool overflow;        // The kernel dropped events: everything is scanned again
+    uint64_t first_ns;    // When the oldest unwritten change came in, 0 if none
+} WatchBatch;
+
+// Identity of a file already classified: (st_dev, st_ino, 0) for another
+// link to the same inode, or for --dedupe-content the file size and hashes
+// of its program headers and dynamic section
+typedef struct {
+    uint64_t a;
+    uint64_t b;
+    uint64_t c;
+} DedupeKey;
+
+typedef struct {
+    DedupeKey key;
+    bool used;
+    bool is_elf;
+    ElfInfo info;       // Block in DedupeStripe.arena, see copy_elf_info()
+} DedupeEntry;
+
+// One lock's share of a dedupe table, open addressing over entries[]
+typedef struct {
+    pthread_mutex_t lock;
+    DedupeEntry *entries;
+    uint32_t cap;       // Always a power of two
+    uint32_t count;
+    Arena arena;        // Copies of the entries' ElfInfo, unless the table has a limit
+    size_t bytes;       // With a limit: entries[] and the info blocks, see dedupe_insert()
+    uint64_t skipped;   // With a limit: files not remembered because the stripe was full
+} DedupeStripe;
+
+// Classifications shared by every worker, so a file reached again under
+// another name is not parsed again. Striped, so workers seldom meet.
+typedef struct {
+    DedupeStripe stripes[DEDUPE_STRIPES];
+    int stripe_count;       // A power of two, DEDUPE_STRIPES without a limit
+    size_t stripe_limit;    // Bytes each stripe may hold, 0 for no limit
+} DedupeTable;
+
+// An immutable image of the results in the ReportHeader layout, read by
+// --serve lookups without locks. See publish_snapshot().
+typedef struct Snapshot {
+    const char *data;
+    size_t size;
+    bool mapped;              // data maps the --query index rather than being malloc'ed
+    uint64_t retired;         // Epoch it was replaced at, once retired
+    struct Snapshot *next;    // Next in retired_snapshots
+} Snapshot;
+
+// One connection to the --serve socket, with the part of a request line
+// received so far
+typedef struct {
+    int fd;
+    size_t len;
+    char buf[SERVE_REQUEST_MAX];
+} ServeClient;
+
+// A path found by a lookup, before sorting and duplicates are dropped
+typedef struct {
+    const char *path;
+    unsigned char kind;
+} ServeHit;
+
+// A --serve thread and the clients it polls
+typedef struct {
+    pthread_t thread;
+    atomic_uint_fast64_t epoch;   // snapshot_epoch when the running lookup began, 0 if none
+    ServeClient *clients;
+    int client_count;
+    int client_cap;
+    struct pollfd *fds;
+    int fd_cap;
+    ServeHit *hits;
+    int hit_cap;
+    char *reply;
+    size_t reply_len;
+    size_t reply_cap;
+} ServeThread;
+
+// Throttle for one device (st_dev) being scanned. A directory that finds
+// every slot taken waits in deferred[] and is queued again by the next
+// worker to release a slot on that device.
+typedef struct {
+    dev_t dev;
+    int limit;          // Directories read at once, 0 for no limit
+    int active;
+    char **deferred;
+    int deferred_count;
+    int deferred_cap;
+} DeviceSlot;
+
+#if IO_URING_SUPPORT
+typedef enum {
+    URING_FREE,
+    URING_STATX,
+    URING_OPEN,
+    URING_READ,
+    URING_CLOSE
+} UringState;
+
+// A candidate file moving through the io_uring pipeline: statx(), then
+// openat() and a read of the initial block for files that need parsing,
+// then close(). The rest of the ELF walk is done with pread() as usual.
+typedef struct {
+    UringState state;
+    char name[NAME_MAX + 1];
+    struct statx stx;
+    struct stat st;
+    ElfFile ef;
+    uint64_t start_ns;     // When it was queued, with --stats
+} UringFile;
+
+// One worker's ring and the files it is working on. All of them belong to
+// the directory being read: dir_fd and path are that directory's.
+typedef struct {
+    int fd;                        // -1 if io_uring is not available
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+    unsigned in_flight;
+    UringFile *files;
+    int *free_files;
+    int free_count;
+    int dir_fd;
+    char *path;                    // Directory path plus '/', names go at dir_len
+    size_t dir_len;
+} Uring;
+#endif
+
+// Per-worker counters for --stats. They are plain fields updated only by
+// their own worker and added up after the scan, so keeping them costs
+// nothing but the clock reads, and those are only done with --stats.
+typedef struct {
+    uint64_t dirs;             // Directories read
+    uint64_t pruned;           // Directories and files left out by mount or --exclude rules
+    uint64_t entries;          // Directory entries looked at
+    uint64_t rejected;         // Regular files turned away without being opened
+    uint64_t opened;           // Files opened and read
+    uint64_t unreadable;       // Candidates that could not be opened or read
+    uint64_t elf_files;        // Files classified as ELF, from the cache or not
+    uint64_t cache_hits;
+    uint64_t inode_hits;       // Classified through another link to the same inode
+    uint64_t content_hits;     // NEEDED lists reused by --dedupe-content
+    uint64_t bytes_read;
+    uint64_t bytes_mapped;
+    uint64_t traverse_ns;      // Reading directories and stat'ing entries
+    uint64_t classify_ns;      // Opening, reading and parsing candidates
+    uint64_t match_ns;         // Matching DT_NEEDED entries
+    uint64_t wait_ns;          // Waiting for io_uring completions
+    uint64_t cpu_ns;           // Thread CPU time spent scanning
+    uint64_t spilled_runs;     // --mem-limit runs written
+    uint64_t spilled_bytes;
+    uint64_t reuse_skipped;    // --mem-limit files not remembered, their dedupe table being full
+    uint64_t latency_count;
+    uint64_t latency_max;
+    uint32_t latency[LATENCY_BUCKETS];  // Per candidate file, see latency_bucket()
+} ScanStats;
+
+typedef enum {
+    PHASE_SCAN,                // Scanning, or reading an index with --query
+    PHASE_RESOLVE,             // --transitive dependency resolution, part of the scan
+    PHASE_MERGE,               // Merging --mem-limit runs, part of the scan
+    PHASE_ORDER,               // Sorting for the reports
+    PHASE_REPORT,              // Writing reports, streams or the index
+    PHASE_COUNT
+} Phase;
+
+typedef struct {
+    uint64_t wall_start;
+    uint64_t cpu_start;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;           // Process CPU time, all threads
+} PhaseTime;
+
+// --mem-limit match buffer of one worker. Records are packed up from the
+// start of data and pointers to them down from its end, so a full buffer
+// is sorted in place without allocating. A record is a uint32_t key_len,
+// the key "arch\0lib\0path\0" and one ElfKind byte, and goes to a run
+// file unchanged.
+typedef struct {
+    char *data;
+    size_t size;
+    size_t used;             // Bytes of records at the start of data
+    uint32_t count;          // Records, and pointers at the end of data
+    FILE **runs;             // Sorted runs written so far, oldest first
+    unsigned char *levels;   // Times the records of each run have been merged
+    int run_count;
+    int run_cap;
+} SpillBuffer;
+
+// The record a run is at, while runs are merged or read back
+typedef struct {
+    FILE *fp;
+    char *key;
+    uint32_t key_len;
+    uint32_t key_cap;
+    unsigned char kind;
+} RunCursor;
+
+// Reads one library's executables in report order, from Library.execs or,
+// after a --mem-limit scan, from its records in merged_run
+typedef struct {
+    const Library *lib;
+    int next;
+    RunCursor run;
+    char path[MAX_PATH];     // Last path put together from path_pool
+} ExecCursor;
+
+typedef struct ScanPool ScanPool;
+
+// Per-thread scan state. Matches are kept private to the worker so the hot
+// path never takes a shared lock.
+typedef struct {
+    int id;
+    pthread_t thread;
+    ScanPool *pool;
+    DirQueue queue;
+    Match *matches;
+    int match_count;
+    int match_cap;
+    Arena arena;         // Match strings and ScannedElf data, freed with the worker
+    CacheRecord *cache_records;
+    int cache_count;
+    int cache_cap;
+    StreamBuffer stream;
+    int *file_libs;      // Libraries already streamed for the current file
+    int file_lib_cap;
+    ScannedElf *elfs;    // --transitive only
+    int elf_count;
+    int elf_cap;
+    dev_t last_dev;      // Last unthrottled device seen, to skip device_lock
+    bool last_dev_free;
+    WatchDir *watches;   // --watch only
+    int watch_count;
+    int watch_cap;
+    int watch_failures;
+    SpillBuffer spill;   // --mem-limit only
+    ScanStats stats;
+#if IO_URING_SUPPORT
+    Uring ring;
+#endif
+} Worker;
+
+struct ScanPool {
+    Options *options;
+    ScanCache cache;
+    DedupeTable inodes;           // Files with more than one link, by (st_dev, st_ino)
+    DedupeTable contents;         // --dedupe-content only
+    Worker *workers;
+    int worker_count;
+    atomic_long pending;          // Directories queued or being read
+    atomic_ulong generation;      // Bumped on every push, for idle workers
+    atomic_int idle;
+    atomic_int file_count;
+    atomic_int matched_count;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    pthread_mutex_t stream_lock;  // Serializes --stream writes to stdout
+    bool throttled;               // Devices can limit workers, see acquire_device()
+    DeviceSlot *devices;
+    int device_count;
+    int device_cap;
+    pthread_mutex_t device_lock;
+};
+
+// The parts of ld.so.cache needed to look sonames up. Entries keep the file
+// order, in which ldconfig puts all entries for one soname next to each
+// other; name_map points at the first of them.
+typedef struct {
+    void *map;
+    size_t map_size;
+    const char **names;
+    const char **paths;
+    uint32_t count;
+    HashIndex name_map;
+} LdCache;
+
+// A shared object reached while resolving --transitive dependencies. The
+// same file loaded under different inherited RPATHs is a different node,
+// since its own dependencies may resolve differently.
+typedef struct {
+    char *path;
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t context;      // Index into Resolver.contexts
+    ElfInfo info;
+    int *deps;             // Node per NEEDED entry, -1 if it did not resolve
+} SharedObject;
+
+// A memoized soname lookup. The key holds everything the answer depends
+// on: the requesting object's ELF class, machine and byte order, the
+// directories searched before ld.so.cache, and the soname itself.
+typedef struct {
+    char *key;
+    size_t key_len;
+    int node;              // -1 if nothing was found
+} ResolveEntry;
+
+// State of one --transitive resolution pass
+typedef struct {
+    const char *sysroot;
+    LdCache ld_cache;
+    SharedObject *nodes;
+    int node_count;
+    int node_cap;
+    HashIndex node_map;          // (dev, ino, context) -> node
+    ResolveEntry *resolved;
+    uint32_t resolved_count;
+    uint32_t resolved_cap;
+    HashIndex resolve_map;       // ResolveEntry key -> index in resolved[]
+    char **contexts;             // Expanded RPATHs inherited from executables, 0 is ""
+    uint32_t context_count;
+    uint32_t context_cap;
+    HashIndex context_map;
+    int words;                   // uint64_t words per --lib bitset
+    uint64_t *bits;              // node_count bitsets: --lib patterns in each closure
+    Arena arena;                 // Node paths and info, deps, contexts and resolve keys
+} Resolver;
+
+// Lookup keys for the Resolver and LdCache hash indexes
+typedef struct {
+    const Resolver *resolver;
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t context;
+} NodeKey;
+
+typedef struct {
+    const Resolver *resolver;
+    const char *key;
+    size_t len;
+} ResolveKey;
+
+typedef struct {
+    const Resolver *resolver;
+    const char *name;
+} ContextKey;
+
+typedef struct {
+    const LdCache *cache;
+    const char *name;
+} LdCacheKey;
+
+#if PDF_SUPPORT
+// State of the PDF being written. Each page holds a single text object:
+// lines are placed with relative moves from the previous line, and the font
+// is only switched when it actually changes.
+typedef struct {
+    HPDF_Doc pdf;
+    HPDF_Page page;
+    HPDF_Font font;
+    HPDF_Font bold_font;
+    HPDF_Font current_font;       // NULL until set on the current page
+    float current_size;
+    float x;                      // Start of the last line in the text object
+    float y;
+    float page_height;
+    float page_width;
+    float char_width[256];        // Regular font at PDF_EXEC_FONT_SIZE, per byte
+    float min_char_width;
+    float max_char_width;
+} PdfWriter;
+#endif
+
 // Global variables
-Architecture archs[MAX_ARCH];
+Architecture *archs = NULL;
 int arch_count = 0;
+int arch_cap = 0;
+PathPool path_pool;
+HashIndex arch_map;        // Architecture name -> index in archs[]
+HashIndex library_map;     // (arch, library name) -> Library.uid
+HashIndex path_map;        // (directory, file name) -> path in path_pool
+HashIndex dir_map;         // (parent, component) -> directory in path_pool
+KeySet exec_set;           // (Library.uid, path index) pairs already recorded
+LibRef *lib_refs = NULL;
+uint32_t lib_ref_count = 0;
+uint32_t lib_ref_cap = 0;
 int total_execs = 0;
+Architecture **sorted_archs = NULL;   // archs[] in report order
+int sorted_arch_count = 0;            // Architectures in sorted_archs[], those with executables
+Arena result_arena;                   // Library names
+uint32_t *path_ranks = NULL;          // String order of each path, see rank_paths()
+uint32_t *ranked_paths = NULL;        // Path ids by rank
+uint32_t *dir_ranks = NULL;           // First and end rank of the paths below each directory
+uint32_t report_path_count = 0;       // Paths in the last report image written
+long streamed_records = 0;
+FILE *progress_out;        // stdout, or stderr when stdout carries --stream records
+bool stats_enabled = false;       // --stats given
+ScanStats scan_stats;             // --stats totals over every worker
+ScanStats *thread_stats = NULL;   // Each worker's own counters
+int thread_count = 0;
+PhaseTime phase_times[PHASE_COUNT];
+int watch_fd = -1;                // --watch inotify instance
+char **watch_dirs = NULL;         // Directory of each watch descriptor, NULL if unused
+int watch_dir_cap = 0;
+volatile sig_atomic_t stop_requested = 0;   // SIGINT or SIGTERM seen by --watch or --serve
+int serve_fd = -1;                // --serve listening socket
+ServeThread *serve_threads = NULL;
+atomic_bool serve_stop;
+Snapshot *_Atomic current_snapshot;     // What lookups read, swapped by publish_snapshot()
+atomic_uint_fast64_t snapshot_epoch = 1;
+Snapshot *retired_snapshots = NULL;     // Replaced but maybe still being read
+DedupeTable *content_table = NULL;      // --dedupe-content table of the running scan
+FILE *merged_run = NULL;          // --mem-limit matches of the scan, see index_merged_run()
+int merge_passes = 0;
 
 // Function prototypes
 void parse_arguments(int argc, char *argv[], Options *options);
 void print_help();
-void scan_directory(const char *dir_path, Options *options);
-bool is_executable(const char *file_path);
-const char *get_architecture(const char *file_path);
-void get_dependencies(const char *file_path, char **libs, int lib_count, const char *arch);
+void scan_directory(Options *options);
+void scan_roots(Options *options, char **roots, int root_count);
+void merge_matches(Worker *worker);
+void merge_spilled_runs(ScanPool *pool);
+FILE *merge_runs(FILE **runs, int count);
+void sift_run_heap(RunCursor **heap, int count, int i);
+void index_merged_run(FILE *run);
+bool read_run_record(RunCursor *cursor);
+void write_results(Options *options);
+void watch_tree(Options *options);
+void watch_event(WatchBatch *batch, const struct inotify_event *event);
+void apply_watch_batch(Options *options, WatchBatch *batch);
+void clear_watch_batch(WatchBatch *batch);
+void rescan_file(Worker *worker, const char *path);
+void purge_stale_paths(const unsigned char *stale, const uint32_t *ids, uint32_t id_count);
+void mark_stale(unsigned char *stale, uint32_t *ids, uint32_t *id_count, uint32_t id);
+void add_watch(Worker *worker, const char *dir_path);
+void set_watch_dir(int wd, char *path);
+void unwatch_tree(const char *dir_path);
+const char *dir_open_path(const char *dir_path);
+bool path_below(const char *path, const char *dir_path);
+void append_string(char ***list, int *count, int *cap, const char *s);
+void request_stop(int sig);
+void catch_stop_signals(void);
+void start_server(Options *options);
+void stop_server(Options *options);
+void wait_for_stop(void);
+void *serve_worker(void *arg);
+bool serve_client(ServeThread *self, ServeClient *client);
+void answer_lookup(ServeThread *self, const char *lib_search);
+void reply_append(ServeThread *self, const char *s, StreamFormat format);
+int compare_hits(const void *a, const void *b);
+Snapshot *snapshot_results(uint32_t flags);
+void publish_snapshot(Snapshot *snap);
+void reclaim_snapshots(void);
+void free_snapshot(Snapshot *snap);
+void query_index(Options *options);
+void merge_reports(Options *options);
+const ReportHeader *map_report(const char *path, const char *what, size_t *size);
+void add_report_results(Options *options, const ReportHeader *hdr);
+bool report_index_valid(const ReportHeader *hdr, size_t size);
+int index_library_count(void);
+void stream_results(StreamFormat format, bool kinds);
+void *scan_worker(void *arg);
+void scan_one_directory(Worker *worker, const char *dir_path);
+void push_directory(Worker *worker, char *dir_path);
+bool acquire_device(Worker *worker, int dir_fd, const char *dir_path, int *slot);
+void release_device(Worker *worker, int slot);
+int device_limit(const Options *options, int dir_fd, dev_t dev);
+bool pop_directory(Worker *worker, char **dir_path);
+bool steal_directory(Worker *worker, char **dir_path);
+bool wait_for_work(ScanPool *pool, unsigned long generation);
+void record_match(Worker *worker, const ElfInfo *info, int lib, const char *soname, const char *file_path);
+void stream_match(StreamBuffer *stream, const char *arch, const char *lib, const char *file_path, unsigned char kind);
+size_t stream_escape(char *out, const char *s, StreamFormat format);
+void spill_match(Worker *worker, const char *arch, const char *lib, const char *file_path, unsigned char kind);
+void write_spill_run(Worker *worker);
+int compare_spilled(const void *a, const void *b);
+int compare_keys(const char *a, uint32_t len_a, const char *b, uint32_t len_b);
+FILE *create_spill_file(void);
+void flush_stream(StreamBuffer *stream);
+void flush_stream_if_due(StreamBuffer *stream);
+bool classify_file(Worker *worker, int dir_fd, const char *name, const struct stat *statbuf, ElfInfo *info);
+bool load_scan_cache(ScanCache *cache, const char *cache_path);
+void unload_scan_cache(ScanCache *cache);
+uint64_t cache_key_hash(uint64_t dev, uint64_t ino);
+bool lookup_scan_cache(const ScanCache *cache, const struct stat *statbuf, bool want_paths, ElfInfo *info, bool *is_elf);
+void record_cache_entry(Worker *worker, const struct stat *statbuf, bool is_elf, bool want_paths, const ElfInfo *info);
+void save_scan_cache(ScanPool *pool, const char *cache_path);
+bool cache_string_equals(uint32_t value, const void *key);
+bool is_executable(int dir_fd, const char *name, const struct stat *statbuf, bool include_shared);
+bool has_text_extension(const char *name);
+bool is_excluded(const Options *options, const char *path, const char *name);
+bool is_scan_root(const Options *options, const char *path);
+bool skip_mount(const Options *options, int dir_fd, const char *name);
+bool is_pseudo_fs(unsigned long type);
+bool has_shared_object_name(const char *name);
+bool inspect_elf_file(int dir_fd, const char *name, uint64_t file_size, ElfInfo *info, bool want_paths);
+char *build_lib_pattern(const char *lib_search);
+void build_lib_matcher(LibMatcher *matcher, char **patterns, int count);
+int match_library(const LibMatcher *matcher, const char *lib_name);
+void free_lib_matcher(LibMatcher *matcher);
+bool get_dependencies(Worker *worker, const char *file_path, const ElfInfo *info);
+void record_scanned_elf(Worker *worker, const char *file_path, const ElfInfo *info);
+void copy_elf_info(ElfInfo *dst, const ElfInfo *src, Arena *arena);
+void init_dedupe_table(DedupeTable *table, size_t limit);
+uint64_t dedupe_skipped(const DedupeTable *table);
+size_t elf_info_size(const ElfInfo *info);
+size_t match_budget(const Options *options);
+void free_dedupe_table(DedupeTable *table);
+DedupeStripe *dedupe_stripe(DedupeTable *table, const DedupeKey *key, uint32_t *slot);
+bool dedupe_lookup(DedupeTable *table, const DedupeKey *key, ElfInfo *info, bool *is_elf);
+void dedupe_insert(DedupeTable *table, const DedupeKey *key, const ElfInfo *info, bool is_elf);
+void resolve_transitive(ScanPool *pool);
+int resolve_soname(Resolver *r, const ElfInfo *from, const char *origin, const char *inherited, uint32_t context, const char *soname);
+int load_shared_object(Resolver *r, const char *path, const ElfInfo *from, uint32_t context);
+void object_origin(const char *path, char *origin);
+void append_search_path(char *out, size_t out_size, size_t *len, const char *list, const char *origin, const char *sysroot);
+uint32_t intern_context(Resolver *r, const char *search_path);
+void compute_closures(Resolver *r, const LibMatcher *matcher);
+const char *multiarch_triplet(const ElfInfo *info);
+bool load_ld_cache(LdCache *cache, const char *sysroot);
+void unload_ld_cache(LdCache *cache);
+bool node_equals(uint32_t value, const void *key);
+bool resolve_key_equals(uint32_t value, const void *key);
+bool context_equals(uint32_t value, const void *key);
+bool ld_cache_name_equals(uint32_t value, const void *key);
+void free_elf_info(ElfInfo *info);
+bool parse_elf_header(const unsigned char *buf, size_t len, ElfHeader *hdr);
+bool read_elf_needed(ElfFile *ef, ElfInfo *info, bool want_paths);
+const unsigned char *elf_view(ElfFile *ef, uint64_t offset, uint64_t len);
+void close_elf_file(ElfFile *ef);
+void release_elf_views(ElfFile *ef);
+bool inspect_elf_head(ElfFile *ef, ElfInfo *info, bool want_paths);
+void scan_elf_file(Worker *worker, char *path, size_t dir_len, const char *name, ElfInfo *info, uint64_t start_ns);
+uint64_t clock_ns(clockid_t clock);
+void phase_start(Phase phase);
+void phase_stop(Phase phase);
+int latency_bucket(uint64_t ns);
+uint64_t latency_bucket_limit(int bucket);
+void record_latency(ScanStats *stats, uint64_t start_ns);
+void add_scan_stats(ScanStats *total, const ScanStats *stats);
+uint64_t latency_percentile(const ScanStats *stats, double fraction);
+void print_stats(const Options *options);
+const ArchInfo *elf_arch(uint16_t machine, unsigned char elf_class, unsigned char data);
+const char *elf_arch_name(uint16_t machine, unsigned char elf_class, unsigned char data);
+const char *elf_kind_name(unsigned char kind);
+uint16_t elf_u16(const ElfHeader *hdr, const unsigned char *p);
+uint32_t elf_u32(const ElfHeader *hdr, const unsigned char *p);
+uint64_t elf_u64(const ElfHeader *hdr, const unsigned char *p);
+uint64_t elf_word(const ElfHeader *hdr, const unsigned char *p);
 int find_or_add_architecture(const char *arch);
 int find_or_add_library(int arch_index, const char *lib_name);
-void add_executable(int arch_index, int lib_index, const char *exec_path);
+void add_executable(int arch_index, int lib_index, const char *exec_path, unsigned char kind);
+uint32_t intern_path(const char *path);
+uint32_t path_dir(const char *path, const char **base, bool add);
+uint32_t intern_dir(const char *dir, size_t len, bool add);
+size_t add_path_name(const char *name, size_t len);
+const char *path_at(uint32_t id, char *buf);
+const char *pool_path(const PathPool *pool, uint32_t id, char *buf);
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed);
+uint64_t hash_mix(uint64_t x);
+uint32_t hash_index_find(const HashIndex *index, uint64_t hash, HashKeyEquals equals, const void *key);
+void hash_index_insert(HashIndex *index, uint64_t hash, uint32_t value);
+bool key_set_add(KeySet *set, uint64_t key);
+bool key_set_has(const KeySet *set, uint64_t key);
+void key_set_remove(KeySet *set, uint64_t key);
+uint32_t find_path(const char *path);
+bool arch_equals(uint32_t value, const void *key);
+bool library_equals(uint32_t value, const void *key);
+bool path_equals(uint32_t value, const void *key);
+bool dir_equals(uint32_t value, const void *key);
+void *xrealloc(void *ptr, size_t size);
+char *xstrdup(const char *s);
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strdup(Arena *arena, const char *s);
+void arena_free(Arena *arena);
+void build_report_order(void);
+int compare_architectures(const void *a, const void *b);
+int compare_libraries(const void *a, const void *b);
+int compare_paths(const void *a, const void *b);
+void rank_paths(void);
+int compare_siblings(const void *a, const void *b);
+const PathNode *path_node(uint32_t id);
+void open_execs(ExecCursor *cursor, const Library *lib);
+bool next_exec(ExecCursor *cursor, const char **path, unsigned char *kind);
+void close_execs(ExecCursor *cursor);
 void generate_txt_report(Options *options);
 void generate_pdf_report(Options *options);
+void generate_json_report(Options *options);
+void generate_bin_report(Options *options);
+bool write_bin_report(const char *output_file, uint32_t flags);
+void write_report_image(FILE *fp, uint32_t flags);
+const char *json_escape(char **buf, size_t *cap, const char *s);
+void write_report_column(FILE *fp, const void *data, size_t size);
 void cleanup();
+#if IO_URING_SUPPORT
+bool uring_init(Uring *ring);
+void uring_exit(Uring *ring);
+struct io_uring_sqe *uring_sqe(Uring *ring, UringFile *file, UringState state, uint8_t opcode);
+void uring_add_file(Worker *worker, const char *name);
+void uring_run(Worker *worker, unsigned wait);
+void uring_complete(Worker *worker, UringFile *file, int res);
+void uring_drain(Worker *worker);
+#endif
 #if PDF_SUPPORT
 void error_handler(HPDF_STATUS error_no, HPDF_STATUS detail_no, void *user_data);
+void pdf_new_page(PdfWriter *w);
+void pdf_text(PdfWriter *w, HPDF_Font font, float size, float x, float y, const char *text);
+bool pdf_path_fits(const PdfWriter *w, const char *path, float max_width);
 #endif
 
 int main(int argc, char *argv[]) {
@@ -78,26 +1131,63 @@ int main(int argc, char *argv[]) {
     
     // Initialize
     memset(&options, 0, sizeof(Options));
-    memset(archs, 0, sizeof(archs));
     
     // Parse command line arguments
     parse_arguments(argc, argv, &options);
+    progress_out = options.stream_format != STREAM_NONE ? stderr : stdout;
+    stats_enabled = options.stats;
+    
+    // Directories are watched as they are read, so nothing changes unseen
+    if (options.watch) {
+        watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch_fd == -1) {
+            fprintf(stderr, "Error: Cannot watch for changes: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
     
-    // Scan the directory
-    scan_directory(options.dir, &options);
+    // Scan the directory, or answer from an index or from partial reports
+    if (options.query_path[0]) {
+        phase_start(PHASE_SCAN);
+        query_index(&options);
+        phase_stop(PHASE_SCAN);
+    } else if (options.merge_count > 0) {
+        phase_start(PHASE_SCAN);
+        merge_reports(&options);
+        phase_stop(PHASE_SCAN);
+    } else {
+        scan_directory(&options);
+    }
     
-    // Generate reports
-    if (options.txt_format) {
-        generate_txt_report(&options);
+    // None of these has results before the end, so those are streamed afterwards
+    if (options.stream_format != STREAM_NONE &&
+        (options.query_path[0] || options.merge_count > 0 || options.transitive)) {
+        phase_start(PHASE_ORDER);
+        build_report_order();
+        phase_stop(PHASE_ORDER);
+        phase_start(PHASE_REPORT);
+        stream_results(options.stream_format, options.include_shared);
     }
     
-    if (options.pdf_format) {
-        generate_pdf_report(&options);
+    // An index served without --lib has no report of its own
+    if (options.lib_count > 0 || !options.query_path[0]) {
+        write_results(&options);
+    }
+    if (options.serve_path[0]) {
+        start_server(&options);
+    }
+    if (options.watch) {
+        watch_tree(&options);
+    } else if (options.serve_path[0]) {
+        wait_for_stop();
+    }
+    if (options.serve_path[0]) {
+        stop_server(&options);
     }
     
-    // Display summary
-    printf("Summary: Found %d executables across %d architectures\n", 
-           total_execs, arch_count);
+    if (options.stats) {
+        print_stats(&options);
+    }
     
     // Cleanup
     cleanup();
@@ -105,26 +1195,92 @@ int main(int argc, char *argv[]) {
     // Free allocated memory for libraries
     for (int i = 0; i < options.lib_count; i++) {
         free(options.libs[i]);
+        free(options.lib_patterns[i]);
     }
     free(options.libs);
+    free(options.lib_patterns);
+    free_lib_matcher(&options.matcher);
+    for (int i = 0; i < options.dir_count; i++) {
+        free(options.dirs[i]);
+    }
+    free(options.dirs);
+    for (int i = 0; i < options.exclude_count; i++) {
+        free(options.excludes[i]);
+    }
+    free(options.excludes);
+    for (int i = 0; i < options.merge_count; i++) {
+        free(options.merge_paths[i]);
+    }
+    free(options.merge_paths);
+    free(thread_stats);
     
     return 0;
 }
 
+// Write the reports, or the index, for the results in archs[] and print the
+// summary; streamed records replace the reports. Called once more after
+// every batch of changes with --watch.
+void write_results(Options *options) {
+    if (options->index_path[0]) {
+        phase_start(PHASE_ORDER);
+        build_report_order();
+        phase_stop(PHASE_ORDER);
+        phase_start(PHASE_REPORT);
+        if (write_bin_report(options->index_path, options->include_shared ? REPORT_SHARED : 0)) {
+            printf("Index saved to %s\n", options->index_path);
+        }
+        printf("Summary: Indexed %d libraries used by %d executables across %d architectures\n",
+               index_library_count(), (int)report_path_count, sorted_arch_count);
+        if (serve_fd != -1) {
+            publish_snapshot(snapshot_results(options->include_shared ? REPORT_SHARED : 0));
+        }
+    } else if (options->stream_format != STREAM_NONE) {
+        fprintf(progress_out, "Summary: Streamed %ld records for %d executables\n",
+                streamed_records, total_execs);
+    } else {
+        phase_start(PHASE_ORDER);
+        build_report_order();
+        phase_stop(PHASE_ORDER);
+        phase_start(PHASE_REPORT);
+        
+        if (options->txt_format) {
+            generate_txt_report(options);
+        }
+        
+        if (options->pdf_format) {
+            generate_pdf_report(options);
+        }
+        
+        if (options->json_format) {
+            generate_json_report(options);
+        }
+        
+        if (options->bin_format) {
+            generate_bin_report(options);
+        }
+        
+        printf("Summary: Found %d executables across %d architectures\n", 
+               total_execs, sorted_arch_count);
+        if (serve_fd != -1) {
+            publish_snapshot(snapshot_results(options->include_shared ? REPORT_SHARED : 0));
+        }
+    }
+    phase_stop(PHASE_REPORT);
+}
+
 void parse_arguments(int argc, char *argv[], Options *options) {
     int i;
-    bool dir_set = false;
+    bool sysroot_set = false;
     
-    // Allocate memory for library names
-    options->libs = (char **)malloc(MAX_LIBS * sizeof(char *));
-    if (!options->libs) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
-    }
+    int lib_cap = 0;
+    int dir_cap = 0;
+    int exclude_cap = 0;
+    bool format_set = false;
     
     // Default values
     options->txt_format = true;
     options->pdf_format = false;
+    options->jobs = 1;
     strcpy(options->output, "bldd_report");
     
     // Check for at least one argument
@@ -140,34 +1296,77 @@ void parse_arguments(int argc, char *argv[], Options *options) {
             exit(0);
         } else if (strcmp(argv[i], "--lib") == 0 || strcmp(argv[i], "-l") == 0) {
             if (i + 1 < argc) {
-                options->libs[options->lib_count] = strdup(argv[++i]);
+                if (options->lib_count == lib_cap) {
+                    lib_cap = lib_cap ? lib_cap * 2 : 16;
+                    options->libs = xrealloc(options->libs, lib_cap * sizeof(char *));
+                }
+                options->libs[options->lib_count] = xstrdup(argv[++i]);
                 options->lib_count++;
             } else {
                 fprintf(stderr, "Error: --lib requires a library name\n");
                 exit(1);
             }
         } else if (strcmp(argv[i], "--dir") == 0 || strcmp(argv[i], "-d") == 0) {
-            if (i + 1 < argc) {
-                strcpy(options->dir, argv[++i]);
-                dir_set = true;
+            if (i + 1 < argc && argv[i + 1][0] != '\0') {
+                size_t len = strlen(argv[++i]);
+                
+                if (options->dir_count == dir_cap) {
+                    dir_cap = dir_cap ? dir_cap * 2 : 8;
+                    options->dirs = xrealloc(options->dirs, dir_cap * sizeof(char *));
+                }
+                if (len + 1 > MAX_PATH) {
+                    fprintf(stderr, "Error: Directory path too long: %s\n", argv[i]);
+                    exit(1);
+                }
+                // Kept without trailing slashes like --sysroot, so every path
+                // below a root, "/" included, has one slash per component and
+                // --exclude globs see it as written
+                while (len > 0 && argv[i][len - 1] == '/') {
+                    len--;
+                }
+                options->dirs[options->dir_count] = xrealloc(NULL, len + 1);
+                memcpy(options->dirs[options->dir_count], argv[i], len);
+                options->dirs[options->dir_count++][len] = '\0';
             } else {
                 fprintf(stderr, "Error: --dir requires a directory path\n");
                 exit(1);
             }
         } else if (strcmp(argv[i], "--format") == 0 || strcmp(argv[i], "-f") == 0) {
             if (i + 1 < argc) {
-                i++;
-                if (strcmp(argv[i], "txt") == 0) {
-                    options->txt_format = true;
-                    options->pdf_format = false;
-                } else if (strcmp(argv[i], "pdf") == 0) {
-                    options->txt_format = false;
-                    options->pdf_format = true;
-                } else if (strcmp(argv[i], "both") == 0) {
-                    options->txt_format = true;
-                    options->pdf_format = true;
-                } else {
-                    fprintf(stderr, "Error: Unknown format: %s\n", argv[i]);
+                // A comma-separated list selects several reports at once
+                const char *format = argv[++i];
+                
+                format_set = true;
+                options->txt_format = false;
+                options->pdf_format = false;
+                options->json_format = false;
+                options->bin_format = false;
+                while (*format) {
+                    size_t len = strcspn(format, ",");
+                    
+                    if (len == 3 && strncmp(format, "txt", 3) == 0) {
+                        options->txt_format = true;
+                    } else if (len == 3 && strncmp(format, "pdf", 3) == 0) {
+                        options->pdf_format = true;
+                    } else if (len == 4 && strncmp(format, "both", 4) == 0) {
+                        options->txt_format = true;
+                        options->pdf_format = true;
+                    } else if (len == 4 && strncmp(format, "json", 4) == 0) {
+                        options->json_format = true;
+                    } else if (len == 3 && strncmp(format, "bin", 3) == 0) {
+                        options->bin_format = true;
+                    } else {
+                        fprintf(stderr, "Error: Unknown format: %.*s\n", (int)len, format);
+                        exit(1);
+                    }
+                    format += len;
+                    if (*format == ',') {
+                        format++;
+                    }
+                }
+                if (!options->txt_format && !options->pdf_format &&
+                    !options->json_format && !options->bin_format) {
+                    fprintf(stderr, "Error: --format requires a format type\n");
                     exit(1);
                 }
             } else {
@@ -181,6 +1380,178 @@ void parse_arguments(int argc, char *argv[], Options *options) {
                 fprintf(stderr, "Error: --output requires a filename\n");
                 exit(1);
             }
+        } else if (strcmp(argv[i], "--cache") == 0 || strcmp(argv[i], "-c") == 0) {
+            if (i + 1 < argc) {
+                if (strlen(argv[++i]) + 5 > MAX_PATH) {  // 5 = ".tmp\0"
+                    fprintf(stderr, "Error: Cache file name too long\n");
+                    exit(1);
+                }
+                strcpy(options->cache_path, argv[i]);
+            } else {
+                fprintf(stderr, "Error: --cache requires a file name\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--stream") == 0 || strcmp(argv[i], "-s") == 0) {
+            if (i + 1 < argc) {
+                i++;
+                if (strcmp(argv[i], "ndjson") == 0) {
+                    options->stream_format = STREAM_NDJSON;
+                } else if (strcmp(argv[i], "tsv") == 0) {
+                    options->stream_format = STREAM_TSV;
+                } else {
+                    fprintf(stderr, "Error: Unknown stream format: %s\n", argv[i]);
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr, "Error: --stream requires a record format\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--build-index") == 0 || strcmp(argv[i], "-b") == 0 ||
+                   strcmp(argv[i], "--query") == 0 || strcmp(argv[i], "-q") == 0) {
+            bool build = argv[i][1] == 'b' || argv[i][2] == 'b';
+            
+            if (i + 1 < argc) {
+                if (strlen(argv[++i]) + 1 > MAX_PATH) {
+                    fprintf(stderr, "Error: Index file name too long\n");
+                    exit(1);
+                }
+                strcpy(build ? options->index_path : options->query_path, argv[i]);
+            } else {
+                fprintf(stderr, "Error: %s requires a file name\n", build ? "--build-index" : "--query");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--mem-limit") == 0) {
+            if (i + 1 < argc) {
+                char *end;
+                unsigned long long limit = strtoull(argv[++i], &end, 10);
+                int shift = 0;
+                
+                if (*end == 'K' || *end == 'k') {
+                    shift = 10;
+                } else if (*end == 'M' || *end == 'm') {
+                    shift = 20;
+                } else if (*end == 'G' || *end == 'g') {
+                    shift = 30;
+                }
+                if (shift) {
+                    end++;
+                }
+                if (end == argv[i] || *end != '\0' || limit == 0 || limit > (SIZE_MAX >> shift)) {
+                    fprintf(stderr, "Error: Invalid --mem-limit: %s\n", argv[i]);
+                    exit(1);
+                }
+                options->mem_limit = (size_t)limit << shift;
+            } else {
+                fprintf(stderr, "Error: --mem-limit requires a size\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--exclude") == 0) {
+            if (i + 1 < argc) {
+                if (options->exclude_count == exclude_cap) {
+                    exclude_cap = exclude_cap ? exclude_cap * 2 : 8;
+                    options->excludes = xrealloc(options->excludes, exclude_cap * sizeof(char *));
+                }
+                options->excludes[options->exclude_count++] = xstrdup(argv[++i]);
+            } else {
+                fprintf(stderr, "Error: --exclude requires a pattern\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--shard") == 0) {
+            if (i + 1 < argc) {
+                char *end;
+                unsigned long index = strtoul(argv[++i], &end, 10);
+                unsigned long count = *end == '/' ? strtoul(end + 1, &end, 10) : 0;
+                
+                if (*end != '\0' || index < 1 || count < 1 || index > count || count > UINT32_MAX) {
+                    fprintf(stderr, "Error: --shard must be i/N with 1 <= i <= N: %s\n", argv[i]);
+                    exit(1);
+                }
+                options->shard_index = (uint32_t)index - 1;
+                options->shard_count = (uint32_t)count;
+            } else {
+                fprintf(stderr, "Error: --shard requires i/N\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--merge") == 0) {
+            // Every argument up to the next option is a partial report
+            while (i + 1 < argc && argv[i + 1][0] != '-') {
+                options->merge_paths = xrealloc(options->merge_paths, (options->merge_count + 1) * sizeof(char *));
+                options->merge_paths[options->merge_count++] = xstrdup(argv[++i]);
+            }
+            if (options->merge_count == 0) {
+                fprintf(stderr, "Error: --merge requires at least one report file\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--one-filesystem") == 0) {
+            options->one_filesystem = true;
+        } else if (strcmp(argv[i], "--dedupe-content") == 0) {
+            options->dedupe_content = true;
+        } else if (strcmp(argv[i], "--fast-reject") == 0) {
+            options->fast_reject = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            options->stats = true;
+        } else if (strcmp(argv[i], "--include-shared") == 0) {
+            options->include_shared = true;
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            options->watch = true;
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            if (i + 1 < argc) {
+                if (strlen(argv[++i]) >= sizeof(options->serve_path)) {
+                    fprintf(stderr, "Error: Socket path too long\n");
+                    exit(1);
+                }
+                strcpy(options->serve_path, argv[i]);
+            } else {
+                fprintf(stderr, "Error: --serve requires a socket path\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--transitive") == 0 || strcmp(argv[i], "-t") == 0) {
+            options->transitive = true;
+        } else if (strcmp(argv[i], "--sysroot") == 0) {
+            if (i + 1 < argc) {
+                size_t len = strlen(argv[++i]);
+                
+                if (len + 1 > MAX_PATH) {
+                    fprintf(stderr, "Error: Sysroot path too long\n");
+                    exit(1);
+                }
+                // Kept without trailing slashes, so "/" is the same as no sysroot
+                while (len > 0 && argv[i][len - 1] == '/') {
+                    len--;
+                }
+                memcpy(options->sysroot, argv[i], len);
+                options->sysroot[len] = '\0';
+                sysroot_set = true;
+            } else {
+                fprintf(stderr, "Error: --sysroot requires a directory path\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--device-jobs") == 0) {
+            if (i + 1 < argc) {
+                char *end;
+                long jobs = strtol(argv[++i], &end, 10);
+                if (*end != '\0' || jobs < 1 || jobs > MAX_JOBS) {
+                    fprintf(stderr, "Error: --device-jobs must be between 1 and %d\n", MAX_JOBS);
+                    exit(1);
+                }
+                options->device_jobs = (int)jobs;
+            } else {
+                fprintf(stderr, "Error: --device-jobs requires a thread count\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--jobs") == 0 || strcmp(argv[i], "-j") == 0) {
+            if (i + 1 < argc) {
+                char *end;
+                long jobs = strtol(argv[++i], &end, 10);
+                if (*end != '\0' || jobs < 1 || jobs > MAX_JOBS) {
+                    fprintf(stderr, "Error: --jobs must be between 1 and %d\n", MAX_JOBS);
+                    exit(1);
+                }
+                options->jobs = (int)jobs;
+            } else {
+                fprintf(stderr, "Error: --jobs requires a thread count\n");
+                exit(1);
+            }
         } else {
             fprintf(stderr, "Error: Unknown option: %s\n", argv[i]);
             print_help();
@@ -189,24 +1560,140 @@ void parse_arguments(int argc, char *argv[], Options *options) {
     }
     
     // Check required options
-    if (options->lib_count == 0) {
-        fprintf(stderr, "Error: At least one library must be specified with --lib\n");
+    if (options->index_path[0] && options->query_path[0]) {
+        fprintf(stderr, "Error: --build-index and --query cannot be combined\n");
         exit(1);
     }
     
-    if (!dir_set) {
-        fprintf(stderr, "Error: Scan directory must be specified with --dir\n");
-        exit(1);
+    // A partial is a bin report unless other formats were asked for
+    if (options->shard_count > 0) {
+        if (options->merge_count > 0 || options->query_path[0] || options->watch) {
+            fprintf(stderr, "Error: --shard cannot be combined with %s\n",
+                    options->merge_count > 0 ? "--merge" : options->query_path[0] ? "--query" : "--watch");
+            exit(1);
+        }
+        if (!format_set) {
+            options->txt_format = false;
+            options->bin_format = true;
+        }
     }
-    
-    // Verify the directory exists
-    DIR *dir = opendir(options->dir);
-    if (dir == NULL) {
-        fprintf(stderr, "Error: Cannot open directory %s: %s\n", 
-                options->dir, strerror(errno));
-        exit(1);
+    if (options->merge_count > 0) {
+        const char *other = options->query_path[0] ? "--query" :
+                            options->dir_count > 0 ? "--dir" :
+                            options->transitive ? "--transitive" :
+                            options->watch ? "--watch" :
+                            options->mem_limit ? "--mem-limit" : NULL;
+        
+        if (other != NULL) {
+            fprintf(stderr, "Error: --merge cannot be combined with %s\n", other);
+            exit(1);
+        }
     }
-    closedir(dir);
+    
+    if (sysroot_set && !options->transitive) {
+        fprintf(stderr, "Error: --sysroot requires --transitive\n");
+        exit(1);
+    }
+    if (options->watch && (options->query_path[0] || options->stream_format != STREAM_NONE || options->transitive)) {
+        fprintf(stderr, "Error: --watch cannot be combined with %s\n",
+                options->query_path[0] ? "--query" : options->transitive ? "--transitive" : "--stream");
+        exit(1);
+    }
+    if (options->serve_path[0] && !options->watch && !options->query_path[0]) {
+        fprintf(stderr, "Error: --serve requires --watch or --query\n");
+        exit(1);
+    }
+    if (options->serve_path[0] && options->stream_format != STREAM_NONE) {
+        fprintf(stderr, "Error: --serve cannot be combined with --stream\n");
+        exit(1);
+    }
+    if (options->mem_limit > 0) {
+        // Only the txt and json writers read matches back from the runs
+        const char *other = options->index_path[0] ? "--build-index" :
+                            options->query_path[0] ? "--query" :
+                            options->stream_format != STREAM_NONE ? "--stream" :
+                            options->transitive ? "--transitive" :
+                            options->watch ? "--watch" :
+                            options->pdf_format ? "--format pdf" :
+                            options->bin_format ? "--format bin" : NULL;
+        
+        if (other != NULL) {
+            fprintf(stderr, "Error: --mem-limit cannot be combined with %s\n", other);
+            exit(1);
+        }
+        if (match_budget(options) / options->jobs < SPILL_MIN_BUFFER) {
+            fprintf(stderr, "Error: --mem-limit must leave at least %d KiB for each of the --jobs threads\n",
+                    SPILL_MIN_BUFFER / 1024);
+            exit(1);
+        }
+    }
+    if (options->transitive && (options->index_path[0] || options->query_path[0])) {
+        fprintf(stderr, "Error: --transitive cannot be combined with %s\n",
+                options->index_path[0] ? "--build-index" : "--query");
+        exit(1);
+    }
+    
+    if (options->index_path[0]) {
+        // The index holds every library, so there is nothing to select
+        if (options->lib_count > 0) {
+            fprintf(stderr, "Error: --lib cannot be combined with --build-index\n");
+            exit(1);
+        }
+        if (options->stream_format != STREAM_NONE) {
+            fprintf(stderr, "Error: --stream cannot be combined with --build-index\n");
+            exit(1);
+        }
+    } else if (options->lib_count == 0 && !(options->query_path[0] && options->serve_path[0]) &&
+               options->merge_count == 0) {
+        // Serving an index answers any library, and merging keeps every
+        // library of the partials; --lib only adds a report or narrows it
+        fprintf(stderr, "Error: At least one library must be specified with --lib\n");
+        exit(1);
+    }
+    
+    if (options->query_path[0]) {
+        if (options->dir_count > 0) {
+            fprintf(stderr, "Error: --dir cannot be combined with --query\n");
+            exit(1);
+        }
+    } else if (options->dir_count == 0 && options->merge_count == 0) {
+        fprintf(stderr, "Error: Scan directory must be specified with --dir\n");
+        exit(1);
+    }
+    
+    // Normalize the library names once and compile them into one matcher
+    options->lib_patterns = xrealloc(NULL, options->lib_count * sizeof(char *));
+    for (i = 0; i < options->lib_count; i++) {
+        options->lib_patterns[i] = build_lib_pattern(options->libs[i]);
+    }
+    build_lib_matcher(&options->matcher, options->lib_patterns, options->lib_count);
+    
+    // Verify the directories exist. A root given twice, under any name,
+    // would list everything below it twice.
+    struct stat *roots = xrealloc(NULL, (options->dir_count + 1) * sizeof(struct stat));
+    int root_count = 0;
+    for (i = 0; i < options->dir_count; i++) {
+        DIR *dir = opendir(dir_open_path(options->dirs[i]));
+        bool seen = false;
+        
+        if (dir == NULL || fstat(dirfd(dir), &roots[root_count]) == -1) {
+            fprintf(stderr, "Error: Cannot open directory %s: %s\n", 
+                    dir_open_path(options->dirs[i]), strerror(errno));
+            exit(1);
+        }
+        closedir(dir);
+        
+        for (int r = 0; r < root_count && !seen; r++) {
+            seen = roots[r].st_dev == roots[root_count].st_dev && roots[r].st_ino == roots[root_count].st_ino;
+        }
+        if (seen) {
+            free(options->dirs[i]);
+            continue;
+        }
+        options->dirs[root_count++] = options->dirs[i];
+    }
+    options->dir_count = root_count;
+    free(roots);
 }
 
 void print_help() {
@@ -215,252 +1702,5240 @@ void print_help() {
     printf("Options:\n");
     printf("  -h, --help                 Show this help message and exit\n");
     printf("  -l, --lib LIB              Shared library to search for (can be specified multiple times)\n");
-    printf("  -d, --dir DIR              Directory to scan for executables\n");
-    printf("  -f, --format FORMAT        Output report format (txt, pdf, both) (default: txt)\n");
+    printf("  -d, --dir DIR              Directory to scan for executables (can be specified multiple times)\n");
+    printf("  -f, --format FORMAT        Output report format (txt, pdf, both, json, bin) (default: txt)\n");
+    printf("                             several formats can be given as a comma-separated list\n");
     printf("  -o, --output FILENAME      Output file name without extension (default: bldd_report)\n");
+    printf("  -j, --jobs N               Number of scan threads (default: 1)\n");
+    printf("      --device-jobs N        Threads reading one device at a time (default: 2 for spinning\n");
+    printf("                             disks, 4 for network file systems, otherwise --jobs)\n");
+    printf("  -c, --cache FILE           Reuse and update a scan cache to skip unchanged files\n");
+    printf("      --fast-reject          Skip files named like scripts or text (.sh, .py, .conf ...)\n");
+    printf("                             without opening them\n");
+    printf("      --dedupe-content       Reuse the libraries of a file with the same size, program\n");
+    printf("                             headers and dynamic section instead of reading them again\n");
+    printf("      --include-shared       Also scan shared objects (*.so*) without an execute bit, and\n");
+    printf("                             tag every file as exec, pie or shared in the report\n");
+    printf("      --watch                Stay running after the scan and rewrite the reports or the\n");
+    printf("                             index as files below --dir change, until interrupted\n");
+    printf("      --serve SOCKET         With --watch or --query, answer library lookups on a Unix\n");
+    printf("                             socket until interrupted (--lib is optional with --query)\n");
+    printf("      --one-filesystem       Do not descend into directories on another file system\n");
+    printf("                             than the --dir they are found below\n");
+    printf("      --exclude GLOB         Skip files and directories matching GLOB; a GLOB with a /\n");
+    printf("                             is matched against the full path, otherwise the name\n");
+    printf("                             (can be specified multiple times)\n");
+    printf("      --shard i/N            Scan only the i-th of N parts of each --dir, split by the\n");
+    printf("                             names of its entries, and write a bin report by default\n");
+    printf("      --merge FILE...        Combine bin reports, such as those of every --shard, into\n");
+    printf("                             one report instead of scanning (--lib is optional)\n");
+    printf("      --mem-limit SIZE       Keep at most SIZE bytes of matches and hardlink/content reuse\n");
+    printf("                             tables in memory (K, M or G suffix), sorting the other\n");
+    printf("                             matches in files below $TMPDIR\n");
+    printf("      --stats                Print phase timings, scan counters and per-file latency\n");
+    printf("                             percentiles when done\n");
+    printf("  -s, --stream FORMAT        Write matches to stdout as they are found (ndjson, tsv)\n");
+    printf("                             instead of writing a report\n");
+    printf("  -b, --build-index FILE     Record every library used by every executable under --dir\n");
+    printf("                             in FILE instead of matching --lib\n");
+    printf("  -q, --query FILE           Answer --lib from an index made by --build-index instead\n");
+    printf("                             of scanning a directory\n");
+    printf("  -t, --transitive           Also match libraries loaded indirectly, through other libraries\n");
+    printf("      --sysroot DIR          Resolve --transitive dependencies below DIR instead of /\n");
     printf("\nExamples:\n");
     printf("  bldd --lib libc.so.6 --dir /usr/bin --format txt\n");
     printf("  bldd --lib libpthread.so --lib libm.so --dir /usr/local/bin\n");
     printf("  bldd --lib libc.so.6 --dir /home --format pdf\n");
+    printf("  bldd --lib libc.so.6 --dir /usr --format txt,json,bin\n");
+    printf("  bldd --lib libcrypto.so --dir /usr/lib --dir /usr/bin --include-shared\n");
+    printf("  bldd --lib libssl.so --dir / --jobs 32\n");
+    printf("  bldd --lib libssl.so --dir / --one-filesystem --exclude '/home/*/.cache' --exclude .git\n");
+    printf("  bldd --lib libssl.so --dir /mnt/image1 --dir /mnt/image2 --jobs 16 --device-jobs 4\n");
+    printf("  bldd --lib libssl.so --dir /srv/images --cache /var/cache/bldd.cache\n");
+    printf("  bldd --lib libc.so.6 --dir / --jobs 8 --mem-limit 128M --format txt,json\n");
+    printf("  bldd --lib libssl.so --dir /srv/store --shard 3/16 --output part3\n");
+    printf("  bldd --merge part*.bin --format txt,pdf --output store\n");
+    printf("  bldd --lib libz.so --dir / --stream ndjson | jq -r .path\n");
+    printf("  bldd --dir /srv/image --build-index image.idx\n");
+    printf("  bldd --dir /srv/build/output --build-index live.idx --watch\n");
+    printf("  bldd --query image.idx --lib libssl.so.1.1 --stream tsv\n");
+    printf("  bldd --query image.idx --serve /run/bldd.sock\n");
+    printf("  bldd --lib libcrypto.so --dir /srv/image/usr/bin --transitive --sysroot /srv/image\n");
 }
 
-void scan_directory(const char *dir_path, Options *options) {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat statbuf;
-    char path[MAX_PATH];
-    int file_count = 0;
-    int matched_count = 0;
+// Scan every --dir root, see scan_roots()
+void scan_directory(Options *options) {
+    scan_roots(options, options->dirs, options->dir_count);
+}
+
+// Scan the trees below every root with options->jobs workers, then merge
+// every worker's matches into archs[]. All roots share the one pool, so a
+// worker that runs out of work in one tree steals from the others.
+void scan_roots(Options *options, char **roots, int root_count) {
+    ScanPool pool;
+    int jobs = options->jobs > 0 ? options->jobs : 1;
+    bool stream = options->stream_format != STREAM_NONE && !options->transitive;
     
-    printf("Scanning directory: %s\n", dir_path);
-    printf("Looking for executables using: ");
-    for (int i = 0; i < options->lib_count; i++) {
-        printf("%s ", options->libs[i]);
+    memset(&pool, 0, sizeof(pool));
+    pool.options = options;
+    pool.worker_count = jobs;
+    phase_start(PHASE_SCAN);
+    pool.workers = calloc(jobs, sizeof(Worker));
+    if (pool.workers == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
     }
-    printf("\n");
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle_cond, NULL);
+    pthread_mutex_init(&pool.stream_lock, NULL);
+    pthread_mutex_init(&pool.device_lock, NULL);
     
-    if ((dir = opendir(dir_path)) == NULL) {
-        fprintf(stderr, "Cannot open directory: %s\n", dir_path);
-        return;
+    // A single worker, or a limit no lower than --jobs, cannot oversubscribe anything
+    pool.throttled = jobs > 1 && (options->device_jobs == 0 || options->device_jobs < jobs);
+    
+    for (int i = 0; i < jobs; i++) {
+        pool.workers[i].id = i;
+        pool.workers[i].pool = &pool;
+        pthread_mutex_init(&pool.workers[i].queue.lock, NULL);
+#if IO_URING_SUPPORT
+        if (!uring_init(&pool.workers[i].ring) && i == 0) {
+            fprintf(stderr, "Warning: io_uring is not available, reading files synchronously\n");
+        }
+#endif
+        if (options->mem_limit) {
+            // Rounded down so the record pointers at the end stay aligned
+            pool.workers[i].spill.size = match_budget(options) / jobs / sizeof(char *) * sizeof(char *);
+            pool.workers[i].spill.data = xrealloc(NULL, pool.workers[i].spill.size);
+        }
+        if (stream) {
+            pool.workers[i].stream.data = xrealloc(NULL, STREAM_BUFFER_SIZE);
+            pool.workers[i].stream.format = options->stream_format;
+            pool.workers[i].stream.kinds = options->include_shared;
+            pool.workers[i].stream.lock = &pool.stream_lock;
+        }
     }
     
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip . and ..
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    init_dedupe_table(&pool.inodes, options->mem_limit / DEDUPE_LIMIT_SHARE);
+    if (options->dedupe_content) {
+        init_dedupe_table(&pool.contents, options->mem_limit / DEDUPE_LIMIT_SHARE);
+        content_table = &pool.contents;
+    }
+    
+    if (options->cache_path[0] && load_scan_cache(&pool.cache, options->cache_path)) {
+        fprintf(progress_out, "Loaded scan cache %s (%u files)\n", options->cache_path, pool.cache.header->entry_count);
+    }
+    
+    for (int i = 0; i < root_count; i++) {
+        push_directory(&pool.workers[i % jobs], xstrdup(roots[i]));
+    }
+    
+    // Worker 0 runs on the calling thread, so --jobs 1 spawns nothing
+    for (int i = 1; i < jobs; i++) {
+        if (pthread_create(&pool.workers[i].thread, NULL, scan_worker, &pool.workers[i]) != 0) {
+            fprintf(stderr, "Error: Cannot create scan thread: %s\n", strerror(errno));
+            exit(1);
         }
+    }
+    scan_worker(&pool.workers[0]);
+    for (int i = 1; i < jobs; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+    content_table = NULL;
+    scan_stats.reuse_skipped += dedupe_skipped(&pool.inodes);
+    free_dedupe_table(&pool.inodes);
+    if (options->dedupe_content) {
+        scan_stats.reuse_skipped += dedupe_skipped(&pool.contents);
+        free_dedupe_table(&pool.contents);
+    }
+    
+    if (options->cache_path[0]) {
+        save_scan_cache(&pool, options->cache_path);
+        unload_scan_cache(&pool.cache);
+    }
+    
+    // Merge per-worker results; this is the only place archs[] is written
+    thread_stats = xrealloc(thread_stats, jobs * sizeof(ScanStats));
+    thread_count = jobs;
+    int watch_failures = 0;
+    for (int i = 0; i < jobs; i++) {
+        Worker *w = &pool.workers[i];
         
-        // Construct full path
-        snprintf(path, MAX_PATH, "%s/%s", dir_path, entry->d_name);
+        if (options->mem_limit) {
+            write_spill_run(w);
+            free(w->spill.data);
+        }
         
-        // Get file status
-        if (lstat(path, &statbuf) == -1) {
-            continue;
+        thread_stats[i] = w->stats;
+        add_scan_stats(&scan_stats, &w->stats);
+        
+        merge_matches(w);
+        for (int d = 0; d < w->watch_count; d++) {
+            set_watch_dir(w->watches[d].wd, w->watches[d].path);
         }
+        watch_failures += w->watch_failures;
+        free(w->watches);
+        free(w->queue.dirs);
+        pthread_mutex_destroy(&w->queue.lock);
+#if IO_URING_SUPPORT
+        uring_exit(&w->ring);
+#endif
         
-        // If directory, recursively scan
-        if (S_ISDIR(statbuf.st_mode)) {
-            scan_directory(path, options);
-        } 
-        // If regular file, check if executable
-        else if (S_ISREG(statbuf.st_mode)) {
-            if (is_executable(path)) {
-                file_count++;
-                if (file_count % 100 == 0) {
-                    printf("Scanned %d executables so far, found %d matches\n", 
-                           file_count, matched_count);
-                }
-                
-                const char *arch = get_architecture(path);
-                if (strcmp(arch, "unknown") != 0) {
-                    get_dependencies(path, options->libs, options->lib_count, arch);
-                }
+        // Streamed matches were never recorded; only the tail is left to write
+        if (stream) {
+            flush_stream(&w->stream);
+            streamed_records += w->stream.records;
+            free(w->stream.data);
+            free(w->file_libs);
+        }
+    }
+    if (stream) {
+        total_execs = atomic_load(&pool.matched_count);
+    }
+    if (watch_failures > 0) {
+        fprintf(stderr, "Warning: Cannot watch %d directories, changes below them will be missed "
+                "(see fs.inotify.max_user_watches)\n", watch_failures);
+    }
+    phase_stop(PHASE_SCAN);
+    
+    if (options->mem_limit) {
+        phase_start(PHASE_MERGE);
+        merge_spilled_runs(&pool);
+        phase_stop(PHASE_MERGE);
+    }
+    
+    if (options->transitive) {
+        phase_start(PHASE_RESOLVE);
+        resolve_transitive(&pool);
+        phase_stop(PHASE_RESOLVE);
+    }
+    
+    pthread_mutex_destroy(&pool.idle_lock);
+    pthread_cond_destroy(&pool.idle_cond);
+    pthread_mutex_destroy(&pool.stream_lock);
+    pthread_mutex_destroy(&pool.device_lock);
+    for (int i = 0; i < pool.device_count; i++) {
+        free(pool.devices[i].deferred);
+    }
+    for (int i = 0; i < jobs; i++) {
+        arena_free(&pool.workers[i].arena);
+    }
+    free(pool.devices);
+    free(pool.workers);
+}
+
+// Move one worker's matches into archs[]
+void merge_matches(Worker *worker) {
+    Options *options = worker->pool->options;
+    
+    for (int m = 0; m < worker->match_count; m++) {
+        Match *match = &worker->matches[m];
+        int arch_index = find_or_add_architecture(match->arch);
+        int lib_index = find_or_add_library(arch_index,
+            match->soname ? match->soname : options->lib_patterns[match->lib]);
+        add_executable(arch_index, lib_index, match->path, match->kind);
+    }
+    free(worker->matches);
+    worker->matches = NULL;
+    worker->match_count = 0;
+    worker->match_cap = 0;
+}
+
+// Merge the runs every worker spilled under --mem-limit into merged_run,
+// SPILL_MERGE_WAYS at a time, then index it: archs[] gets each library
+// with its exec count and the offset of its first record, but no paths.
+void merge_spilled_runs(ScanPool *pool) {
+    FILE **runs = NULL;
+    int run_count = 0;
+    
+    for (int i = 0; i < pool->worker_count; i++) {
+        SpillBuffer *spill = &pool->workers[i].spill;
+        
+        runs = xrealloc(runs, (run_count + spill->run_count + 1) * sizeof(FILE *));
+        memcpy(runs + run_count, spill->runs, spill->run_count * sizeof(FILE *));
+        run_count += spill->run_count;
+        free(spill->runs);
+        free(spill->levels);
+        spill->runs = NULL;
+        spill->levels = NULL;
+        spill->run_count = 0;
+    }
+    
+    // Each pass cuts the run count by SPILL_MERGE_WAYS, so only a few are needed
+    while (run_count > 1) {
+        int merged = 0;
+        
+        for (int r = 0; r < run_count; r += SPILL_MERGE_WAYS) {
+            int ways = run_count - r < SPILL_MERGE_WAYS ? run_count - r : SPILL_MERGE_WAYS;
+            
+            runs[merged++] = ways > 1 ? merge_runs(runs + r, ways) : runs[r];
+        }
+        run_count = merged;
+        merge_passes++;
+    }
+    
+    if (run_count == 1) {
+        merged_run = runs[0];
+        index_merged_run(merged_run);
+    }
+    free(runs);
+}
+
+// Merge sorted runs into a new one, dropping repeated records. The inputs
+// are closed. A binary heap keeps the cursor with the smallest key on top.
+FILE *merge_runs(FILE **runs, int count) {
+    FILE *out = create_spill_file();
+    RunCursor *cursors = calloc(count, sizeof(RunCursor));
+    RunCursor **heap = xrealloc(NULL, count * sizeof(RunCursor *));
+    char *last = NULL;
+    uint32_t last_len = 0;
+    uint32_t last_cap = 0;
+    int heap_count = 0;
+    
+    if (cursors == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        cursors[i].fp = runs[i];
+        rewind(runs[i]);
+        if (read_run_record(&cursors[i])) {
+            heap[heap_count++] = &cursors[i];
+        }
+    }
+    for (int i = heap_count / 2 - 1; i >= 0; i--) {
+        sift_run_heap(heap, heap_count, i);
+    }
+    
+    while (heap_count > 0) {
+        RunCursor *top = heap[0];
+        
+        if (last == NULL || compare_keys(top->key, top->key_len, last, last_len) != 0) {
+            fwrite(&top->key_len, sizeof(uint32_t), 1, out);
+            fwrite(top->key, 1, top->key_len, out);
+            fputc(top->kind, out);
+            if (top->key_len > last_cap) {
+                last_cap = top->key_len;
+                last = xrealloc(last, last_cap);
+            }
+            memcpy(last, top->key, top->key_len);
+            last_len = top->key_len;
+        }
+        if (!read_run_record(top)) {
+            heap[0] = heap[--heap_count];
+        }
+        sift_run_heap(heap, heap_count, 0);
+    }
+    
+    if (fflush(out) != 0 || ferror(out)) {
+        fprintf(stderr, "Error: Cannot write spill file: %s\n", strerror(errno));
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        fclose(runs[i]);
+        free(cursors[i].key);
+    }
+    free(cursors);
+    free(heap);
+    free(last);
+    return out;
+}
+
+// Move heap[i] down until neither child has a smaller key
+void sift_run_heap(RunCursor **heap, int count, int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        
+        if (left < count && compare_keys(heap[left]->key, heap[left]->key_len,
+                                         heap[smallest]->key, heap[smallest]->key_len) < 0) {
+            smallest = left;
+        }
+        if (right < count && compare_keys(heap[right]->key, heap[right]->key_len,
+                                          heap[smallest]->key, heap[smallest]->key_len) < 0) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        RunCursor *tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// Count the records of every (arch, lib) group in the merged run. Groups
+// are contiguous and their paths already sorted and unique, so the report
+// writers only need where each one starts.
+void index_merged_run(FILE *run) {
+    RunCursor cursor;
+    Library *lib = NULL;
+    char *group = NULL;     // "arch\0lib\0" of the current group
+    size_t group_len = 0;
+    off_t offset = 0;
+    
+    memset(&cursor, 0, sizeof(cursor));
+    cursor.fp = run;
+    rewind(run);
+    while (read_run_record(&cursor)) {
+        const char *arch = cursor.key;
+        const char *lib_name = arch + strlen(arch) + 1;
+        size_t len = lib_name + strlen(lib_name) + 1 - cursor.key;
+        
+        if (lib == NULL || len != group_len || memcmp(cursor.key, group, len) != 0) {
+            int arch_index = find_or_add_architecture(arch);
+            int lib_index = find_or_add_library(arch_index, lib_name);
+            
+            lib = &archs[arch_index].libraries[lib_index];
+            lib->run_offset = offset;
+            group = xrealloc(group, len);
+            memcpy(group, cursor.key, len);
+            group_len = len;
+        }
+        lib->exec_count++;
+        total_execs++;
+        offset += sizeof(uint32_t) + cursor.key_len + 1;
+    }
+    free(group);
+    free(cursor.key);
+}
+
+// Read the next record of a run into the cursor. Returns false at its end.
+bool read_run_record(RunCursor *cursor) {
+    uint32_t len;
+    int kind;
+    
+    if (fread(&len, sizeof(len), 1, cursor->fp) != 1) {
+        if (ferror(cursor->fp)) {
+            fprintf(stderr, "Error: Cannot read spill file: %s\n", strerror(errno));
+            exit(1);
+        }
+        return false;
+    }
+    if (len > cursor->key_cap) {
+        cursor->key_cap = len;
+        cursor->key = xrealloc(cursor->key, len);
+    }
+    if (fread(cursor->key, 1, len, cursor->fp) != len || (kind = fgetc(cursor->fp)) == EOF) {
+        fprintf(stderr, "Error: Spill file is truncated\n");
+        exit(1);
+    }
+    cursor->key_len = len;
+    cursor->kind = (unsigned char)kind;
+    return true;
+}
+
+// Keep the results current after the first scan: follow the inotify
+// watches the scan left on every directory, collect changes until they
+// settle for WATCH_SETTLE_MS (or WATCH_MAX_DELAY_MS pass), then apply the
+// batch and write the reports or the index again. Runs until SIGINT or
+// SIGTERM.
+void watch_tree(Options *options) {
+    WatchBatch batch;
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int watched = 0;
+    
+    catch_stop_signals();
+    
+    // Rescans only see part of the tree; saving their cache would drop the rest
+    options->cache_path[0] = '\0';
+    
+    for (int wd = 0; wd < watch_dir_cap; wd++) {
+        watched += watch_dirs[wd] != NULL;
+    }
+    fprintf(progress_out, "Watching %d directories for changes, interrupt to stop\n", watched);
+    fflush(progress_out);
+    
+    memset(&batch, 0, sizeof(batch));
+    while (!stop_requested) {
+        struct pollfd pfd = { watch_fd, POLLIN, 0 };
+        int timeout = -1;
+    
+        if (batch.first_ns) {
+            uint64_t waited = (clock_ns(CLOCK_MONOTONIC) - batch.first_ns) / 1000000;
+    
+            timeout = WATCH_SETTLE_MS;
+            if (waited >= WATCH_MAX_DELAY_MS) {
+                timeout = 0;
+            } else if (WATCH_MAX_DELAY_MS - waited < WATCH_SETTLE_MS) {
+                timeout = (int)(WATCH_MAX_DELAY_MS - waited);
+            }
+        }
+    
+        int ready = poll(&pfd, 1, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: Cannot wait for changes: %s\n", strerror(errno));
+            exit(1);
+        }
+    
+        if (ready > 0) {
+            ssize_t len = read(watch_fd, buf, sizeof(buf));
+    
+            if (len == -1 && errno != EAGAIN && errno != EINTR) {
+                fprintf(stderr, "Error: Cannot read changes: %s\n", strerror(errno));
+                exit(1);
+            }
+            for (ssize_t off = 0; off < len; ) {
+                const struct inotify_event *event = (const struct inotify_event *)(buf + off);
+    
+                watch_event(&batch, event);
+                off += sizeof(struct inotify_event) + event->len;
+            }
+        }
+    
+        // A steady stream of events never lets poll() time out
+        if (batch.first_ns && (ready == 0 ||
+            clock_ns(CLOCK_MONOTONIC) - batch.first_ns >= WATCH_MAX_DELAY_MS * 1000000ULL)) {
+            apply_watch_batch(options, &batch);
+            fflush(stdout);
+            fflush(progress_out);
+        }
+    }
+    
+    fprintf(progress_out, "Stopped watching\n");
+    clear_watch_batch(&batch);
+    free(batch.changed);
+    free(batch.removed);
+    free(batch.added);
+    close(watch_fd);
+    watch_fd = -1;
+}
+
+// Add one inotify event to the batch
+void watch_event(WatchBatch *batch, const struct inotify_event *event) {
+    char path[MAX_PATH];
+    int wd = event->wd;
+    
+    if (event->mask & IN_Q_OVERFLOW) {
+        batch->overflow = true;
+        batch->first_ns = batch->first_ns ? batch->first_ns : clock_ns(CLOCK_MONOTONIC);
+        return;
+    }
+    
+    // Events still queued for a watch dropped by unwatch_tree() go too
+    if (wd < 0 || wd >= watch_dir_cap || watch_dirs[wd] == NULL) {
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        free(watch_dirs[wd]);
+        watch_dirs[wd] = NULL;
+        return;
+    }
+    
+    // A --dir root has no watched parent to report it deleted or renamed,
+    // so its own watch does. Below a root this repeats the parent's event.
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        snprintf(path, sizeof(path), "%s", watch_dirs[wd]);
+        append_string(&batch->removed, &batch->removed_count, &batch->removed_cap, path);
+        if (event->mask & IN_MOVE_SELF) {
+            unwatch_tree(path);
+        }
+        if (batch->first_ns == 0) {
+            batch->first_ns = clock_ns(CLOCK_MONOTONIC);
+        }
+        return;
+    }
+    
+    // Other nameless events are about the directory itself
+    if (event->len == 0 || snprintf(path, sizeof(path), "%s/%s", watch_dirs[wd], event->name) >= MAX_PATH) {
+        return;
+    }
+    
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            append_string(&batch->removed, &batch->removed_count, &batch->removed_cap, path);
+    
+            // A moved directory keeps its watches, under a path that is now wrong
+            if (event->mask & IN_MOVED_FROM) {
+                unwatch_tree(path);
+            }
+        } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            append_string(&batch->added, &batch->added_count, &batch->added_cap, path);
+        } else {
+            return;
+        }
+    } else {
+        // A file being written shows up as a run of events for the same name
+        if (batch->changed_count == 0 || strcmp(batch->changed[batch->changed_count - 1], path) != 0) {
+            append_string(&batch->changed, &batch->changed_count, &batch->changed_cap, path);
+        }
+    }
+    
+    if (batch->first_ns == 0) {
+        batch->first_ns = clock_ns(CLOCK_MONOTONIC);
+    }
+}
+
+// Bring archs[] up to date with a batch of changes: drop every path that
+// changed or was below a removed directory, classify the changed files
+// again, scan the added directories and write the results. After lost
+// events everything is dropped and every root is scanned again.
+void apply_watch_batch(Options *options, WatchBatch *batch) {
+    unsigned char *stale = xrealloc(NULL, path_pool.count + 1);
+    uint32_t *stale_ids = xrealloc(NULL, (path_pool.count + 1) * sizeof(uint32_t));
+    uint32_t stale_count = 0;
+    char **roots = xrealloc(NULL, (batch->added_count + 1) * sizeof(char *));
+    int root_count = 0;
+    
+    memset(stale, 0, path_pool.count + 1);
+    if (batch->overflow) {
+        fprintf(stderr, "Warning: Changes were lost, scanning everything again\n");
+        unwatch_tree("");
+        free(roots);
+        roots = options->dirs;
+        root_count = options->dir_count;
+        for (uint32_t id = 0; id < path_pool.count; id++) {
+            mark_stale(stale, stale_ids, &stale_count, id);
+        }
+    } else {
+        for (int i = 0; i < batch->changed_count; i++) {
+            uint32_t id = find_path(batch->changed[i]);
+    
+            if (id != HASH_EMPTY) {
+                mark_stale(stale, stale_ids, &stale_count, id);
+            }
+        }
+        
+        // The paths below a directory hold a range of ranks from the last report
+        for (int i = 0; i < batch->removed_count; i++) {
+            uint32_t dir = intern_dir(batch->removed[i], strlen(batch->removed[i]), false);
+            
+            if (dir == HASH_EMPTY) {
+                continue;
+            }
+            for (uint32_t r = dir_ranks[2 * dir]; r < dir_ranks[2 * dir + 1]; r++) {
+                mark_stale(stale, stale_ids, &stale_count, ranked_paths[r]);
+            }
+        }
+    
+        // Directories that are gone again, excluded, or below another added one, need no scan
+        for (int i = 0; i < batch->added_count; i++) {
+            struct stat st;
+            bool covered = lstat(batch->added[i], &st) == -1 || !S_ISDIR(st.st_mode) ||
+                           (options->exclude_count > 0 &&
+                            is_excluded(options, batch->added[i], strrchr(batch->added[i], '/') + 1));
+    
+            for (int j = 0; j < batch->added_count && !covered; j++) {
+                covered = j != i && path_below(batch->added[i], batch->added[j]) &&
+                          (strcmp(batch->added[i], batch->added[j]) != 0 || j < i);
+            }
+            if (!covered) {
+                roots[root_count++] = batch->added[i];
+            }
+        }
+    }
+    if (stale_count > 0) {
+        purge_stale_paths(stale, stale_ids, stale_count);
+    }
+    free(stale);
+    free(stale_ids);
+    
+    // The changed files are few; one worker on this thread classifies them
+    if (!batch->overflow && batch->changed_count > 0) {
+        ScanPool pool;
+        Worker worker;
+    
+        memset(&pool, 0, sizeof(pool));
+        memset(&worker, 0, sizeof(worker));
+        pool.options = options;
+        pool.workers = &worker;
+        pool.worker_count = 1;
+        worker.pool = &pool;
+        init_dedupe_table(&pool.inodes, 0);
+        for (int i = 0; i < batch->changed_count; i++) {
+            rescan_file(&worker, batch->changed[i]);
+        }
+        free_dedupe_table(&pool.inodes);
+        add_scan_stats(&scan_stats, &worker.stats);
+        merge_matches(&worker);
+        arena_free(&worker.arena);
+    }
+    if (root_count > 0) {
+        scan_roots(options, roots, root_count);
+    }
+    
+    fprintf(progress_out, "Changes: %d files, %d directories added, %d removed%s\n",
+            batch->changed_count, batch->added_count, batch->removed_count,
+            batch->overflow ? ", events lost" : "");
+    write_results(options);
+    
+    if (!batch->overflow) {
+        free(roots);
+    }
+    clear_watch_batch(batch);
+}
+
+// Free the paths in a batch and empty it, keeping the lists for reuse
+void clear_watch_batch(WatchBatch *batch) {
+    for (int i = 0; i < batch->changed_count; i++) {
+        free(batch->changed[i]);
+    }
+    for (int i = 0; i < batch->removed_count; i++) {
+        free(batch->removed[i]);
+    }
+    for (int i = 0; i < batch->added_count; i++) {
+        free(batch->added[i]);
+    }
+    batch->changed_count = 0;
+    batch->removed_count = 0;
+    batch->added_count = 0;
+    batch->overflow = false;
+    batch->first_ns = 0;
+}
+
+// Classify one file named by a --watch event, the way scan_one_directory()
+// would have, and record its matches in the worker
+void rescan_file(Worker *worker, const char *path) {
+    Options *options = worker->pool->options;
+    const char *slash = strrchr(path, '/');
+    char buf[MAX_PATH];
+    struct stat statbuf;
+    ElfInfo info;
+    
+    if (slash == NULL || strlen(path) >= MAX_PATH) {
+        return;
+    }
+    
+    size_t dir_len = slash - path + 1;
+    const char *name = slash + 1;
+    if (options->exclude_count > 0 && is_excluded(options, path, name)) {
+        return;
+    }
+    memcpy(buf, path, dir_len);
+    buf[dir_len] = '\0';
+    
+    int dir_fd = open(buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
+        return;
+    }
+    
+    uint64_t start = options->stats ? clock_ns(CLOCK_MONOTONIC) : 0;
+    if (fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(statbuf.st_mode) &&
+        !(options->fast_reject && has_text_extension(name)) &&
+        is_executable(dir_fd, name, &statbuf, options->include_shared) &&
+        classify_file(worker, dir_fd, name, &statbuf, &info)) {
+        scan_elf_file(worker, buf, dir_len, name, &info, start);
+    }
+    close(dir_fd);
+}
+
+// Drop every executable whose path is marked in stale[], and listed in
+// ids[], from the libraries that have it. A library is only looked at if
+// it holds one of the ids, found through exec_set when there are fewer ids
+// than executables in it. The paths stay interned, so a file that comes
+// back gets its old id, and libraries left empty stay in archs[]:
+// build_report_order() leaves them out of the reports.
+void purge_stale_paths(const unsigned char *stale, const uint32_t *ids, uint32_t id_count) {
+    for (int a = 0; a < arch_count; a++) {
+        for (int l = 0; l < archs[a].lib_count; l++) {
+            Library *lib = &archs[a].libraries[l];
+            uint64_t uid = (uint64_t)lib->uid << 32;
+            bool listed = (uint32_t)lib->exec_count <= id_count;
+            int kept = 0;
+    
+            for (uint32_t i = 0; i < id_count && !listed; i++) {
+                listed = key_set_has(&exec_set, uid | ids[i]);
+            }
+            if (!listed) {
+                continue;
+            }
+            for (int e = 0; e < lib->exec_count; e++) {
+                uint32_t id = lib->execs[e];
+    
+                if (stale[id]) {
+                    key_set_remove(&exec_set, uid | id);
+                    total_execs--;
+                } else {
+                    lib->execs[kept++] = id;
+                }
+            }
+            lib->exec_count = kept;
+        }
+    }
+}
+
+void mark_stale(unsigned char *stale, uint32_t *ids, uint32_t *id_count, uint32_t id) {
+    if (!stale[id]) {
+        stale[id] = 1;
+        ids[(*id_count)++] = id;
+    }
+}
+
+// Watch a directory a worker is about to read. The watch descriptor is
+// kept with the worker and handed to watch_dirs[] when the scan merges.
+void add_watch(Worker *worker, const char *dir_path) {
+    int wd = inotify_add_watch(watch_fd, dir_open_path(dir_path), WATCH_MASK);
+    
+    if (wd == -1) {
+        worker->watch_failures++;
+        return;
+    }
+    if (worker->watch_count == worker->watch_cap) {
+        worker->watch_cap = worker->watch_cap ? worker->watch_cap * 2 : 64;
+        worker->watches = xrealloc(worker->watches, worker->watch_cap * sizeof(WatchDir));
+    }
+    worker->watches[worker->watch_count].wd = wd;
+    worker->watches[worker->watch_count].path = xstrdup(dir_path);
+    worker->watch_count++;
+}
+
+// Record the directory of a watch descriptor, taking ownership of path. A
+// directory watched twice gets the same descriptor back, and the newer path.
+void set_watch_dir(int wd, char *path) {
+    if (wd >= watch_dir_cap) {
+        int old_cap = watch_dir_cap;
+    
+        while (wd >= watch_dir_cap) {
+            watch_dir_cap = watch_dir_cap ? watch_dir_cap * 2 : 1024;
+        }
+        watch_dirs = xrealloc(watch_dirs, watch_dir_cap * sizeof(char *));
+        memset(watch_dirs + old_cap, 0, (watch_dir_cap - old_cap) * sizeof(char *));
+    }
+    free(watch_dirs[wd]);
+    watch_dirs[wd] = path;
+}
+
+// Stop watching dir_path and every directory below it; "" stops them all
+void unwatch_tree(const char *dir_path) {
+    for (int wd = 0; wd < watch_dir_cap; wd++) {
+        if (watch_dirs[wd] != NULL && (dir_path[0] == '\0' || path_below(watch_dirs[wd], dir_path))) {
+            inotify_rm_watch(watch_fd, wd);
+            free(watch_dirs[wd]);
+            watch_dirs[wd] = NULL;
+        }
+    }
+}
+
+// The root directory is kept as "", the prefix of the paths below it
+const char *dir_open_path(const char *dir_path) {
+    return dir_path[0] ? dir_path : "/";
+}
+
+// True if path is dir_path itself or anything below it
+bool path_below(const char *path, const char *dir_path) {
+    size_t len = strlen(dir_path);
+    
+    return strncmp(path, dir_path, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+void append_string(char ***list, int *count, int *cap, const char *s) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+        *list = xrealloc(*list, *cap * sizeof(char *));
+    }
+    (*list)[(*count)++] = xstrdup(s);
+}
+
+void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+// Turn SIGINT and SIGTERM into stop_requested. SA_RESTART is left out so
+// that a blocked poll() or sigsuspend() returns and sees it.
+void catch_stop_signals(void) {
+    struct sigaction sa;
+    
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+// Serve lookups on options->serve_path from whatever snapshot is current:
+// the mapped --query index, or the results of the last --watch batch. Each
+// of the SERVE_THREADS threads polls the listening socket and its own
+// clients, so a slow or idle client only holds up the ones on its thread,
+// and none of them ever takes a lock.
+void start_server(Options *options) {
+    struct sockaddr_un addr;
+    struct stat st;
+    sigset_t block, old;
+    size_t len = strlen(options->serve_path);
+    
+    if (len >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long: %s\n", options->serve_path);
+        exit(1);
+    }
+    
+    // A socket left behind by an earlier server is replaced, anything else is not
+    if (lstat(options->serve_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(options->serve_path);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, options->serve_path, len + 1);
+    serve_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (serve_fd == -1 || bind(serve_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(serve_fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "Error: Cannot listen on %s: %s\n", options->serve_path, strerror(errno));
+        exit(1);
+    }
+    
+    if (atomic_load(&current_snapshot) == NULL) {
+        publish_snapshot(snapshot_results(options->include_shared ? REPORT_SHARED : 0));
+    }
+    
+    // SIGINT and SIGTERM are left to the main thread, which waits for them
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    serve_threads = calloc(SERVE_THREADS, sizeof(ServeThread));
+    if (serve_threads == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < SERVE_THREADS; i++) {
+        if (pthread_create(&serve_threads[i].thread, NULL, serve_worker, &serve_threads[i]) != 0) {
+            fprintf(stderr, "Error: Cannot create server thread: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    fprintf(progress_out, "Serving lookups on %s\n", options->serve_path);
+    fflush(progress_out);
+}
+
+void stop_server(Options *options) {
+    atomic_store(&serve_stop, true);
+    for (int i = 0; i < SERVE_THREADS; i++) {
+        pthread_join(serve_threads[i].thread, NULL);
+        free(serve_threads[i].clients);
+        free(serve_threads[i].fds);
+        free(serve_threads[i].hits);
+        free(serve_threads[i].reply);
+    }
+    free(serve_threads);
+    serve_threads = NULL;
+    close(serve_fd);
+    serve_fd = -1;
+    unlink(options->serve_path);
+    
+    // No reader is left, so every snapshot can go
+    free_snapshot(atomic_exchange(&current_snapshot, NULL));
+    while (retired_snapshots != NULL) {
+        Snapshot *next = retired_snapshots->next;
+        free_snapshot(retired_snapshots);
+        retired_snapshots = next;
+    }
+}
+
+// Block until SIGINT or SIGTERM, for a server with nothing else to do
+void wait_for_stop(void) {
+    sigset_t block, old;
+    
+    catch_stop_signals();
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    while (!stop_requested) {
+        sigsuspend(&old);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void *serve_worker(void *arg) {
+    ServeThread *self = arg;
+    
+    while (!atomic_load(&serve_stop)) {
+        int nfds = self->client_count + 1;
+        
+        if (nfds > self->fd_cap) {
+            self->fd_cap = nfds * 2;
+            self->fds = xrealloc(self->fds, self->fd_cap * sizeof(struct pollfd));
+        }
+        self->fds[0].fd = serve_fd;
+        self->fds[0].events = POLLIN;
+        for (int c = 0; c < self->client_count; c++) {
+            self->fds[c + 1].fd = self->clients[c].fd;
+            self->fds[c + 1].events = POLLIN;
+        }
+        
+        // The timeout is only there to notice stop_server()
+        if (poll(self->fds, nfds, SERVE_POLL_MS) <= 0) {
+            continue;
+        }
+        
+        // Backwards, so a dropped client's slot is taken by one already done
+        for (int c = self->client_count - 1; c >= 0; c--) {
+            if (self->fds[c + 1].revents != 0 && !serve_client(self, &self->clients[c])) {
+                close(self->clients[c].fd);
+                self->clients[c] = self->clients[--self->client_count];
+            }
+        }
+        
+        // Every thread wakes up for a new connection; one of them gets it
+        if (self->fds[0].revents & POLLIN) {
+            int fd = accept(serve_fd, NULL, NULL);
+            struct timeval timeout = { SERVE_SEND_TIMEOUT_S, 0 };
+            
+            if (fd == -1) {
+                continue;
+            }
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            if (self->client_count == self->client_cap) {
+                self->client_cap = self->client_cap ? self->client_cap * 2 : 16;
+                self->clients = xrealloc(self->clients, self->client_cap * sizeof(ServeClient));
+            }
+            self->clients[self->client_count].fd = fd;
+            self->clients[self->client_count].len = 0;
+            self->client_count++;
+        }
+    }
+    
+    for (int c = 0; c < self->client_count; c++) {
+        close(self->clients[c].fd);
+    }
+    return NULL;
+}
+
+// Read what a client sent and answer every complete line in it, in one
+// reply. Returns false once the client is to be dropped.
+bool serve_client(ServeThread *self, ServeClient *client) {
+    ssize_t n = recv(client->fd, client->buf + client->len, sizeof(client->buf) - client->len, 0);
+    
+    if (n <= 0) {
+        return n == -1 && errno == EINTR;
+    }
+    client->len += n;
+    self->reply_len = 0;
+    
+    char *start = client->buf;
+    char *end = client->buf + client->len;
+    char *newline;
+    while ((newline = memchr(start, '\n', end - start)) != NULL) {
+        *newline = '\0';
+        if (newline > start && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        answer_lookup(self, start);
+        start = newline + 1;
+    }
+    client->len = end - start;
+    memmove(client->buf, start, client->len);
+    
+    bool keep = client->len < sizeof(client->buf);
+    if (!keep) {
+        reply_append(self, "error\trequest too long\n", STREAM_NONE);
+    }
+    
+    // Sent in full or not at all; a client that stops reading is dropped
+    for (size_t done = 0; done < self->reply_len; ) {
+        ssize_t sent = send(client->fd, self->reply + done, self->reply_len - done, MSG_NOSIGNAL);
+        
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        done += sent;
+    }
+    return keep;
+}
+
+// Append the answer to one request to the thread's reply: the executables
+// using any library that --lib lib_search would have matched, grouped by
+// architecture and listed once each, in name order:
+//
+//   arch <TAB> x86_64 <TAB> 2
+//   <TAB> /usr/bin/curl [<TAB> kind]
+//   <TAB> /usr/bin/wget [<TAB> kind]
+//   end <TAB> 2
+//
+// Paths are escaped like --stream tsv; kinds are added for snapshots taken
+// with --include-shared.
+void answer_lookup(ServeThread *self, const char *lib_search) {
+    char line[64];
+    
+    if (lib_search[0] == '\0') {
+        reply_append(self, "error\tempty library name\n", STREAM_NONE);
+        return;
+    }
+    
+    // Published before the snapshot is loaded, see reclaim_snapshots()
+    atomic_store(&self->epoch, atomic_load(&snapshot_epoch));
+    const Snapshot *snap = atomic_load(&current_snapshot);
+    const ReportHeader *hdr = (const ReportHeader *)snap->data;
+    const char *base = snap->data;
+    const uint64_t *arch_name = (const uint64_t *)(base + hdr->arch_name_offset);
+    const uint32_t *arch_libs = (const uint32_t *)(base + hdr->arch_libs_offset);
+    const uint64_t *lib_name = (const uint64_t *)(base + hdr->lib_name_offset);
+    const uint32_t *lib_execs = (const uint32_t *)(base + hdr->lib_execs_offset);
+    const uint32_t *exec_path = (const uint32_t *)(base + hdr->exec_path_offset);
+    const uint64_t *path_string = (const uint64_t *)(base + hdr->path_string_offset);
+    const uint8_t *path_kind = (const uint8_t *)(base + hdr->path_kind_offset);
+    const char *strings = base + hdr->strings_offset;
+    
+    // One pattern needs no automaton: match_library() is a substring search too
+    char *pattern = build_lib_pattern(lib_search);
+    uint32_t total = 0;
+    
+    for (uint32_t a = 0; a < hdr->arch_count; a++) {
+        int hit_count = 0;
+        
+        for (uint32_t l = arch_libs[a]; l < arch_libs[a + 1]; l++) {
+            if (strstr(strings + lib_name[l], pattern) == NULL) {
+                continue;
+            }
+            for (uint32_t e = lib_execs[l]; e < lib_execs[l + 1]; e++) {
+                if (hit_count == self->hit_cap) {
+                    self->hit_cap = self->hit_cap ? self->hit_cap * 2 : 256;
+                    self->hits = xrealloc(self->hits, self->hit_cap * sizeof(ServeHit));
+                }
+                self->hits[hit_count].path = strings + path_string[exec_path[e]];
+                self->hits[hit_count].kind = path_kind[exec_path[e]];
+                hit_count++;
+            }
+        }
+        if (hit_count == 0) {
+            continue;
+        }
+        
+        // A path using several matching libraries is listed once
+        qsort(self->hits, hit_count, sizeof(ServeHit), compare_hits);
+        int unique = 0;
+        for (int h = 0; h < hit_count; h++) {
+            if (unique == 0 || strcmp(self->hits[unique - 1].path, self->hits[h].path) != 0) {
+                self->hits[unique++] = self->hits[h];
+            }
+        }
+        
+        reply_append(self, "arch\t", STREAM_NONE);
+        reply_append(self, strings + arch_name[a], STREAM_NONE);
+        snprintf(line, sizeof(line), "\t%d\n", unique);
+        reply_append(self, line, STREAM_NONE);
+        for (int h = 0; h < unique; h++) {
+            reply_append(self, "\t", STREAM_NONE);
+            reply_append(self, self->hits[h].path, STREAM_TSV);
+            if (hdr->flags & REPORT_SHARED) {
+                reply_append(self, "\t", STREAM_NONE);
+                reply_append(self, elf_kind_name(self->hits[h].kind), STREAM_NONE);
+            }
+            reply_append(self, "\n", STREAM_NONE);
+        }
+        total += unique;
+    }
+    atomic_store(&self->epoch, 0);
+    
+    snprintf(line, sizeof(line), "end\t%u\n", total);
+    reply_append(self, line, STREAM_NONE);
+    free(pattern);
+}
+
+// Append s to the thread's reply, escaped for format unless that is STREAM_NONE
+void reply_append(ServeThread *self, const char *s, StreamFormat format) {
+    size_t len = strlen(s);
+    size_t need = self->reply_len + (format ? 2 * len : len);
+    
+    if (need > self->reply_cap) {
+        self->reply_cap = need > 2 * self->reply_cap ? need : 2 * self->reply_cap;
+        self->reply = xrealloc(self->reply, self->reply_cap);
+    }
+    if (format) {
+        self->reply_len += stream_escape(self->reply + self->reply_len, s, format);
+    } else {
+        memcpy(self->reply + self->reply_len, s, len);
+        self->reply_len += len;
+    }
+}
+
+int compare_hits(const void *a, const void *b) {
+    return strcmp(((const ServeHit *)a)->path, ((const ServeHit *)b)->path);
+}
+
+// Take a snapshot of archs[] in report order, in the ReportHeader layout,
+// so the server reads watch results with the same code as a mapped index
+Snapshot *snapshot_results(uint32_t flags) {
+    Snapshot *snap = xrealloc(NULL, sizeof(Snapshot));
+    char *data = NULL;
+    FILE *fp;
+    
+    memset(snap, 0, sizeof(*snap));
+    fp = open_memstream(&data, &snap->size);
+    if (fp == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    write_report_image(fp, flags);
+    if (ferror(fp) | fclose(fp)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    snap->data = data;
+    return snap;
+}
+
+// Make snap the one new lookups read. The one it replaces is retired with
+// the epoch it stopped being current at and freed once no reader can still
+// be using it. Only the main thread publishes.
+void publish_snapshot(Snapshot *snap) {
+    Snapshot *old = atomic_exchange(&current_snapshot, snap);
+    uint64_t epoch = atomic_fetch_add(&snapshot_epoch, 1) + 1;
+    
+    if (old != NULL) {
+        old->retired = epoch;
+        old->next = retired_snapshots;
+        retired_snapshots = old;
+    }
+    reclaim_snapshots();
+}
+
+// Free the retired snapshots no lookup can still be reading. A lookup
+// stores the epoch before it loads the snapshot, so one that stored epoch e
+// can only hold snapshots still current at e, which are those retired after
+// e. Anything retired at or before the oldest epoch in use is unreachable.
+void reclaim_snapshots(void) {
+    uint64_t oldest = UINT64_MAX;
+    
+    for (int i = 0; serve_threads != NULL && i < SERVE_THREADS; i++) {
+        uint64_t epoch = atomic_load(&serve_threads[i].epoch);
+        
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    
+    Snapshot **link = &retired_snapshots;
+    while (*link != NULL) {
+        Snapshot *snap = *link;
+        
+        if (snap->retired <= oldest) {
+            *link = snap->next;
+            free_snapshot(snap);
+        } else {
+            link = &snap->next;
+        }
+    }
+}
+
+void free_snapshot(Snapshot *snap) {
+    if (snap == NULL) {
+        return;
+    }
+    if (snap->mapped) {
+        munmap((void *)snap->data, snap->size);
+    } else {
+        free((void *)snap->data);
+    }
+    free(snap);
+}
+
+// Answer the --lib patterns from an index written by --build-index. Every
+// soname in it goes through the same matcher a scan uses, so the results
+// are what a scan of the indexed tree would have found, and the tree itself
+// is never touched.
+void query_index(Options *options) {
+    size_t size;
+    const ReportHeader *hdr = map_report(options->query_path, "index", &size);
+    
+    // Kinds are only worth showing if the indexed scan looked at libraries too
+    if (hdr->flags & REPORT_SHARED) {
+        options->include_shared = true;
+    }
+    
+    fprintf(progress_out, "Querying index %s (%u libraries, %u executables)\n",
+            options->query_path, hdr->lib_count, hdr->path_count);
+    add_report_results(options, hdr);
+    
+    // --serve answers from the mapped index itself
+    if (options->serve_path[0]) {
+        Snapshot *snap = xrealloc(NULL, sizeof(Snapshot));
+        
+        memset(snap, 0, sizeof(*snap));
+        snap->data = (void *)hdr;
+        snap->size = size;
+        snap->mapped = true;
+        publish_snapshot(snap);
+    } else {
+        munmap((void *)hdr, size);
+    }
+}
+
+// Combine the bin reports of a --shard scan, or any others, into archs[].
+// An executable found by two of them is listed once.
+void merge_reports(Options *options) {
+    for (int i = 0; i < options->merge_count; i++) {
+        size_t size;
+        const ReportHeader *hdr = map_report(options->merge_paths[i], "report", &size);
+        
+        if (hdr->flags & REPORT_SHARED) {
+            options->include_shared = true;
+        }
+        fprintf(progress_out, "Merging report %s (%u libraries, %u executables)\n",
+                options->merge_paths[i], hdr->lib_count, hdr->path_count);
+        add_report_results(options, hdr);
+        munmap((void *)hdr, size);
+    }
+}
+
+// Map a bin report or index and check it, exiting if it is not one
+const ReportHeader *map_report(const char *path, const char *what, size_t *size) {
+    struct stat st;
+    int fd;
+    
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Error: Cannot open %s %s: %s\n", what, path, strerror(errno));
+        exit(1);
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ReportHeader)) {
+        fprintf(stderr, "Error: %s is not a bldd %s\n", path, what);
+        exit(1);
+    }
+    
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map %s %s: %s\n", what, path, strerror(errno));
+        exit(1);
+    }
+    
+    if (!report_index_valid(map, st.st_size)) {
+        fprintf(stderr, "Error: %s is not a bldd %s\n", path, what);
+        exit(1);
+    }
+    *size = st.st_size;
+    return map;
+}
+
+// Add the executables of every library in a mapped report that matches
+// --lib, under the --lib name, or of every library under its own name when
+// no --lib was given
+void add_report_results(Options *options, const ReportHeader *hdr) {
+    const char *base = (const char *)hdr;
+    const uint64_t *arch_name = (const uint64_t *)(base + hdr->arch_name_offset);
+    const uint32_t *arch_libs = (const uint32_t *)(base + hdr->arch_libs_offset);
+    const uint64_t *lib_name = (const uint64_t *)(base + hdr->lib_name_offset);
+    const uint32_t *lib_execs = (const uint32_t *)(base + hdr->lib_execs_offset);
+    const uint32_t *exec_path = (const uint32_t *)(base + hdr->exec_path_offset);
+    const uint64_t *path_string = (const uint64_t *)(base + hdr->path_string_offset);
+    const uint8_t *path_kind = (const uint8_t *)(base + hdr->path_kind_offset);
+    const char *strings = base + hdr->strings_offset;
+    
+    for (uint32_t a = 0; a < hdr->arch_count; a++) {
+        int arch_index = -1;
+        
+        for (uint32_t l = arch_libs[a]; l < arch_libs[a + 1]; l++) {
+            const char *name = strings + lib_name[l];
+            
+            if (options->lib_count > 0) {
+                int lib = match_library(&options->matcher, name);
+                
+                if (lib < 0) {
+                    continue;
+                }
+                name = options->lib_patterns[lib];
+            }
+            if (arch_index < 0) {
+                arch_index = find_or_add_architecture(strings + arch_name[a]);
+            }
+            
+            int lib_index = find_or_add_library(arch_index, name);
+            for (uint32_t e = lib_execs[l]; e < lib_execs[l + 1]; e++) {
+                add_executable(arch_index, lib_index, strings + path_string[exec_path[e]], path_kind[exec_path[e]]);
+            }
+        }
+    }
+}
+
+// Check that every offset and index in a mapped index stays inside it, so
+// query_index() can use the columns without further checks
+bool report_index_valid(const ReportHeader *hdr, size_t size) {
+    const char *base = (const char *)hdr;
+    
+    if (memcmp(hdr->magic, REPORT_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != REPORT_VERSION || hdr->byte_order != REPORT_BYTE_ORDER) {
+        return false;
+    }
+    
+    // Each column must be aligned and end before the string table, which
+    // runs to the end of the file and ends with a NUL
+    struct { uint64_t offset; uint64_t count; size_t width; } columns[] = {
+        { hdr->arch_name_offset, hdr->arch_count, sizeof(uint64_t) },
+        { hdr->arch_libs_offset, (uint64_t)hdr->arch_count + 1, sizeof(uint32_t) },
+        { hdr->lib_name_offset, hdr->lib_count, sizeof(uint64_t) },
+        { hdr->lib_execs_offset, (uint64_t)hdr->lib_count + 1, sizeof(uint32_t) },
+        { hdr->exec_path_offset, hdr->exec_count, sizeof(uint32_t) },
+        { hdr->path_string_offset, hdr->path_count, sizeof(uint64_t) },
+        { hdr->path_kind_offset, hdr->path_count, sizeof(uint8_t) },
+    };
+    if (hdr->strings_offset > size || size - hdr->strings_offset != hdr->strings_size ||
+        (hdr->strings_size > 0 && base[size - 1] != '\0')) {
+        return false;
+    }
+    for (size_t c = 0; c < sizeof(columns) / sizeof(columns[0]); c++) {
+        if (columns[c].offset % 8 != 0 || columns[c].offset < sizeof(ReportHeader) ||
+            columns[c].offset > hdr->strings_offset ||
+            columns[c].count > (hdr->strings_offset - columns[c].offset) / columns[c].width) {
+            return false;
+        }
+    }
+    
+    const uint64_t *arch_name = (const uint64_t *)(base + hdr->arch_name_offset);
+    const uint32_t *arch_libs = (const uint32_t *)(base + hdr->arch_libs_offset);
+    const uint64_t *lib_name = (const uint64_t *)(base + hdr->lib_name_offset);
+    const uint32_t *lib_execs = (const uint32_t *)(base + hdr->lib_execs_offset);
+    const uint32_t *exec_path = (const uint32_t *)(base + hdr->exec_path_offset);
+    const uint64_t *path_string = (const uint64_t *)(base + hdr->path_string_offset);
+    const uint8_t *path_kind = (const uint8_t *)(base + hdr->path_kind_offset);
+    const char *strings = base + hdr->strings_offset;
+    
+    if (arch_libs[0] != 0 || arch_libs[hdr->arch_count] != hdr->lib_count ||
+        lib_execs[0] != 0 || lib_execs[hdr->lib_count] != hdr->exec_count) {
+        return false;
+    }
+    for (uint32_t a = 0; a < hdr->arch_count; a++) {
+        // Architecture names must fit Architecture.name to be looked up again
+        if (arch_libs[a] > arch_libs[a + 1] || arch_name[a] >= hdr->strings_size ||
+            strnlen(strings + arch_name[a], sizeof(archs[0].name)) == sizeof(archs[0].name)) {
+            return false;
+        }
+    }
+    for (uint32_t l = 0; l < hdr->lib_count; l++) {
+        if (lib_execs[l] > lib_execs[l + 1] || lib_name[l] >= hdr->strings_size) {
+            return false;
+        }
+    }
+    for (uint32_t e = 0; e < hdr->exec_count; e++) {
+        if (exec_path[e] >= hdr->path_count) {
+            return false;
+        }
+    }
+    for (uint32_t p = 0; p < hdr->path_count; p++) {
+        if (path_string[p] >= hdr->strings_size || path_kind[p] > ELF_KIND_SHARED) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+int index_library_count(void) {
+    int count = 0;
+    
+    for (int a = 0; a < sorted_arch_count; a++) {
+        count += sorted_archs[a]->sorted_count;
+    }
+    return count;
+}
+
+// Stream the results already in archs[], in report order, for --query and
+// --transitive
+void stream_results(StreamFormat format, bool kinds) {
+    StreamBuffer stream;
+    
+    memset(&stream, 0, sizeof(stream));
+    stream.data = xrealloc(NULL, STREAM_BUFFER_SIZE);
+    stream.format = format;
+    stream.kinds = kinds;
+    
+    for (int a = 0; a < sorted_arch_count; a++) {
+        Architecture *arch = sorted_archs[a];
+        
+        for (int l = 0; l < arch->sorted_count; l++) {
+            Library *lib = arch->sorted[l];
+            ExecCursor execs;
+            const char *path;
+            unsigned char kind;
+            
+            open_execs(&execs, lib);
+            while (next_exec(&execs, &path, &kind)) {
+                stream_match(&stream, arch->name, lib->name, path, kind);
+            }
+            close_execs(&execs);
+        }
+    }
+    
+    flush_stream(&stream);
+    streamed_records = stream.records;
+    free(stream.data);
+}
+
+void *scan_worker(void *arg) {
+    Worker *worker = (Worker *)arg;
+    ScanPool *pool = worker->pool;
+    char *dir_path;
+    uint64_t cpu_start = pool->options->stats ? clock_ns(CLOCK_THREAD_CPUTIME_ID) : 0;
+    
+    for (;;) {
+        unsigned long generation = atomic_load(&pool->generation);
+        
+        if (!pop_directory(worker, &dir_path) && !steal_directory(worker, &dir_path)) {
+            // Nothing would send what is buffered while the worker sleeps
+            if (worker->stream.len > 0) {
+                flush_stream(&worker->stream);
+            }
+            if (!wait_for_work(pool, generation)) {
+                break;
+            }
+            continue;
+        }
+        
+        scan_one_directory(worker, dir_path);
+        free(dir_path);
+        if (worker->stream.data != NULL) {
+            flush_stream_if_due(&worker->stream);
+        }
+        
+        // The last directory to finish wakes everybody up so they can exit
+        if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+            pthread_mutex_lock(&pool->idle_lock);
+            pthread_cond_broadcast(&pool->idle_cond);
+            pthread_mutex_unlock(&pool->idle_lock);
+        }
+    }
+    
+    if (pool->options->stats) {
+        worker->stats.cpu_ns += clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+    }
+    return NULL;
+}
+
+// Read one directory: inspect its files and queue its subdirectories.
+// Entries are opened and stat'ed relative to the directory descriptor, and
+// d_type lets directories and special files go by without any stat at all;
+// only file systems that report DT_UNKNOWN pay for an fstatat() per entry.
+// Full paths are only put together for subdirectories and ELF files.
+void scan_one_directory(Worker *worker, const char *dir_path) {
+    Options *options = worker->pool->options;
+    DIR *dir;
+    int dir_fd;
+    struct dirent *entry;
+    struct stat statbuf;
+    char path[MAX_PATH];
+    size_t dir_len;
+    char **subdirs = NULL;
+    int subdir_count = 0, subdir_cap = 0;
+    int slot = -1;
+    dev_t dir_dev = 0;
+    bool mounts = false;
+    bool shard = options->shard_count > 1 && is_scan_root(options, dir_path);
+    ScanStats *stats = &worker->stats;
+    bool timed = options->stats;
+    uint64_t dir_start = timed ? clock_ns(CLOCK_MONOTONIC) : 0;
+    uint64_t busy_start = stats->classify_ns + stats->match_ns + stats->wait_ns;
+    
+    dir_fd = open(dir_open_path(dir_path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1 || (dir = fdopendir(dir_fd)) == NULL) {
+        fprintf(stderr, "Cannot open directory: %s\n", dir_open_path(dir_path));
+        if (dir_fd != -1) {
+            close(dir_fd);
+        }
+        return;
+    }
+    
+    // Wait for a turn on the device, without holding up this worker
+    if (worker->pool->throttled && !acquire_device(worker, dir_fd, dir_path, &slot)) {
+        closedir(dir);
+        return;
+    }
+    
+    fprintf(progress_out, "Scanning directory: %s\n", dir_open_path(dir_path));
+    fprintf(progress_out, "Looking for executables using: ");
+    for (int i = 0; i < options->lib_count; i++) {
+        fprintf(progress_out, "%s ", options->libs[i]);
+    }
+    fprintf(progress_out, "\n");
+    
+    // Watched before it is read, so nothing created meanwhile is missed
+    if (watch_fd != -1) {
+        add_watch(worker, dir_path);
+    }
+    
+    // Subdirectories on another device are mount points, checked before they are queued
+    if (fstat(dir_fd, &statbuf) == 0) {
+        dir_dev = statbuf.st_dev;
+        mounts = true;
+    }
+    
+    stats->dirs++;
+    
+    // Every path below shares the directory prefix
+    dir_len = strlen(dir_path);
+    if (dir_len + 2 > MAX_PATH) {
+        closedir(dir);
+        release_device(worker, slot);
+        return;
+    }
+    memcpy(path, dir_path, dir_len);
+    path[dir_len++] = '/';
+    
+#if IO_URING_SUPPORT
+    bool ring = worker->ring.fd != -1;
+    worker->ring.dir_fd = dir_fd;
+    worker->ring.path = path;
+    worker->ring.dir_len = dir_len;
+#else
+    bool ring = false;
+#endif
+    
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        unsigned char type = entry->d_type;
+        
+        // Skip . and ..
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        stats->entries++;
+        
+        // Symlinks, devices, fifos and sockets are never scanned
+        if (type != DT_DIR && type != DT_REG && type != DT_UNKNOWN) {
+            continue;
+        }
+        if (type == DT_REG && options->fast_reject && has_text_extension(name)) {
+            stats->rejected++;
+            continue;
+        }
+        
+        // Construct full path
+        size_t name_len = strlen(name);
+        if (dir_len + name_len + 1 > MAX_PATH) {
+            continue;
+        }
+        memcpy(path + dir_len, name, name_len + 1);
+        if (options->exclude_count > 0 && is_excluded(options, path, name)) {
+            stats->pruned++;
+            continue;
+        }
+        
+        // --shard only keeps the entries of a root whose name hashes to it
+        if (shard && hash_bytes(name, name_len, 0) % options->shard_count != options->shard_index) {
+            continue;
+        }
+        
+        // AT_NO_AUTOMOUNT leaves an autofs mount point untriggered, for skip_mount()
+        if (type == DT_UNKNOWN) {
+            if (fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT) == -1) {
+                continue;
+            }
+            type = S_ISDIR(statbuf.st_mode) ? DT_DIR : S_ISREG(statbuf.st_mode) ? DT_REG : DT_UNKNOWN;
+            if (type == DT_UNKNOWN) {
+                continue;
+            }
+        } else if (type == DT_REG && !ring) {
+            // Regular files still need their mode and size
+            if (fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(statbuf.st_mode)) {
+                continue;
+            }
+        }
+        
+        // If directory, queue it for a worker unless it is pruned
+        if (type == DT_DIR) {
+            if (mounts && entry->d_type == DT_DIR &&
+                fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT) == -1) {
+                continue;
+            }
+            if (mounts && statbuf.st_dev != dir_dev && skip_mount(options, dir_fd, name)) {
+                stats->pruned++;
+                continue;
+            }
+            if (subdir_count == subdir_cap) {
+                subdir_cap = subdir_cap ? subdir_cap * 2 : 16;
+                subdirs = xrealloc(subdirs, subdir_cap * sizeof(char *));
+            }
+            subdirs[subdir_count++] = xstrdup(path);
+        } 
+#if IO_URING_SUPPORT
+        // Left to the ring, which stats it along with the rest of the batch
+        else if (ring && entry->d_type == DT_REG) {
+            uring_add_file(worker, name);
+        }
+#endif
+        // If regular file, check if executable
+        else {
+            ElfInfo info;
+            uint64_t start = timed ? clock_ns(CLOCK_MONOTONIC) : 0;
+            
+            if (!is_executable(dir_fd, name, &statbuf, options->include_shared)) {
+                stats->rejected++;
+                continue;
+            }
+            if (classify_file(worker, dir_fd, name, &statbuf, &info)) {
+                if (timed) {
+                    stats->classify_ns += clock_ns(CLOCK_MONOTONIC) - start;
+                }
+                scan_elf_file(worker, path, dir_len, name, &info, start);
+            } else if (timed) {
+                stats->classify_ns += clock_ns(CLOCK_MONOTONIC) - start;
+                record_latency(stats, start);
+            }
+        }
+    }
+    
+#if IO_URING_SUPPORT
+    if (ring) {
+        uring_drain(worker);
+    }
+#endif
+    closedir(dir);
+    release_device(worker, slot);
+    
+    // Pushed in reverse so the owner pops them back in readdir order
+    for (int i = subdir_count - 1; i >= 0; i--) {
+        push_directory(worker, subdirs[i]);
+    }
+    free(subdirs);
+    
+    // Whatever the files did not account for went into the directory itself
+    if (timed) {
+        uint64_t busy = stats->classify_ns + stats->match_ns + stats->wait_ns - busy_start;
+        uint64_t elapsed = clock_ns(CLOCK_MONOTONIC) - dir_start;
+        stats->traverse_ns += elapsed > busy ? elapsed - busy : 0;
+    }
+}
+
+// Count a classified file, match its dependencies and free its info.
+// path holds the directory prefix up to dir_len. start_ns is when work on
+// the file began, for the --stats latency histogram.
+void scan_elf_file(Worker *worker, char *path, size_t dir_len, const char *name, ElfInfo *info, uint64_t start_ns) {
+    ScanPool *pool = worker->pool;
+    int scanned = atomic_fetch_add(&pool->file_count, 1) + 1;
+    bool timed = pool->options->stats;
+    
+    if (strcmp(info->arch, "unknown") != 0) {
+        uint64_t match_start = timed ? clock_ns(CLOCK_MONOTONIC) : 0;
+        
+        memcpy(path + dir_len, name, strlen(name) + 1);
+        if (get_dependencies(worker, path, info)) {
+            atomic_fetch_add(&pool->matched_count, 1);
+        }
+        if (timed) {
+            worker->stats.match_ns += clock_ns(CLOCK_MONOTONIC) - match_start;
+        }
+    }
+    if (timed) {
+        record_latency(&worker->stats, start_ns);
+    }
+    if (scanned % 100 == 0) {
+        fprintf(progress_out, "Scanned %d executables so far, found %d matches\n",
+               scanned, atomic_load(&pool->matched_count));
+    }
+    free_elf_info(info);
+}
+
+#if IO_URING_SUPPORT
+// Set up a ring of URING_DEPTH entries with the raw system calls. Returns
+// false, leaving ring->fd at -1, if the kernel has no io_uring or lacks any
+// of the operations used; the scan then reads synchronously.
+bool uring_init(Uring *ring) {
+    struct io_uring_params params;
+    struct io_uring_probe *probe;
+    const uint8_t ops[] = { IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+    bool supported = true;
+    
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return false;
+    }
+    
+    probe = calloc(1, sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    if (probe == NULL ||
+        syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) {
+        supported = false;
+    }
+    for (size_t i = 0; supported && i < sizeof(ops); i++) {
+        supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = 0;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    
+    ring->sq_map = MAP_FAILED;
+    ring->cq_map = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+    if (supported) {
+        ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_SQ_RING);
+    }
+    if (ring->sq_map != MAP_FAILED) {
+        ring->cq_map = ring->cq_map_size == 0 ? ring->sq_map :
+                       mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+    }
+    if (ring->cq_map != MAP_FAILED) {
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQES);
+    }
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+            munmap(ring->cq_map, ring->cq_map_size);
+        }
+        if (ring->sq_map != MAP_FAILED) {
+            munmap(ring->sq_map, ring->sq_map_size);
+        }
+        close(ring->fd);
+        ring->fd = -1;
+        return false;
+    }
+    
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    unsigned *sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    
+    // Submission slot i always carries SQE i, so only the tail ever moves
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+    
+    ring->files = xrealloc(NULL, URING_DEPTH * sizeof(UringFile));
+    ring->free_files = xrealloc(NULL, URING_DEPTH * sizeof(int));
+    for (int i = 0; i < URING_DEPTH; i++) {
+        ring->files[i].state = URING_FREE;
+        ring->free_files[ring->free_count++] = URING_DEPTH - 1 - i;
+    }
+    
+    return true;
+}
+
+void uring_exit(Uring *ring) {
+    if (ring->fd == -1) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    free(ring->files);
+    free(ring->free_files);
+    ring->fd = -1;
+}
+
+// Queue the next operation for a file. There is never more than one
+// operation in flight per file, so the submission queue cannot overflow.
+struct io_uring_sqe *uring_sqe(Uring *ring, UringFile *file, UringState state, uint8_t opcode) {
+    unsigned tail = *ring->sq_tail;
+    struct io_uring_sqe *sqe = &ring->sqes[tail & *ring->sq_mask];
+    
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = file - ring->files;
+    file->state = state;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    
+    return sqe;
+}
+
+// Start a regular file of the current directory down the pipeline,
+// handling completions first if all URING_DEPTH files are busy
+void uring_add_file(Worker *worker, const char *name) {
+    Uring *ring = &worker->ring;
+    
+    while (ring->free_count == 0) {
+        uring_run(worker, 1);
+    }
+    
+    UringFile *file = &ring->files[ring->free_files[--ring->free_count]];
+    snprintf(file->name, sizeof(file->name), "%s", name);
+    file->start_ns = worker->pool->options->stats ? clock_ns(CLOCK_MONOTONIC) : 0;
+    
+    struct io_uring_sqe *sqe = uring_sqe(ring, file, URING_STATX, IORING_OP_STATX);
+    sqe->fd = ring->dir_fd;
+    sqe->addr = (uintptr_t)file->name;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (uintptr_t)&file->stx;
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    ring->in_flight++;
+    
+    if (ring->to_submit >= URING_SUBMIT_BATCH) {
+        uring_run(worker, 0);
+    }
+}
+
+// Submit everything queued, wait for at least `wait` completions and handle
+// all that have arrived. Handling a completion usually queues the file's
+// next operation, which goes out with the following call.
+void uring_run(Worker *worker, unsigned wait) {
+    Uring *ring = &worker->ring;
+    bool timed = wait > 0 && worker->pool->options->stats;
+    uint64_t start = timed ? clock_ns(CLOCK_MONOTONIC) : 0;
+    int ret;
+    
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+    if (timed) {
+        worker->stats.wait_ns += clock_ns(CLOCK_MONOTONIC) - start;
+    }
+    if (ret == -1 && errno != EAGAIN && errno != EBUSY) {
+        fprintf(stderr, "Error: io_uring_enter failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (ret > 0) {
+        ring->to_submit -= ret;
+    }
+    
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        UringFile *file = &ring->files[cqe->user_data];
+        int res = cqe->res;
+    
+        // Give the entry back before the handler queues more work
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        uring_complete(worker, file, res);
+    }
+}
+
+// Move a file on to its next stage once an operation on it has completed.
+// This does what classify_file() and the synchronous scan loop do, in the
+// same order, so the cache and the results come out the same.
+void uring_complete(Worker *worker, UringFile *file, int res) {
+    Uring *ring = &worker->ring;
+    Options *options = worker->pool->options;
+    bool want_paths = options->transitive;
+    bool use_cache = options->cache_path[0] != '\0';
+    ScanStats *stats = &worker->stats;
+    bool timed = options->stats;
+    uint64_t start = 0;
+    struct io_uring_sqe *sqe;
+    ElfInfo info;
+    bool is_elf;
+    
+    switch (file->state) {
+        case URING_STATX:
+            if (res < 0 || !S_ISREG(file->stx.stx_mode)) {
+                break;
+            }
+            memset(&file->st, 0, sizeof(file->st));
+            file->st.st_dev = makedev(file->stx.stx_dev_major, file->stx.stx_dev_minor);
+            file->st.st_ino = file->stx.stx_ino;
+            file->st.st_mode = file->stx.stx_mode;
+            file->st.st_nlink = file->stx.stx_nlink;
+            file->st.st_uid = file->stx.stx_uid;
+            file->st.st_gid = file->stx.stx_gid;
+            file->st.st_size = file->stx.stx_size;
+            file->st.st_mtim.tv_sec = file->stx.stx_mtime.tv_sec;
+            file->st.st_mtim.tv_nsec = file->stx.stx_mtime.tv_nsec;
+    
+            // faccessat() has no io_uring counterpart; with the inode just
+            // looked up it does not wait on the device
+            if (!is_executable(ring->dir_fd, file->name, &file->st, options->include_shared)) {
+                stats->rejected++;
+                break;
+            }
+            DedupeKey inode = { file->st.st_dev, file->st.st_ino, 0 };
+            bool known = use_cache && lookup_scan_cache(&worker->pool->cache, &file->st, want_paths, &info, &is_elf);
+            
+            if (known) {
+                stats->cache_hits++;
+            } else if (file->st.st_nlink > 1 && dedupe_lookup(&worker->pool->inodes, &inode, &info, &is_elf)) {
+                stats->inode_hits++;
+                known = true;
+            }
+            if (known) {
+                stats->elf_files += is_elf;
+                if (use_cache) {
+                    record_cache_entry(worker, &file->st, is_elf, want_paths, &info);
+                }
+                if (is_elf) {
+                    scan_elf_file(worker, ring->path, ring->dir_len, file->name, &info, file->start_ns);
+                } else if (timed) {
+                    record_latency(stats, file->start_ns);
+                }
+                break;
+            }
+    
+            sqe = uring_sqe(ring, file, URING_OPEN, IORING_OP_OPENAT);
+            sqe->fd = ring->dir_fd;
+            sqe->addr = (uintptr_t)file->name;
+            sqe->open_flags = O_RDONLY | O_CLOEXEC | O_NOCTTY;
+            return;
+    
+        case URING_OPEN:
+            stats->opened++;
+            if (res < 0) {
+                if (timed) {
+                    record_latency(stats, file->start_ns);
+                }
+                // No verdict, so nothing cached, as in classify_file()
+                stats->unreadable++;
+                break;
+            }
+            file->ef.fd = res;
+            file->ef.size = file->st.st_size;
+            file->ef.nbufs = 0;
+            file->ef.bytes_mapped = 0;
+            if ((uint64_t)file->st.st_size > ELF_LARGE_FILE) {
+                posix_fadvise(res, 0, 0, POSIX_FADV_RANDOM);
+            }
+    
+            sqe = uring_sqe(ring, file, URING_READ, IORING_OP_READ);
+            sqe->fd = res;
+            sqe->addr = (uintptr_t)file->ef.head;
+            sqe->len = sizeof(file->ef.head);
+            sqe->off = 0;
+            return;
+    
+        case URING_READ:
+            start = timed ? clock_ns(CLOCK_MONOTONIC) : 0;
+            file->ef.head_len = res > 0 ? (size_t)res : 0;
+            file->ef.bytes_read = file->ef.head_len;
+            file->ef.failed = res < 0;
+            is_elf = inspect_elf_head(&file->ef, &info, want_paths);
+            release_elf_views(&file->ef);
+            stats->bytes_read += info.bytes_read;
+            stats->bytes_mapped += info.bytes_mapped;
+            stats->content_hits += info.deduped;
+            stats->elf_files += is_elf;
+            stats->unreadable += info.unreadable;
+            if (file->st.st_nlink > 1 && !info.unreadable) {
+                DedupeKey inode = { file->st.st_dev, file->st.st_ino, 0 };
+                dedupe_insert(&worker->pool->inodes, &inode, &info, is_elf);
+            }
+            if (use_cache && !info.unreadable) {
+                record_cache_entry(worker, &file->st, is_elf, want_paths, &info);
+            }
+            if (timed) {
+                stats->classify_ns += clock_ns(CLOCK_MONOTONIC) - start;
+            }
+            if (is_elf) {
+                scan_elf_file(worker, ring->path, ring->dir_len, file->name, &info, file->start_ns);
+            } else if (timed) {
+                record_latency(stats, file->start_ns);
+            }
+    
+            sqe = uring_sqe(ring, file, URING_CLOSE, IORING_OP_CLOSE);
+            sqe->fd = file->ef.fd;
+            return;
+    
+        case URING_CLOSE:
+        case URING_FREE:
+            break;
+    }
+    
+    file->state = URING_FREE;
+    ring->free_files[ring->free_count++] = file - ring->files;
+    ring->in_flight--;
+}
+
+// Finish every file of the current directory before its descriptor closes
+void uring_drain(Worker *worker) {
+    Uring *ring = &worker->ring;
+    
+    while (ring->in_flight > 0) {
+        uring_run(worker, 1);
+    }
+}
+#endif
+
+// Owner side of the work-stealing deque: push and pop at the bottom
+void push_directory(Worker *worker, char *dir_path) {
+    ScanPool *pool = worker->pool;
+    DirQueue *queue = &worker->queue;
+    
+    atomic_fetch_add(&pool->pending, 1);
+    
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail == queue->cap) {
+        // Reclaim the slots already taken by thieves before growing
+        if (queue->head > 0) {
+            memmove(queue->dirs, queue->dirs + queue->head,
+                    (queue->tail - queue->head) * sizeof(char *));
+            queue->tail -= queue->head;
+            queue->head = 0;
+        }
+        if (queue->tail == queue->cap) {
+            queue->cap = queue->cap ? queue->cap * 2 : 64;
+            queue->dirs = xrealloc(queue->dirs, queue->cap * sizeof(char *));
+        }
+    }
+    queue->dirs[queue->tail++] = dir_path;
+    pthread_mutex_unlock(&queue->lock);
+    
+    atomic_fetch_add(&pool->generation, 1);
+    if (atomic_load(&pool->idle) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_broadcast(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+// Take one of the read slots of the device holding the directory. Returns
+// false if they are all in use: the directory is then kept on the device's
+// deferred list, and this worker moves on to other work, possibly on
+// another device, instead of blocking. *slot is -1 for devices without a
+// limit, which need no release.
+bool acquire_device(Worker *worker, int dir_fd, const char *dir_path, int *slot) {
+    ScanPool *pool = worker->pool;
+    struct stat st;
+    DeviceSlot *device = NULL;
+    bool acquired = true;
+    
+    *slot = -1;
+    if (fstat(dir_fd, &st) == -1 || (worker->last_dev_free && worker->last_dev == st.st_dev)) {
+        return true;
+    }
+    
+    pthread_mutex_lock(&pool->device_lock);
+    for (int i = 0; i < pool->device_count && device == NULL; i++) {
+        if (pool->devices[i].dev == st.st_dev) {
+            device = &pool->devices[i];
+        }
+    }
+    if (device == NULL) {
+        if (pool->device_count == pool->device_cap) {
+            pool->device_cap = pool->device_cap ? pool->device_cap * 2 : 8;
+            pool->devices = xrealloc(pool->devices, pool->device_cap * sizeof(DeviceSlot));
+        }
+        device = &pool->devices[pool->device_count++];
+        memset(device, 0, sizeof(*device));
+        device->dev = st.st_dev;
+        device->limit = device_limit(pool->options, dir_fd, st.st_dev);
+    }
+    
+    if (device->limit == 0) {
+        worker->last_dev = st.st_dev;
+        worker->last_dev_free = true;
+    } else if (device->active < device->limit) {
+        device->active++;
+        *slot = device - pool->devices;
+    } else {
+        if (device->deferred_count == device->deferred_cap) {
+            device->deferred_cap = device->deferred_cap ? device->deferred_cap * 2 : 64;
+            device->deferred = xrealloc(device->deferred, device->deferred_cap * sizeof(char *));
+        }
+        device->deferred[device->deferred_count++] = xstrdup(dir_path);
+        acquired = false;
+    }
+    pthread_mutex_unlock(&pool->device_lock);
+    
+    return acquired;
+}
+
+// Give a slot back and queue one of the directories waiting for it. This
+// worker is still busy with the directory it releases, so pending work
+// cannot run out while directories are deferred.
+void release_device(Worker *worker, int slot) {
+    ScanPool *pool = worker->pool;
+    char *next = NULL;
+    
+    if (slot < 0) {
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->device_lock);
+    DeviceSlot *device = &pool->devices[slot];
+    device->active--;
+    if (device->deferred_count > 0) {
+        next = device->deferred[--device->deferred_count];
+    }
+    pthread_mutex_unlock(&pool->device_lock);
+    
+    if (next != NULL) {
+        push_directory(worker, next);
+    }
+}
+
+// How many directories of one device may be read at once. Spinning disks
+// lose more to seeking than they gain from a deeper queue, and network file
+// systems pile up server round trips. Anything else, SSDs and NVMe in
+// particular, is left to --jobs.
+int device_limit(const Options *options, int dir_fd, dev_t dev) {
+    struct statfs fs;
+    char path[96];
+    char rotational = '0';
+    int fd;
+    
+    if (options->device_jobs > 0) {
+        return options->device_jobs;
+    }
+    
+    if (fstatfs(dir_fd, &fs) == 0 &&
+        (fs.f_type == NFS_FS_MAGIC || (uint32_t)fs.f_type == CIFS_FS_MAGIC || (uint32_t)fs.f_type == SMB2_FS_MAGIC)) {
+        return NETWORK_DEVICE_JOBS;
+    }
+    
+    // A partition has no queue of its own; its disk is the parent directory
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd != -1) {
+        if (read(fd, &rotational, 1) != 1) {
+            rotational = '0';
+        }
+        close(fd);
+    }
+    
+    return rotational == '1' ? ROTATIONAL_DEVICE_JOBS : 0;
+}
+
+bool pop_directory(Worker *worker, char **dir_path) {
+    DirQueue *queue = &worker->queue;
+    bool found = false;
+    
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail > queue->head) {
+        *dir_path = queue->dirs[--queue->tail];
+        found = true;
+    }
+    if (queue->tail == queue->head) {
+        queue->head = queue->tail = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    
+    return found;
+}
+
+// Thief side: take the oldest entry from another worker. Entries near the
+// top of a deque are closest to the root and carry the largest subtrees.
+bool steal_directory(Worker *worker, char **dir_path) {
+    ScanPool *pool = worker->pool;
+    
+    for (int i = 1; i < pool->worker_count; i++) {
+        DirQueue *queue = &pool->workers[(worker->id + i) % pool->worker_count].queue;
+        bool found = false;
+        
+        pthread_mutex_lock(&queue->lock);
+        if (queue->tail > queue->head) {
+            *dir_path = queue->dirs[queue->head++];
+            found = true;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        
+        if (found) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+// Sleep until something is pushed or the scan is over. generation is the
+// push counter sampled before the deques were found empty, so a push that
+// raced with the search is never missed. Returns false once all work is done.
+bool wait_for_work(ScanPool *pool, unsigned long generation) {
+    bool more;
+    
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_fetch_add(&pool->idle, 1);
+    while (atomic_load(&pool->pending) > 0 && atomic_load(&pool->generation) == generation) {
+        pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+    }
+    atomic_fetch_sub(&pool->idle, 1);
+    more = atomic_load(&pool->pending) > 0;
+    pthread_mutex_unlock(&pool->idle_lock);
+    
+    return more;
+}
+
+// Record a match in the worker's private result list, or its spill buffer
+void record_match(Worker *worker, const ElfInfo *info, int lib, const char *soname, const char *file_path) {
+    if (worker->spill.data != NULL) {
+        spill_match(worker, info->arch, worker->pool->options->lib_patterns[lib], file_path, info->kind);
+        return;
+    }
+    
+    if (worker->match_count == worker->match_cap) {
+        worker->match_cap = worker->match_cap ? worker->match_cap * 2 : 256;
+        worker->matches = xrealloc(worker->matches, worker->match_cap * sizeof(Match));
+    }
+    
+    Match *match = &worker->matches[worker->match_count++];
+    match->arch = info->arch;
+    match->lib = lib;
+    match->soname = soname ? arena_strdup(&worker->arena, soname) : NULL;
+    match->path = arena_strdup(&worker->arena, file_path);
+    match->kind = info->kind;
+}
+
+// Add a match to the worker's --mem-limit buffer, writing the buffer out
+// as a sorted run first if the record does not fit
+void spill_match(Worker *worker, const char *arch, const char *lib, const char *file_path, unsigned char kind) {
+    SpillBuffer *spill = &worker->spill;
+    size_t arch_len = strlen(arch) + 1;
+    size_t lib_len = strlen(lib) + 1;
+    size_t path_len = strlen(file_path) + 1;
+    uint32_t key_len = (uint32_t)(arch_len + lib_len + path_len);
+    size_t need = sizeof(uint32_t) + key_len + 1 + sizeof(char *);
+    
+    if (spill->used + need + spill->count * sizeof(char *) > spill->size) {
+        write_spill_run(worker);
+        if (need > spill->size) {
+            fprintf(stderr, "Error: --mem-limit is too small for a match of %s\n", file_path);
+            exit(1);
+        }
+    }
+    
+    char *record = spill->data + spill->used;
+    char **slots = (char **)(spill->data + spill->size);
+    
+    memcpy(record, &key_len, sizeof(uint32_t));
+    record += sizeof(uint32_t);
+    memcpy(record, arch, arch_len);
+    memcpy(record + arch_len, lib, lib_len);
+    memcpy(record + arch_len + lib_len, file_path, path_len);
+    record[key_len] = (char)kind;
+    
+    slots[-1 - (long)spill->count] = spill->data + spill->used;
+    spill->count++;
+    spill->used += sizeof(uint32_t) + key_len + 1;
+}
+
+// Sort the worker's buffered records and write them, without repeats, to
+// a new run file. The buffer is empty again afterwards. As soon as the
+// worker holds SPILL_CASCADE_WAYS runs of one level they are merged into a
+// run of the next, so it never has more than SPILL_CASCADE_WAYS - 1 runs of
+// each level open and its descriptors grow with the log of its matches.
+void write_spill_run(Worker *worker) {
+    SpillBuffer *spill = &worker->spill;
+    char **records = (char **)(spill->data + spill->size) - spill->count;
+    const char *last = NULL;
+    FILE *run;
+    
+    if (spill->count == 0) {
+        return;
+    }
+    
+    qsort(records, spill->count, sizeof(char *), compare_spilled);
+    run = create_spill_file();
+    for (uint32_t i = 0; i < spill->count; i++) {
+        if (last != NULL && compare_spilled(&records[i], &last) == 0) {
+            continue;
+        }
+        uint32_t key_len;
+        memcpy(&key_len, records[i], sizeof(uint32_t));
+        fwrite(records[i], 1, sizeof(uint32_t) + key_len + 1, run);
+        worker->stats.spilled_bytes += sizeof(uint32_t) + key_len + 1;
+        last = records[i];
+    }
+    if (fflush(run) != 0 || ferror(run)) {
+        fprintf(stderr, "Error: Cannot write spill file: %s\n", strerror(errno));
+        exit(1);
+    }
+    
+    if (spill->run_count == spill->run_cap) {
+        spill->run_cap = spill->run_cap ? spill->run_cap * 2 : 16;
+        spill->runs = xrealloc(spill->runs, spill->run_cap * sizeof(FILE *));
+        spill->levels = xrealloc(spill->levels, spill->run_cap);
+    }
+    spill->runs[spill->run_count] = run;
+    spill->levels[spill->run_count++] = 0;
+    worker->stats.spilled_runs++;
+    spill->used = 0;
+    spill->count = 0;
+    
+    // Levels never rise towards the end, so the last runs share a level
+    // when the first and last of them do
+    while (spill->run_count >= SPILL_CASCADE_WAYS &&
+           spill->levels[spill->run_count - SPILL_CASCADE_WAYS] == spill->levels[spill->run_count - 1]) {
+        int first = spill->run_count - SPILL_CASCADE_WAYS;
+        
+        spill->runs[first] = merge_runs(spill->runs + first, SPILL_CASCADE_WAYS);
+        spill->levels[first]++;
+        spill->run_count = first + 1;
+    }
+}
+
+// Order two buffered records by key. Keys are "arch\0lib\0path\0", so a
+// plain byte comparison orders them by arch, then lib, then path.
+int compare_spilled(const void *a, const void *b) {
+    const char *ra = *(const char * const *)a;
+    const char *rb = *(const char * const *)b;
+    uint32_t len_a, len_b;
+    
+    memcpy(&len_a, ra, sizeof(uint32_t));
+    memcpy(&len_b, rb, sizeof(uint32_t));
+    return compare_keys(ra + sizeof(uint32_t), len_a, rb + sizeof(uint32_t), len_b);
+}
+
+int compare_keys(const char *a, uint32_t len_a, const char *b, uint32_t len_b) {
+    int cmp = memcmp(a, b, len_a < len_b ? len_a : len_b);
+    
+    if (cmp != 0) {
+        return cmp;
+    }
+    return len_a < len_b ? -1 : len_a > len_b;
+}
+
+// Open an anonymous read-write file below $TMPDIR, or /tmp. It is unlinked
+// right away, so nothing is left behind however bldd exits.
+FILE *create_spill_file(void) {
+    const char *dir = getenv("TMPDIR");
+    char path[MAX_PATH];
+    FILE *fp;
+    int fd;
+    
+    if (dir == NULL || dir[0] == '\0') {
+        dir = "/tmp";
+    }
+    snprintf(path, sizeof(path), "%s/bldd-spill-XXXXXX", dir);
+    fd = mkstemp(path);
+    if (fd == -1 || (fp = fdopen(fd, "w+")) == NULL) {
+        fprintf(stderr, "Error: Cannot create spill file in %s: %s\n", dir, strerror(errno));
+        exit(1);
+    }
+    unlink(path);
+    return fp;
+}
+
+// Append one (arch, lib, path) record to a stream buffer, flushing it
+// first if the record might not fit. The file's kind is added as a fourth
+// field when the buffer asks for it.
+void stream_match(StreamBuffer *stream, const char *arch, const char *lib, const char *file_path, unsigned char kind) {
+    StreamFormat format = stream->format;
+    // Worst case is every byte escaped as \u00XX, plus the JSON punctuation
+    // and the kind field: ","kind":" and the name, with sprintf()'s NUL
+    size_t kind_len = stream->kinds ? 10 + strlen(elf_kind_name(kind)) + 1 : 0;
+    size_t max_len = 6 * (strlen(arch) + strlen(lib) + strlen(file_path)) + 32 + kind_len;
+    char *out;
+    
+    if (stream->len + max_len > STREAM_BUFFER_SIZE) {
+        flush_stream(stream);
+    }
+    if (stream->len == 0) {
+        stream->pending_ns = clock_ns(CLOCK_MONOTONIC);
+    }
+    out = stream->data + stream->len;
+    
+    if (format == STREAM_NDJSON) {
+        memcpy(out, "{\"arch\":\"", 9);
+        out += 9;
+        out += stream_escape(out, arch, format);
+        memcpy(out, "\",\"lib\":\"", 9);
+        out += 9;
+        out += stream_escape(out, lib, format);
+        memcpy(out, "\",\"path\":\"", 10);
+        out += 10;
+        out += stream_escape(out, file_path, format);
+        if (stream->kinds) {
+            out += sprintf(out, "\",\"kind\":\"%s", elf_kind_name(kind));
+        }
+        memcpy(out, "\"}\n", 3);
+        out += 3;
+    } else {
+        out += stream_escape(out, arch, format);
+        *out++ = '\t';
+        out += stream_escape(out, lib, format);
+        *out++ = '\t';
+        out += stream_escape(out, file_path, format);
+        if (stream->kinds) {
+            out += sprintf(out, "\t%s", elf_kind_name(kind));
+        }
+        *out++ = '\n';
+    }
+    
+    stream->len = out - stream->data;
+    stream->records++;
+}
+
+// Copy s to out with the escaping its field needs. JSON strings escape
+// quotes, backslashes and control characters; TSV fields escape tab,
+// newline, carriage return and backslash the way PostgreSQL's text format
+// does. Other bytes, including non-UTF-8 ones, are copied as they are.
+size_t stream_escape(char *out, const char *s, StreamFormat format) {
+    static const char hex[] = "0123456789abcdef";
+    char *start = out;
+    
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        unsigned char c = *p;
+        
+        if (c == '\\') {
+            *out++ = '\\';
+            *out++ = '\\';
+        } else if (c == '\t') {
+            *out++ = '\\';
+            *out++ = 't';
+        } else if (c == '\n') {
+            *out++ = '\\';
+            *out++ = 'n';
+        } else if (c == '\r') {
+            *out++ = '\\';
+            *out++ = 'r';
+        } else if (format == STREAM_NDJSON && c == '"') {
+            *out++ = '\\';
+            *out++ = '"';
+        } else if (format == STREAM_NDJSON && c < 0x20) {
+            memcpy(out, "\\u00", 4);
+            out[4] = hex[c >> 4];
+            out[5] = hex[c & 0xf];
+            out += 6;
+        } else {
+            *out++ = c;
+        }
+    }
+    
+    return out - start;
+}
+
+// Write out a stream buffer. The lock keeps blocks from different workers
+// from interleaving when stdout is a pipe and a write() comes back short.
+void flush_stream(StreamBuffer *stream) {
+    size_t done = 0;
+    
+    if (stream->lock != NULL) {
+        pthread_mutex_lock(stream->lock);
+    }
+    while (done < stream->len) {
+        ssize_t n = write(STDOUT_FILENO, stream->data + done, stream->len - done);
+        
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: Cannot write stream output: %s\n", strerror(errno));
+            exit(1);
+        }
+        done += n;
+    }
+    if (stream->lock != NULL) {
+        pthread_mutex_unlock(stream->lock);
+    }
+    
+    stream->len = 0;
+}
+
+// Write out a worker's records once the oldest has waited STREAM_FLUSH_MS
+void flush_stream_if_due(StreamBuffer *stream) {
+    if (stream->len > 0 && clock_ns(CLOCK_MONOTONIC) - stream->pending_ns >= STREAM_FLUSH_MS * 1000000ULL) {
+        flush_stream(stream);
+    }
+}
+
+// Classify a candidate file, consulting the scan cache first when one is
+// in use. Every file classified here is also queued for the next cache.
+bool classify_file(Worker *worker, int dir_fd, const char *name, const struct stat *statbuf, ElfInfo *info) {
+    ScanPool *pool = worker->pool;
+    bool is_elf;
+    
+    bool want_paths = pool->options->transitive;
+    bool cached = pool->options->cache_path[0] &&
+                  lookup_scan_cache(&pool->cache, statbuf, want_paths, info, &is_elf);
+    
+    // Only files with several links can be met again under another name
+    DedupeKey inode = { statbuf->st_dev, statbuf->st_ino, 0 };
+    bool linked = statbuf->st_nlink > 1;
+    
+    if (cached) {
+        worker->stats.cache_hits++;
+    } else if (linked && dedupe_lookup(&pool->inodes, &inode, info, &is_elf)) {
+        worker->stats.inode_hits++;
+    } else {
+        is_elf = inspect_elf_file(dir_fd, name, statbuf->st_size, info, want_paths);
+        worker->stats.opened++;
+        worker->stats.bytes_read += info->bytes_read;
+        worker->stats.bytes_mapped += info->bytes_mapped;
+        worker->stats.content_hits += info->deduped;
+        worker->stats.unreadable += info->unreadable;
+        if (linked && !info->unreadable) {
+            dedupe_insert(&pool->inodes, &inode, info, is_elf);
+        }
+    }
+    // A file we failed to read (EACCES, EMFILE, EIO) gets no verdict, or
+    // the next --cache run would skip it until it changed
+    if (pool->options->cache_path[0] && !info->unreadable) {
+        record_cache_entry(worker, statbuf, is_elf, want_paths, info);
+    }
+    worker->stats.elf_files += is_elf;
+    
+    return is_elf;
+}
+
+// Map an existing cache file. A missing, stale or corrupt cache is not an
+// error: the scan simply starts from scratch and writes a fresh one.
+bool load_scan_cache(ScanCache *cache, const char *cache_path) {
+    struct stat st;
+    int fd;
+    
+    memset(cache, 0, sizeof(*cache));
+    
+    fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+    
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    
+    const CacheHeader *hdr = map;
+    size_t entries_size = (size_t)hdr->entry_count * sizeof(CacheEntry);
+    size_t needed_size = (size_t)hdr->needed_count * sizeof(uint32_t);
+    size_t slots_size = (size_t)hdr->slot_count * sizeof(uint32_t);
+    
+    if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != CACHE_VERSION ||
+        hdr->slot_count == 0 || (hdr->slot_count & (hdr->slot_count - 1)) != 0 ||
+        hdr->entry_count >= hdr->slot_count ||
+        sizeof(CacheHeader) + entries_size + needed_size + slots_size + hdr->strings_size != (size_t)st.st_size) {
+        fprintf(stderr, "Warning: Ignoring invalid scan cache %s\n", cache_path);
+        munmap(map, st.st_size);
+        return false;
+    }
+    
+    cache->map = map;
+    cache->map_size = st.st_size;
+    cache->header = hdr;
+    cache->entries = (const CacheEntry *)(hdr + 1);
+    cache->needed = (const uint32_t *)((const char *)cache->entries + entries_size);
+    cache->slots = (const uint32_t *)((const char *)cache->needed + needed_size);
+    cache->strings = (const char *)cache->slots + slots_size;
+    
+    // Make sure every string reference stays inside the mapping
+    if (hdr->strings_size == 0 || cache->strings[hdr->strings_size - 1] != '\0') {
+        fprintf(stderr, "Warning: Ignoring invalid scan cache %s\n", cache_path);
+        unload_scan_cache(cache);
+        return false;
+    }
+    for (uint32_t i = 0; i < hdr->entry_count; i++) {
+        const CacheEntry *e = &cache->entries[i];
+        bool bad = e->needed_index > hdr->needed_count ||
+                   e->needed_count > hdr->needed_count - e->needed_index ||
+                   ((e->flags & CACHE_PATHS) && e->needed_count < 2);
+        
+        for (uint32_t n = 0; !bad && n < e->needed_count; n++) {
+            bad = cache->needed[e->needed_index + n] >= hdr->strings_size;
+        }
+        if (bad) {
+            fprintf(stderr, "Warning: Ignoring invalid scan cache %s\n", cache_path);
+            unload_scan_cache(cache);
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+void unload_scan_cache(ScanCache *cache) {
+    if (cache->map != NULL) {
+        munmap(cache->map, cache->map_size);
+    }
+    memset(cache, 0, sizeof(*cache));
+}
+
+uint64_t cache_key_hash(uint64_t dev, uint64_t ino) {
+    return hash_mix(hash_mix(dev) ^ ino);
+}
+
+// Look up a file by identity. On a hit, *is_elf tells whether the file was
+// an ELF file and info is filled in with NEEDED strings pointing into the
+// mapping. Only the pointer array is allocated, so free_elf_info() works.
+// An entry written without search paths is a miss when want_paths is set.
+bool lookup_scan_cache(const ScanCache *cache, const struct stat *statbuf, bool want_paths, ElfInfo *info, bool *is_elf) {
+    if (cache->map == NULL) {
+        return false;
+    }
+    
+    uint32_t mask = cache->header->slot_count - 1;
+    uint32_t slot = (uint32_t)cache_key_hash(statbuf->st_dev, statbuf->st_ino) & mask;
+    
+    for (;; slot = (slot + 1) & mask) {
+        uint32_t index = cache->slots[slot];
+        
+        if (index == 0 || index > cache->header->entry_count) {
+            return false;
+        }
+        
+        const CacheEntry *e = &cache->entries[index - 1];
+        if (e->dev != (uint64_t)statbuf->st_dev || e->ino != (uint64_t)statbuf->st_ino) {
+            continue;
+        }
+        
+        // Same file, but it changed since the cache was written
+        if (e->mtime_sec != (int64_t)statbuf->st_mtim.tv_sec ||
+            e->mtime_nsec != (int64_t)statbuf->st_mtim.tv_nsec ||
+            e->size != (int64_t)statbuf->st_size) {
+            return false;
+        }
+        if (want_paths && (e->flags & CACHE_ELF) && !(e->flags & CACHE_PATHS)) {
+            return false;
+        }
+        
+        uint32_t needed_count = e->needed_count;
+        const uint32_t *needed = cache->needed + e->needed_index;
+        
+        memset(info, 0, sizeof(*info));
+        info->machine = e->machine;
+        info->elf_class = e->elf_class;
+        info->data = e->data;
+        info->kind = e->kind;
+        info->arch = (e->flags & CACHE_ELF) ? elf_arch_name(e->machine, e->elf_class, e->data) : "unknown";
+        if (e->flags & CACHE_PATHS) {
+            needed_count -= 2;
+            if (cache->strings[needed[needed_count]] != '\0') {
+                info->rpath = cache->strings + needed[needed_count];
+            }
+            if (cache->strings[needed[needed_count + 1]] != '\0') {
+                info->runpath = cache->strings + needed[needed_count + 1];
+            }
+        }
+        if (needed_count > 0) {
+            info->needed = xrealloc(NULL, needed_count * sizeof(char *));
+            for (uint32_t n = 0; n < needed_count; n++) {
+                info->needed[n] = (char *)cache->strings + needed[n];
+            }
+            info->needed_count = needed_count;
+        }
+        *is_elf = (e->flags & CACHE_ELF) != 0;
+        return true;
+    }
+}
+
+// Remember the classification of one file for the cache written at the end
+void record_cache_entry(Worker *worker, const struct stat *statbuf, bool is_elf, bool want_paths, const ElfInfo *info) {
+    if (worker->cache_count == worker->cache_cap) {
+        worker->cache_cap = worker->cache_cap ? worker->cache_cap * 2 : 256;
+        worker->cache_records = xrealloc(worker->cache_records, worker->cache_cap * sizeof(CacheRecord));
+    }
+    
+    CacheRecord *rec = &worker->cache_records[worker->cache_count++];
+    memset(rec, 0, sizeof(*rec));
+    rec->entry.dev = statbuf->st_dev;
+    rec->entry.ino = statbuf->st_ino;
+    rec->entry.mtime_sec = statbuf->st_mtim.tv_sec;
+    rec->entry.mtime_nsec = statbuf->st_mtim.tv_nsec;
+    rec->entry.size = statbuf->st_size;
+    rec->entry.machine = info->machine;
+    rec->entry.elf_class = info->elf_class;
+    rec->entry.data = info->data;
+    rec->entry.kind = info->kind;
+    rec->entry.flags = is_elf ? CACHE_ELF : 0;
+    
+    // The search paths go after the NEEDED strings, empty if absent
+    int path_count = 0;
+    const char *paths[2] = { info->rpath ? info->rpath : "", info->runpath ? info->runpath : "" };
+    if (is_elf && want_paths) {
+        rec->entry.flags |= CACHE_PATHS;
+        path_count = 2;
+    }
+    
+    if (is_elf && info->needed_count + path_count > 0) {
+        size_t len = 0;
+        
+        for (int n = 0; n < info->needed_count; n++) {
+            len += strlen(info->needed[n]) + 1;
+        }
+        for (int n = 0; n < path_count; n++) {
+            len += strlen(paths[n]) + 1;
+        }
+        rec->needed = xrealloc(NULL, len);
+        rec->needed_len = len;
+        len = 0;
+        for (int n = 0; n < info->needed_count + path_count; n++) {
+            const char *str = n < info->needed_count ? info->needed[n] : paths[n - info->needed_count];
+            size_t l = strlen(str) + 1;
+            memcpy(rec->needed + len, str, l);
+            len += l;
+        }
+        rec->entry.needed_count = info->needed_count + path_count;
+    }
+}
+
+// Write the records collected by all workers to a new cache file, replacing
+// the old one atomically. Strings are de-duplicated, since most binaries
+// share the same handful of sonames.
+void save_scan_cache(ScanPool *pool, const char *cache_path) {
+    char tmp_path[MAX_PATH];
+    uint32_t entry_count = 0, needed_count = 0, slot_count = 64;
+    HashIndex string_map;
+    char *strings = NULL;
+    size_t strings_len = 0, strings_cap = 0;
+    
+    memset(&string_map, 0, sizeof(string_map));
+    
+    for (int i = 0; i < pool->worker_count; i++) {
+        entry_count += pool->workers[i].cache_count;
+        for (int r = 0; r < pool->workers[i].cache_count; r++) {
+            needed_count += pool->workers[i].cache_records[r].entry.needed_count;
+        }
+    }
+    while (slot_count < entry_count * 2) {
+        slot_count *= 2;
+    }
+    
+    CacheEntry *entries = xrealloc(NULL, (entry_count ? entry_count : 1) * sizeof(CacheEntry));
+    uint32_t *needed = xrealloc(NULL, (needed_count ? needed_count : 1) * sizeof(uint32_t));
+    uint32_t *slots = calloc(slot_count, sizeof(uint32_t));
+    if (slots == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    
+    // Offset 0 is the empty string, which also keeps the string table non-empty
+    strings_cap = 4096;
+    strings = xrealloc(NULL, strings_cap);
+    strings[0] = '\0';
+    strings_len = 1;
+    
+    entry_count = 0;
+    needed_count = 0;
+    for (int i = 0; i < pool->worker_count; i++) {
+        Worker *w = &pool->workers[i];
+        
+        for (int r = 0; r < w->cache_count; r++) {
+            CacheRecord *rec = &w->cache_records[r];
+            uint32_t mask = slot_count - 1;
+            uint32_t slot = (uint32_t)cache_key_hash(rec->entry.dev, rec->entry.ino) & mask;
+            bool duplicate = false;
+            
+            // Hard links show up once per name; keep the first
+            while (slots[slot] != 0) {
+                const CacheEntry *e = &entries[slots[slot] - 1];
+                if (e->dev == rec->entry.dev && e->ino == rec->entry.ino) {
+                    duplicate = true;
+                    break;
+                }
+                slot = (slot + 1) & mask;
+            }
+            if (duplicate) {
+                free(rec->needed);
+                continue;
+            }
+            
+            CacheEntry *e = &entries[entry_count];
+            *e = rec->entry;
+            e->needed_index = needed_count;
+            for (size_t off = 0; off < rec->needed_len; ) {
+                const char *name = rec->needed + off;
+                size_t len = strlen(name) + 1;
+                uint64_t hash = hash_bytes(name, len - 1, 0);
+                CacheStrings ctx = { strings, name };
+                uint32_t found = hash_index_find(&string_map, hash, cache_string_equals, &ctx);
+                
+                if (found == HASH_EMPTY) {
+                    while (strings_len + len > strings_cap) {
+                        strings_cap *= 2;
+                        strings = xrealloc(strings, strings_cap);
+                    }
+                    memcpy(strings + strings_len, name, len);
+                    found = (uint32_t)strings_len;
+                    strings_len += len;
+                    hash_index_insert(&string_map, hash, found);
+                }
+                needed[needed_count++] = found;
+                off += len;
+            }
+            slots[slot] = ++entry_count;
+            free(rec->needed);
+        }
+        free(w->cache_records);
+        w->cache_records = NULL;
+        w->cache_count = 0;
+    }
+    
+    CacheHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = CACHE_VERSION;
+    hdr.entry_count = entry_count;
+    hdr.needed_count = needed_count;
+    hdr.slot_count = slot_count;
+    hdr.strings_size = strings_len;
+    
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Cannot create cache file %s: %s\n", tmp_path, strerror(errno));
+    } else {
+        bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+                  fwrite(entries, sizeof(CacheEntry), entry_count, fp) == entry_count &&
+                  fwrite(needed, sizeof(uint32_t), needed_count, fp) == needed_count &&
+                  fwrite(slots, sizeof(uint32_t), slot_count, fp) == slot_count &&
+                  fwrite(strings, 1, strings_len, fp) == strings_len;
+        
+        if (fclose(fp) != 0 || !ok || rename(tmp_path, cache_path) != 0) {
+            fprintf(stderr, "Error: Cannot write cache file %s: %s\n", cache_path, strerror(errno));
+            unlink(tmp_path);
+        }
+    }
+    
+    free(entries);
+    free(needed);
+    free(slots);
+    free(strings);
+    free(string_map.hashes);
+    free(string_map.values);
+}
+
+bool cache_string_equals(uint32_t value, const void *key) {
+    const CacheStrings *ctx = key;
+    
+    return strcmp(ctx->strings + value, ctx->name) == 0;
+}
+
+// Cheap checks done before the file is opened. With include_shared, a
+// file named like a shared object is a candidate whatever its mode, since
+// libraries are usually installed without an x bit.
+bool is_executable(int dir_fd, const char *name, const struct stat *statbuf, bool include_shared) {
+    // Too short to hold even a 32-bit ELF header, like most tiny wrappers
+    if (statbuf->st_size < (off_t)sizeof(Elf32_Ehdr)) {
+        return false;
+    }
+    
+    if (include_shared && has_shared_object_name(name)) {
+        return true;
+    }
+    
+    // Nobody, not even root, can execute a file without any x bit
+    if ((statbuf->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) == 0) {
+        return false;
+    }
+    
+    return faccessat(dir_fd, name, X_OK, 0) == 0;
+}
+
+// Name suffixes that --fast-reject takes to mean "not ELF" without reading
+// the file. This is a guess: nothing stops an ELF binary from being called
+// run.sh, which is why it is not the default.
+bool has_text_extension(const char *name) {
+    static const char *const extensions[] = {
+        "sh", "bash", "zsh", "csh", "ksh", "py", "pyc", "pl", "pm", "rb", "lua", "tcl",
+        "js", "php", "awk", "sed", "txt", "md", "json", "xml", "html", "conf", "cfg",
+        "ini", "yml", "yaml", "desktop", "service", "cmake", "pc", "la", "a", "o",
+    };
+    const char *dot = strrchr(name, '.');
+    
+    if (dot == NULL || dot == name) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        if (strcmp(dot + 1, extensions[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// An --exclude glob with a slash is matched against the whole path, so
+// "/home/*/.cache" works; one without is matched against the name alone,
+// like "*.debug" or ".git"
+bool is_excluded(const Options *options, const char *path, const char *name) {
+    for (int i = 0; i < options->exclude_count; i++) {
+        const char *glob = options->excludes[i];
+        
+        if (fnmatch(glob, strchr(glob, '/') ? path : name, 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// --shard splits the trees by the entries of each root, by name alone, so
+// every node computes the same split wherever the store is mounted
+bool is_scan_root(const Options *options, const char *path) {
+    for (int i = 0; i < options->dir_count; i++) {
+        if (strcmp(options->dirs[i], path) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// A directory below a root that sits on another file system is skipped
+// with --one-filesystem, and always when that file system is a pseudo one:
+// /proc alone holds a directory per task, none of it an executable. Only
+// mount points get here, so the fstatfs() is rare. An O_PATH descriptor
+// opened without O_DIRECTORY does not trigger an automount, so an autofs
+// mount point is seen as autofs and a dead share behind it is never waited on.
+bool skip_mount(const Options *options, int dir_fd, const char *name) {
+    struct statfs fs;
+    bool pseudo;
+    int fd;
+    
+    if (options->one_filesystem) {
+        return true;
+    }
+    fd = openat(dir_fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    pseudo = fstatfs(fd, &fs) == 0 && is_pseudo_fs((unsigned long)fs.f_type);
+    close(fd);
+    return pseudo;
+}
+
+bool is_pseudo_fs(unsigned long type) {
+    switch ((uint32_t)type) {
+        case PROC_FS_MAGIC:
+        case SYSFS_FS_MAGIC:
+        case DEVPTS_FS_MAGIC:
+        case CGROUP_FS_MAGIC:
+        case CGROUP2_FS_MAGIC:
+        case DEBUGFS_FS_MAGIC:
+        case TRACEFS_FS_MAGIC:
+        case SECURITYFS_FS_MAGIC:
+        case PSTORE_FS_MAGIC:
+        case BPF_FS_MAGIC:
+        case CONFIGFS_FS_MAGIC:
+        case FUSECTL_FS_MAGIC:
+        case MQUEUE_FS_MAGIC:
+        case HUGETLBFS_FS_MAGIC:
+        case BINFMT_FS_MAGIC:
+        case AUTOFS_FS_MAGIC:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// libfoo.so, libfoo.so.1 and libfoo.so.1.2.3 as well as plugins named
+// foo.so; "libfoo.so.py" or "x.sock" are not shared objects
+bool has_shared_object_name(const char *name) {
+    const char *so = name;
+    
+    while ((so = strstr(so + 1, ".so")) != NULL) {
+        const char *p = so + 3;
+        
+        while (*p == '.' && p[1] >= '0' && p[1] <= '9') {
+            p++;
+            while (*p >= '0' && *p <= '9') {
+                p++;
+            }
+        }
+        if (*p == '\0') {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Classify a file in one pass: open it once, reject non-ELF by magic, then
+// take the architecture and the DT_NEEDED list from the same descriptor.
+// Only the file header, program headers, dynamic section and the part of
+// the dynamic string table holding NEEDED names are ever read, so the cost
+// does not depend on the size of the file. Returns false if the file is not
+// a readable ELF file, with info->unreadable set when that is because it
+// could not be opened or read rather than what it holds. With want_paths,
+// DT_RPATH and DT_RUNPATH are read from the string table as well.
+bool inspect_elf_file(int dir_fd, const char *name, uint64_t file_size, ElfInfo *info, bool want_paths) {
+    ElfFile ef;
+    ssize_t len;
+    bool ok;
+    
+    memset(info, 0, sizeof(*info));
+    info->arch = "unknown";
+    
+    ef.fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+    if (ef.fd == -1) {
+        info->unreadable = true;
+        return false;
+    }
+    ef.size = file_size;
+    ef.nbufs = 0;
+    ef.failed = false;
+    
+    // Readahead on a multi-gigabyte binary would pull in far more than the
+    // few pages we look at
+    if (file_size > ELF_LARGE_FILE) {
+        posix_fadvise(ef.fd, 0, 0, POSIX_FADV_RANDOM);
+    }
+    
+    // One read covers the file header and, for almost every binary, the
+    // program header table that immediately follows it
+    do {
+        len = pread(ef.fd, ef.head, sizeof(ef.head), 0);
+    } while (len == -1 && errno == EINTR);
+    ef.head_len = len > 0 ? (size_t)len : 0;
+    ef.failed = len == -1;
+    ef.bytes_read = ef.head_len;
+    ef.bytes_mapped = 0;
+    
+    ok = inspect_elf_head(&ef, info, want_paths);
+    close_elf_file(&ef);
+    
+    return ok;
+}
+
+// Classify an open file whose initial block is already in ef->head
+bool inspect_elf_head(ElfFile *ef, ElfInfo *info, bool want_paths) {
+    bool ok;
+    
+    memset(info, 0, sizeof(*info));
+    info->arch = "unknown";
+    
+    ok = parse_elf_header(ef->head, ef->head_len, &ef->hdr);
+    if (ok) {
+        info->machine = ef->hdr.machine;
+        info->elf_class = ef->hdr.elf_class;
+        info->data = ef->hdr.data;
+        info->kind = ef->hdr.type == ET_EXEC ? ELF_KIND_EXEC : ELF_KIND_SHARED;
+        info->arch = elf_arch_name(ef->hdr.machine, ef->hdr.elf_class, ef->hdr.data);
+        // No point walking the dynamic section of a file we can't classify
+        if (strcmp(info->arch, "unknown") != 0) {
+            ok = read_elf_needed(ef, info, want_paths);
+        }
+    }
+    info->bytes_read = ef->bytes_read;
+    info->bytes_mapped = ef->bytes_mapped;
+    info->unreadable = !ok && ef->failed;
+    
+    return ok;
+}
+
+void close_elf_file(ElfFile *ef) {
+    release_elf_views(ef);
+    close(ef->fd);
+}
+
+void release_elf_views(ElfFile *ef) {
+    for (int i = 0; i < ef->nbufs; i++) {
+        if (ef->bufs[i].mapped) {
+            munmap(ef->bufs[i].base, ef->bufs[i].len);
+        } else {
+            free(ef->bufs[i].base);
+        }
+    }
+    ef->nbufs = 0;
+}
+
+// Turn a --lib argument into the substring searched for in DT_NEEDED:
+// "ssl" and "libssl" both become "libssl.so", anything naming ".so" is kept
+char *build_lib_pattern(const char *lib_search) {
+    size_t size = strlen(lib_search) + sizeof("lib.so");
+    char *lib_pattern = xrealloc(NULL, size);
+    
+    if (strstr(lib_search, ".so") == NULL) {
+        if (strncmp(lib_search, "lib", 3) != 0) {
+            snprintf(lib_pattern, size, "lib%s.so", lib_search);
+        } else {
+            snprintf(lib_pattern, size, "%s.so", lib_search);
+        }
+    } else {
+        snprintf(lib_pattern, size, "%s", lib_search);
+    }
+    
+    return lib_pattern;
+}
+
+// Match the DT_NEEDED entries of one file against the requested libraries.
+// Returns true if at least one of them matched. With --stream, each match
+// is written out instead of recorded, once per library and file just like
+// the report would list it.
+bool get_dependencies(Worker *worker, const char *file_path, const ElfInfo *info) {
+    Options *options = worker->pool->options;
+    int streamed = 0;
+    bool matched = false;
+    
+    // An index keeps every DT_NEEDED string, not just the requested ones
+    if (options->index_path[0]) {
+        for (int n = 0; n < info->needed_count; n++) {
+            record_match(worker, info, -1, info->needed[n], file_path);
+        }
+        return info->needed_count > 0;
+    }
+    
+    // Transitive matches are only known once every library is resolved
+    if (options->transitive) {
+        record_scanned_elf(worker, file_path, info);
+        return false;
+    }
+    
+    for (int n = 0; n < info->needed_count; n++) {
+        int lib = match_library(&options->matcher, info->needed[n]);
+        
+        if (lib < 0) {
+            continue;
+        }
+        matched = true;
+        
+        if (options->stream_format == STREAM_NONE) {
+            record_match(worker, info, lib, NULL, file_path);
+            continue;
+        }
+        
+        bool seen = false;
+        for (int k = 0; k < streamed && !seen; k++) {
+            seen = worker->file_libs[k] == lib;
+        }
+        if (seen) {
+            continue;
+        }
+        if (streamed == worker->file_lib_cap) {
+            worker->file_lib_cap = worker->file_lib_cap ? worker->file_lib_cap * 2 : 16;
+            worker->file_libs = xrealloc(worker->file_libs, worker->file_lib_cap * sizeof(int));
+        }
+        worker->file_libs[streamed++] = lib;
+        stream_match(&worker->stream, info->arch, options->lib_patterns[lib], file_path, info->kind);
+    }
+    if (streamed > 0) {
+        flush_stream_if_due(&worker->stream);
+    }
+    
+    return matched;
+}
+
+// Keep a copy of an ELF file's dependency information for --transitive
+void record_scanned_elf(Worker *worker, const char *file_path, const ElfInfo *info) {
+    if (worker->elf_count == worker->elf_cap) {
+        worker->elf_cap = worker->elf_cap ? worker->elf_cap * 2 : 256;
+        worker->elfs = xrealloc(worker->elfs, worker->elf_cap * sizeof(ScannedElf));
+    }
+    
+    ScannedElf *elf = &worker->elfs[worker->elf_count++];
+    elf->path = arena_strdup(&worker->arena, file_path);
+    copy_elf_info(&elf->info, info, &worker->arena);
+    elf->deps = NULL;
+}
+
+// Copy an ElfInfo into a single block laid out like the one
+// read_elf_needed() builds. Cache hits point into the cache mapping, which
+// is gone by the time dependencies are resolved. The block comes from the
+// arena if one is given; otherwise free_elf_info() releases it.
+void copy_elf_info(ElfInfo *dst, const ElfInfo *src, Arena *arena) {
+    size_t size = elf_info_size(src);
+    
+    *dst = *src;
+    char **list = arena ? arena_alloc(arena, size) : xrealloc(NULL, size);
+    char *out = (char *)(list + src->needed_count);
+    for (int n = 0; n < src->needed_count; n++) {
+        size_t l = strlen(src->needed[n]) + 1;
+        memcpy(out, src->needed[n], l);
+        list[n] = out;
+        out += l;
+    }
+    if (src->rpath) {
+        size_t l = strlen(src->rpath) + 1;
+        memcpy(out, src->rpath, l);
+        dst->rpath = out;
+        out += l;
+    }
+    if (src->runpath) {
+        size_t l = strlen(src->runpath) + 1;
+        memcpy(out, src->runpath, l);
+        dst->runpath = out;
+    }
+    dst->needed = list;
+}
+
+// Bytes of the block copy_elf_info() makes of info
+size_t elf_info_size(const ElfInfo *info) {
+    size_t len = 0;
+    
+    for (int n = 0; n < info->needed_count; n++) {
+        len += strlen(info->needed[n]) + 1;
+    }
+    len += info->rpath ? strlen(info->rpath) + 1 : 0;
+    len += info->runpath ? strlen(info->runpath) + 1 : 0;
+    
+    return info->needed_count * sizeof(char *) + len + 1;
+}
+
+// A table with a limit of limit bytes, 0 for none, splits it between its
+// stripes. A small limit gets fewer of them, as a share smaller than the
+// first entries[] of 64 would refuse every file. Its info blocks then come
+// from the heap, so each one can be counted exactly; an arena block would
+// be too coarse for a small share.
+void init_dedupe_table(DedupeTable *table, size_t limit) {
+    memset(table, 0, sizeof(*table));
+    table->stripe_count = DEDUPE_STRIPES;
+    while (limit && table->stripe_count > 1 &&
+           limit / table->stripe_count < DEDUPE_MIN_STRIPE_ENTRIES * sizeof(DedupeEntry)) {
+        table->stripe_count /= 2;
+    }
+    table->stripe_limit = limit / table->stripe_count;
+    for (int i = 0; i < table->stripe_count; i++) {
+        pthread_mutex_init(&table->stripes[i].lock, NULL);
+    }
+}
+
+void free_dedupe_table(DedupeTable *table) {
+    for (int i = 0; i < table->stripe_count; i++) {
+        DedupeStripe *stripe = &table->stripes[i];
+        
+        if (table->stripe_limit) {
+            for (uint32_t e = 0; e < stripe->cap; e++) {
+                if (stripe->entries[e].used) {
+                    free_elf_info(&stripe->entries[e].info);
+                }
+            }
+        }
+        arena_free(&stripe->arena);
+        free(stripe->entries);
+        pthread_mutex_destroy(&stripe->lock);
+    }
+}
+
+uint64_t dedupe_skipped(const DedupeTable *table) {
+    uint64_t skipped = 0;
+    
+    for (int i = 0; i < table->stripe_count; i++) {
+        skipped += table->stripes[i].skipped;
+    }
+    return skipped;
+}
+
+// What --mem-limit leaves for the workers' match buffers once the hardlink
+// table, and the --dedupe-content one, have their shares
+size_t match_budget(const Options *options) {
+    int tables = options->dedupe_content ? 2 : 1;
+    
+    return options->mem_limit - tables * (options->mem_limit / DEDUPE_LIMIT_SHARE);
+}
+
+// Pick the stripe for a key and the slot its probe starts at. The low bits
+// of the hash choose the stripe, so the slot is taken from the others.
+DedupeStripe *dedupe_stripe(DedupeTable *table, const DedupeKey *key, uint32_t *slot) {
+    uint64_t hash = hash_mix(hash_mix(hash_mix(key->a) ^ key->b) ^ key->c);
+    
+    *slot = (uint32_t)(hash >> 32);
+    return &table->stripes[hash & (table->stripe_count - 1)];
+}
+
+// Look a file up. On a hit, info gets a copy of the classification the
+// first file with this key was given, and *is_elf tells it apart from a
+// file that was not ELF.
+bool dedupe_lookup(DedupeTable *table, const DedupeKey *key, ElfInfo *info, bool *is_elf) {
+    uint32_t slot;
+    DedupeStripe *stripe = dedupe_stripe(table, key, &slot);
+    bool found = false;
+    
+    pthread_mutex_lock(&stripe->lock);
+    for (slot &= stripe->cap - 1; stripe->cap > 0 && stripe->entries[slot].used; slot = (slot + 1) & (stripe->cap - 1)) {
+        DedupeEntry *entry = &stripe->entries[slot];
+        
+        if (memcmp(&entry->key, key, sizeof(*key)) == 0) {
+            // Callers only free the info of ELF files
+            if (entry->is_elf) {
+                copy_elf_info(info, &entry->info, NULL);
+            } else {
+                memset(info, 0, sizeof(*info));
+                info->arch = "unknown";
+            }
+            *is_elf = entry->is_elf;
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    
+    // Nothing was read for this file
+    if (found) {
+        info->bytes_read = 0;
+        info->bytes_mapped = 0;
+    }
+    return found;
+}
+
+// Remember a file's classification under key, unless another worker got
+// there first. Grows at 50% load like HashIndex. A stripe of a table with
+// a limit stops taking files once the entries and their info would not fit
+// its share; those files are then parsed again when seen again.
+void dedupe_insert(DedupeTable *table, const DedupeKey *key, const ElfInfo *info, bool is_elf) {
+    uint32_t hash_slot;
+    DedupeStripe *stripe = dedupe_stripe(table, key, &hash_slot);
+    size_t info_size = table->stripe_limit ? elf_info_size(info) : 0;
+    
+    pthread_mutex_lock(&stripe->lock);
+    if (table->stripe_limit) {
+        bool grow = (stripe->count + 1) * 2 > stripe->cap;
+        size_t entries = (grow ? (stripe->cap ? stripe->cap : 64) : 0) * sizeof(DedupeEntry);
+        
+        if (stripe->bytes + entries + info_size > table->stripe_limit) {
+            stripe->skipped++;
+            pthread_mutex_unlock(&stripe->lock);
+            return;
+        }
+    }
+    if ((stripe->count + 1) * 2 > stripe->cap) {
+        DedupeEntry *old = stripe->entries;
+        uint32_t old_cap = stripe->cap;
+        
+        stripe->cap = old_cap ? old_cap * 2 : 64;
+        stripe->bytes += (stripe->cap - old_cap) * sizeof(DedupeEntry);
+        stripe->entries = calloc(stripe->cap, sizeof(DedupeEntry));
+        if (stripe->entries == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        for (uint32_t i = 0; i < old_cap; i++) {
+            if (!old[i].used) {
+                continue;
+            }
+            uint32_t slot;
+            dedupe_stripe(table, &old[i].key, &slot);
+            for (slot &= stripe->cap - 1; stripe->entries[slot].used; slot = (slot + 1) & (stripe->cap - 1)) {
+            }
+            stripe->entries[slot] = old[i];
+        }
+        free(old);
+    }
+    
+    uint32_t slot = hash_slot & (stripe->cap - 1);
+    bool present = false;
+    for (; stripe->entries[slot].used && !present; slot = (slot + 1) & (stripe->cap - 1)) {
+        present = memcmp(&stripe->entries[slot].key, key, sizeof(*key)) == 0;
+    }
+    if (!present) {
+        DedupeEntry *entry = &stripe->entries[slot];
+        
+        entry->key = *key;
+        entry->used = true;
+        entry->is_elf = is_elf;
+        copy_elf_info(&entry->info, info, table->stripe_limit ? NULL : &stripe->arena);
+        stripe->bytes += info_size;
+        stripe->count++;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+// Resolve the dependencies of every ELF file the scan found, then list each
+// file under every --lib pattern that occurs anywhere in its dependency
+// closure. Each shared object is loaded and resolved once, soname lookups
+// are memoized, and closures are computed once over the whole graph, so the
+// cost grows with the number of distinct libraries rather than with files
+// times closure size.
+void resolve_transitive(ScanPool *pool) {
+    Options *options = pool->options;
+    Resolver r;
+    char origin[MAX_PATH];
+    char rpath[MAX_SEARCH_PATH];
+    int file_total = 0, matched = 0;
+    uint32_t unresolved = 0;
+    
+    memset(&r, 0, sizeof(r));
+    r.sysroot = options->sysroot;
+    r.words = (options->lib_count + 63) / 64;
+    load_ld_cache(&r.ld_cache, r.sysroot);
+    intern_context(&r, "");
+    
+    // Executables first. The libraries they pull in are appended to nodes[]
+    // and resolved in turn by the loop below, until nothing new turns up.
+    for (int i = 0; i < pool->worker_count; i++) {
+        Worker *w = &pool->workers[i];
+        
+        for (int e = 0; e < w->elf_count; e++) {
+            ScannedElf *elf = &w->elfs[e];
+            size_t len = 0;
+            
+            // Without a DT_RUNPATH, an executable's DT_RPATH is also
+            // searched for the libraries it loads
+            object_origin(elf->path, origin);
+            rpath[0] = '\0';
+            if (elf->info.rpath && !elf->info.runpath) {
+                append_search_path(rpath, sizeof(rpath), &len, elf->info.rpath, origin, r.sysroot);
+            }
+            uint32_t context = intern_context(&r, rpath);
+            
+            elf->deps = arena_alloc(&r.arena, (elf->info.needed_count + 1) * sizeof(int));
+            for (int n = 0; n < elf->info.needed_count; n++) {
+                elf->deps[n] = resolve_soname(&r, &elf->info, origin, "", context, elf->info.needed[n]);
+            }
+            file_total++;
+        }
+    }
+    for (int i = 0; i < r.node_count; i++) {
+        // nodes[] may move while this node's dependencies are loaded
+        ElfInfo from = r.nodes[i].info;
+        uint32_t context = r.nodes[i].context;
+        const char *inherited = r.contexts[context];
+        int *deps = arena_alloc(&r.arena, (from.needed_count + 1) * sizeof(int));
+        
+        object_origin(r.nodes[i].path, origin);
+        for (int n = 0; n < from.needed_count; n++) {
+            deps[n] = resolve_soname(&r, &from, origin, inherited, context, from.needed[n]);
+        }
+        r.nodes[i].deps = deps;
+    }
+    
+    compute_closures(&r, &options->matcher);
+    
+    uint64_t *acc = xrealloc(NULL, r.words * sizeof(uint64_t));
+    for (int i = 0; i < pool->worker_count; i++) {
+        Worker *w = &pool->workers[i];
+        
+        for (int e = 0; e < w->elf_count; e++) {
+            ScannedElf *elf = &w->elfs[e];
+            int arch_index = -1;
+            
+            memset(acc, 0, r.words * sizeof(uint64_t));
+            for (int n = 0; n < elf->info.needed_count; n++) {
+                int lib = match_library(&options->matcher, elf->info.needed[n]);
+                int dep = elf->deps[n];
+                
+                if (lib >= 0) {
+                    acc[lib / 64] |= 1ULL << (lib % 64);
+                }
+                if (dep >= 0) {
+                    for (int k = 0; k < r.words; k++) {
+                        acc[k] |= r.bits[(size_t)dep * r.words + k];
+                    }
+                }
+            }
+            
+            for (int lib = 0; lib < options->lib_count; lib++) {
+                if (!(acc[lib / 64] & (1ULL << (lib % 64)))) {
+                    continue;
+                }
+                if (arch_index < 0) {
+                    arch_index = find_or_add_architecture(elf->info.arch);
+                    matched++;
+                }
+                add_executable(arch_index, find_or_add_library(arch_index, options->lib_patterns[lib]),
+                               elf->path, elf->info.kind);
+            }
+        }
+        free(w->elfs);
+        w->elfs = NULL;
+        w->elf_count = 0;
+    }
+    free(acc);
+    
+    for (uint32_t i = 0; i < r.resolved_count; i++) {
+        unresolved += r.resolved[i].node < 0;
+    }
+    fprintf(progress_out, "Resolved %d shared objects for %d ELF files, %d of them match (%u sonames not found)\n",
+            r.node_count, file_total, matched, unresolved);
+    
+    arena_free(&r.arena);
+    free(r.nodes);
+    free(r.resolved);
+    free(r.contexts);
+    free(r.bits);
+    free(r.node_map.hashes);
+    free(r.node_map.values);
+    free(r.resolve_map.hashes);
+    free(r.resolve_map.values);
+    free(r.context_map.hashes);
+    free(r.context_map.values);
+    unload_ld_cache(&r.ld_cache);
+}
+
+// Find the object a NEEDED entry of `from` refers to, searching the way
+// ld.so does: DT_RPATH (only without a DT_RUNPATH), then the RPATH inherited
+// from the executable, DT_RUNPATH, ld.so.cache and the default directories.
+// Candidates of another machine, class or byte order are skipped, as ld.so
+// skips them. LD_LIBRARY_PATH is ignored on purpose: it belongs to this
+// process, not to the scanned tree. Returns the node, or -1.
+int resolve_soname(Resolver *r, const ElfInfo *from, const char *origin, const char *inherited, uint32_t context, const char *soname) {
+    char search[MAX_SEARCH_PATH];
+    char key[MAX_SEARCH_PATH + MAX_PATH + 64];
+    char path[MAX_PATH];
+    size_t len = 0;
+    int node = -1;
+    
+    if (strlen(soname) >= MAX_PATH) {
+        return -1;
+    }
+    
+    // A NEEDED entry with a slash names the file itself; a relative one
+    // would depend on the working directory of the process
+    if (strchr(soname, '/') != NULL) {
+        if (soname[0] != '/' || snprintf(path, sizeof(path), "%s%s", r->sysroot, soname) >= (int)sizeof(path)) {
+            return -1;
+        }
+        return load_shared_object(r, path, from, context);
+    }
+    
+    search[0] = '\0';
+    if (from->runpath == NULL) {
+        if (from->rpath != NULL) {
+            append_search_path(search, sizeof(search), &len, from->rpath, origin, r->sysroot);
+        }
+        append_search_path(search, sizeof(search), &len, inherited, origin, "");
+    } else {
+        append_search_path(search, sizeof(search), &len, from->runpath, origin, r->sysroot);
+    }
+    
+    size_t key_len = snprintf(key, sizeof(key), "%u/%u/%u/%u:%s:%s", from->machine, from->elf_class,
+                              from->data, context, search, soname);
+    ResolveKey rk = { r, key, key_len };
+    uint64_t hash = hash_bytes(key, key_len, 0);
+    uint32_t found = hash_index_find(&r->resolve_map, hash, resolve_key_equals, &rk);
+    if (found != HASH_EMPTY) {
+        return r->resolved[found].node;
+    }
+    
+    for (const char *dir = search; node < 0 && *dir; ) {
+        size_t dir_len = strcspn(dir, ":");
+        
+        if (dir_len + strlen(soname) + 2 <= MAX_PATH) {
+            snprintf(path, sizeof(path), "%.*s/%s", (int)dir_len, dir, soname);
+            node = load_shared_object(r, path, from, context);
+        }
+        dir += dir_len;
+        if (*dir == ':') {
+            dir++;
+        }
+    }
+    
+    if (node < 0 && r->ld_cache.map != NULL) {
+        LdCacheKey ck = { &r->ld_cache, soname };
+        uint32_t i = hash_index_find(&r->ld_cache.name_map, hash_bytes(soname, strlen(soname), 0),
+                                     ld_cache_name_equals, &ck);
+        
+        for (; node < 0 && i < r->ld_cache.count && strcmp(r->ld_cache.names[i], soname) == 0; i++) {
+            if (snprintf(path, sizeof(path), "%s%s", r->sysroot, r->ld_cache.paths[i]) < (int)sizeof(path)) {
+                node = load_shared_object(r, path, from, context);
+            }
+        }
+    }
+    
+    if (node < 0) {
+        const char *triplet = multiarch_triplet(from);
+        const char *dirs[6];
+        char multiarch[2][64];
+        int dir_count = 0;
+        
+        if (triplet != NULL) {
+            snprintf(multiarch[0], sizeof(multiarch[0]), "/lib/%s", triplet);
+            snprintf(multiarch[1], sizeof(multiarch[1]), "/usr/lib/%s", triplet);
+            dirs[dir_count++] = multiarch[0];
+            dirs[dir_count++] = multiarch[1];
+        }
+        if (from->elf_class == ELFCLASS64) {
+            dirs[dir_count++] = "/lib64";
+            dirs[dir_count++] = "/usr/lib64";
+        }
+        dirs[dir_count++] = "/lib";
+        dirs[dir_count++] = "/usr/lib";
+        
+        for (int d = 0; node < 0 && d < dir_count; d++) {
+            if (strlen(r->sysroot) + strlen(dirs[d]) + strlen(soname) + 2 <= MAX_PATH) {
+                snprintf(path, sizeof(path), "%s%s/%s", r->sysroot, dirs[d], soname);
+                node = load_shared_object(r, path, from, context);
+            }
+        }
+    }
+    
+    if (r->resolved_count == r->resolved_cap) {
+        r->resolved_cap = r->resolved_cap ? r->resolved_cap * 2 : 256;
+        r->resolved = xrealloc(r->resolved, r->resolved_cap * sizeof(ResolveEntry));
+    }
+    ResolveEntry *entry = &r->resolved[r->resolved_count];
+    entry->key = arena_alloc(&r->arena, key_len);
+    memcpy(entry->key, key, key_len);
+    entry->key_len = key_len;
+    entry->node = node;
+    hash_index_insert(&r->resolve_map, hash, r->resolved_count++);
+    
+    return node;
+}
+
+// Return the node for the shared object at path, loading it on first use,
+// or -1 if there is no such file or `from` could not load it (another
+// machine, class or byte order), in which case the search goes on
+int load_shared_object(Resolver *r, const char *path, const ElfInfo *from, uint32_t context) {
+    struct stat st;
+    ElfInfo info;
+    
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    
+    NodeKey key = { r, st.st_dev, st.st_ino, context };
+    uint64_t hash = hash_mix(cache_key_hash(st.st_dev, st.st_ino) ^ context);
+    uint32_t found = hash_index_find(&r->node_map, hash, node_equals, &key);
+    if (found != HASH_EMPTY) {
+        const ElfInfo *known = &r->nodes[found].info;
+        bool compatible = known->machine == from->machine && known->elf_class == from->elf_class &&
+                          known->data == from->data;
+        return compatible ? (int)found : -1;
+    }
+    
+    if (!inspect_elf_file(AT_FDCWD, path, st.st_size, &info, true) ||
+        info.machine != from->machine || info.elf_class != from->elf_class || info.data != from->data) {
+        free_elf_info(&info);
+        return -1;
+    }
+    
+    if (r->node_count == r->node_cap) {
+        r->node_cap = r->node_cap ? r->node_cap * 2 : 256;
+        r->nodes = xrealloc(r->nodes, r->node_cap * sizeof(SharedObject));
+    }
+    SharedObject *node = &r->nodes[r->node_count];
+    node->path = arena_strdup(&r->arena, path);
+    node->dev = st.st_dev;
+    node->ino = st.st_ino;
+    node->context = context;
+    copy_elf_info(&node->info, &info, &r->arena);
+    free_elf_info(&info);
+    node->deps = NULL;
+    hash_index_insert(&r->node_map, hash, r->node_count);
+    
+    return r->node_count++;
+}
+
+// The directory $ORIGIN stands for: the one holding the object
+void object_origin(const char *path, char *origin) {
+    const char *slash = strrchr(path, '/');
+    
+    if (slash == NULL) {
+        strcpy(origin, ".");
+        return;
+    }
+    memcpy(origin, path, slash - path);
+    origin[slash - path] = '\0';
+}
+
+// Append the directories of a DT_RPATH/DT_RUNPATH list to a colon-separated
+// search path: $ORIGIN becomes the directory of the object and other
+// absolute entries move under the sysroot. Relative entries, entries using
+// other dynamic string tokens and entries that do not fit are left out.
+void append_search_path(char *out, size_t out_size, size_t *len, const char *list, const char *origin, const char *sysroot) {
+    while (*list) {
+        size_t entry_len = strcspn(list, ":");
+        const char *prefix = NULL;
+        const char *rest = list;
+        size_t rest_len = entry_len;
+        
+        if (entry_len >= 7 && strncmp(list, "$ORIGIN", 7) == 0) {
+            prefix = origin;
+            rest += 7;
+            rest_len -= 7;
+        } else if (entry_len >= 9 && strncmp(list, "${ORIGIN}", 9) == 0) {
+            prefix = origin;
+            rest += 9;
+            rest_len -= 9;
+        } else if (entry_len > 0 && list[0] == '/') {
+            prefix = sysroot;
+        }
+        
+        if (prefix != NULL && (rest_len == 0 || rest[0] == '/') && memchr(rest, '$', rest_len) == NULL) {
+            size_t prefix_len = strlen(prefix);
+            
+            if (*len + 1 + prefix_len + rest_len < out_size) {
+                if (*len > 0) {
+                    out[(*len)++] = ':';
+                }
+                memcpy(out + *len, prefix, prefix_len);
+                memcpy(out + *len + prefix_len, rest, rest_len);
+                *len += prefix_len + rest_len;
+                out[*len] = '\0';
+            }
+        }
+        
+        list += entry_len;
+        if (*list == ':') {
+            list++;
+        }
+    }
+}
+
+// Number a distinct inherited search path, so nodes can carry it as a small id
+uint32_t intern_context(Resolver *r, const char *search_path) {
+    uint64_t hash = hash_bytes(search_path, strlen(search_path), 0);
+    ContextKey key = { r, search_path };
+    uint32_t found = hash_index_find(&r->context_map, hash, context_equals, &key);
+    
+    if (found != HASH_EMPTY) {
+        return found;
+    }
+    
+    if (r->context_count == r->context_cap) {
+        r->context_cap = r->context_cap ? r->context_cap * 2 : 16;
+        r->contexts = xrealloc(r->contexts, r->context_cap * sizeof(char *));
+    }
+    r->contexts[r->context_count] = arena_strdup(&r->arena, search_path);
+    hash_index_insert(&r->context_map, hash, r->context_count);
+    return r->context_count++;
+}
+
+// Compute, for every node, the --lib patterns matched by any NEEDED entry in
+// its dependency closure. Libraries that depend on each other in a cycle
+// share one closure, so Tarjan's algorithm (iterative, the graph can be
+// deep) groups the nodes into strongly connected components and finishes
+// them in reverse topological order: a component's set is the union of its
+// members' own matches and the already final sets of the components it
+// depends on. Each edge is looked at once.
+void compute_closures(Resolver *r, const LibMatcher *matcher) {
+    int n = r->node_count;
+    int words = r->words;
+    int *index = xrealloc(NULL, (n + 1) * sizeof(int));
+    int *lowlink = xrealloc(NULL, (n + 1) * sizeof(int));
+    int *component = xrealloc(NULL, (n + 1) * sizeof(int));
+    int *stack = xrealloc(NULL, (n + 1) * sizeof(int));
+    int *call_node = xrealloc(NULL, (n + 1) * sizeof(int));
+    int *call_pos = xrealloc(NULL, (n + 1) * sizeof(int));
+    int sp = 0, csp = 0, counter = 0, component_count = 0;
+    
+    r->bits = calloc((size_t)(n + 1) * words, sizeof(uint64_t));
+    if (r->bits == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        index[i] = -1;
+        component[i] = -1;
+    }
+    
+    for (int root = 0; root < n; root++) {
+        if (index[root] != -1) {
+            continue;
+        }
+        index[root] = lowlink[root] = counter++;
+        stack[sp++] = root;
+        call_node[csp] = root;
+        call_pos[csp++] = 0;
+        
+        while (csp > 0) {
+            int v = call_node[csp - 1];
+            const SharedObject *node = &r->nodes[v];
+            
+            if (call_pos[csp - 1] < node->info.needed_count) {
+                int w = node->deps[call_pos[csp - 1]++];
+                
+                if (w < 0) {
+                    continue;
+                }
+                if (index[w] == -1) {
+                    index[w] = lowlink[w] = counter++;
+                    stack[sp++] = w;
+                    call_node[csp] = w;
+                    call_pos[csp++] = 0;
+                } else if (component[w] == -1 && index[w] < lowlink[v]) {
+                    // Visited but not in a finished component: still on the stack
+                    lowlink[v] = index[w];
+                }
+                continue;
+            }
+            
+            csp--;
+            if (csp > 0 && lowlink[v] < lowlink[call_node[csp - 1]]) {
+                lowlink[call_node[csp - 1]] = lowlink[v];
+            }
+            if (lowlink[v] != index[v]) {
+                continue;
+            }
+            
+            // v is the root of a component made of everything above it on the stack
+            int first = sp;
+            do {
+                first--;
+                component[stack[first]] = component_count;
+            } while (stack[first] != v);
+            
+            uint64_t *acc = r->bits + (size_t)v * words;
+            for (int m = first; m < sp; m++) {
+                const SharedObject *member = &r->nodes[stack[m]];
+                
+                for (int k = 0; k < member->info.needed_count; k++) {
+                    int lib = match_library(matcher, member->info.needed[k]);
+                    int dep = member->deps[k];
+                    
+                    if (lib >= 0) {
+                        acc[lib / 64] |= 1ULL << (lib % 64);
+                    }
+                    if (dep >= 0 && component[dep] != component_count) {
+                        for (int w = 0; w < words; w++) {
+                            acc[w] |= r->bits[(size_t)dep * words + w];
+                        }
+                    }
+                }
+            }
+            for (int m = first; m < sp; m++) {
+                if (stack[m] != v) {
+                    memcpy(r->bits + (size_t)stack[m] * words, acc, words * sizeof(uint64_t));
+                }
+            }
+            sp = first;
+            component_count++;
+        }
+    }
+    
+    free(index);
+    free(lowlink);
+    free(component);
+    free(stack);
+    free(call_node);
+    free(call_pos);
+}
+
+// Debian-style multiarch directory name for a machine, searched before the
+// classic library directories
+const char *multiarch_triplet(const ElfInfo *info) {
+    const ArchInfo *arch = elf_arch(info->machine, info->elf_class, info->data);
+    
+    return arch ? arch->triplet : NULL;
+}
+
+// Map sysroot/etc/ld.so.cache. Both the current format and the combined
+// old and new format written by older ldconfig versions are understood.
+// Without a usable cache fewer libraries resolve, which is not an error.
+bool load_ld_cache(LdCache *cache, const char *sysroot) {
+    char path[MAX_PATH];
+    struct stat st;
+    int fd;
+    
+    memset(cache, 0, sizeof(*cache));
+    
+    snprintf(path, sizeof(path), "%s/etc/ld.so.cache", sysroot);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < LD_CACHE_HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+    
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    
+    const char *base = map;
+    size_t size = st.st_size;
+    size_t start = 0;
+    uint32_t nlibs;
+    
+    // The old format's table comes first; the new one follows it, 8-byte aligned
+    if (memcmp(base, LD_CACHE_OLD_MAGIC, strlen(LD_CACHE_OLD_MAGIC)) == 0) {
+        memcpy(&nlibs, base + 12, sizeof(nlibs));
+        start = (16 + (size_t)nlibs * 12 + 7) & ~(size_t)7;
+    }
+    if (start > size - LD_CACHE_HEADER_SIZE ||
+        memcmp(base + start, LD_CACHE_MAGIC, strlen(LD_CACHE_MAGIC)) != 0) {
+        munmap(map, size);
+        return false;
+    }
+    memcpy(&nlibs, base + start + 20, sizeof(nlibs));
+    
+    // String offsets in the new format are relative to its header
+    const char *strings = base + start;
+    size_t strings_size = size - start;
+    size_t entries = start + LD_CACHE_HEADER_SIZE;
+    if (nlibs > (size - entries) / LD_CACHE_ENTRY_SIZE) {
+        munmap(map, size);
+        return false;
+    }
+    
+    cache->map = map;
+    cache->map_size = size;
+    cache->names = xrealloc(NULL, ((size_t)nlibs + 1) * sizeof(char *));
+    cache->paths = xrealloc(NULL, ((size_t)nlibs + 1) * sizeof(char *));
+    for (uint32_t i = 0; i < nlibs; i++) {
+        const char *e = base + entries + (size_t)i * LD_CACHE_ENTRY_SIZE;
+        uint32_t key, value;
+        
+        memcpy(&key, e + 4, sizeof(key));
+        memcpy(&value, e + 8, sizeof(value));
+        if (key >= strings_size || value >= strings_size ||
+            memchr(strings + key, '\0', strings_size - key) == NULL ||
+            memchr(strings + value, '\0', strings_size - value) == NULL) {
+            continue;
+        }
+        
+        const char *name = strings + key;
+        cache->names[cache->count] = name;
+        cache->paths[cache->count] = strings + value;
+        if (cache->count == 0 || strcmp(cache->names[cache->count - 1], name) != 0) {
+            hash_index_insert(&cache->name_map, hash_bytes(name, strlen(name), 0), cache->count);
+        }
+        cache->count++;
+    }
+    
+    return true;
+}
+
+void unload_ld_cache(LdCache *cache) {
+    if (cache->map != NULL) {
+        munmap(cache->map, cache->map_size);
+    }
+    free(cache->names);
+    free(cache->paths);
+    free(cache->name_map.hashes);
+    free(cache->name_map.values);
+    memset(cache, 0, sizeof(*cache));
+}
+
+bool node_equals(uint32_t value, const void *key) {
+    const NodeKey *k = key;
+    const SharedObject *node = &k->resolver->nodes[value];
+    
+    return node->dev == k->dev && node->ino == k->ino && node->context == k->context;
+}
+
+bool resolve_key_equals(uint32_t value, const void *key) {
+    const ResolveKey *k = key;
+    const ResolveEntry *entry = &k->resolver->resolved[value];
+    
+    return entry->key_len == k->len && memcmp(entry->key, k->key, k->len) == 0;
+}
+
+bool context_equals(uint32_t value, const void *key) {
+    const ContextKey *k = key;
+    
+    return strcmp(k->resolver->contexts[value], k->name) == 0;
+}
+
+bool ld_cache_name_equals(uint32_t value, const void *key) {
+    const LdCacheKey *k = key;
+    
+    return strcmp(k->cache->names[value], k->name) == 0;
+}
+
+void build_lib_matcher(LibMatcher *matcher, char **patterns, int count) {
+    int max_nodes = 1;
+    int node_count = 1;
+    
+    memset(matcher, 0, sizeof(*matcher));
+    
+    // Assign a class to every byte that occurs in a pattern
+    matcher->class_count = 1;
+    for (int i = 0; i < count; i++) {
+        for (const unsigned char *p = (const unsigned char *)patterns[i]; *p; p++) {
+            if (matcher->byte_class[*p] == 0) {
+                matcher->byte_class[*p] = (unsigned char)matcher->class_count++;
+            }
+        }
+        max_nodes += strlen(patterns[i]);
+    }
+    
+    int classes = matcher->class_count;
+    int *next = xrealloc(NULL, (size_t)max_nodes * classes * sizeof(int));
+    int *best = xrealloc(NULL, max_nodes * sizeof(int));
+    int *fail = xrealloc(NULL, max_nodes * sizeof(int));
+    int *queue = xrealloc(NULL, max_nodes * sizeof(int));
+    
+    // Trie of all patterns; -1 marks a missing edge until the DFA is built
+    memset(next, 0xff, (size_t)max_nodes * classes * sizeof(int));
+    best[0] = -1;
+    for (int i = 0; i < count; i++) {
+        int node = 0;
+        
+        for (const unsigned char *p = (const unsigned char *)patterns[i]; *p; p++) {
+            int *edge = &next[node * classes + matcher->byte_class[*p]];
+            if (*edge < 0) {
+                best[node_count] = -1;
+                *edge = node_count++;
+            }
+            node = *edge;
+        }
+        // Earlier --lib arguments take precedence, as in the original loop
+        if (best[node] < 0) {
+            best[node] = i;
+        }
+    }
+    
+    // Breadth-first pass: fill in failure transitions and fold the outputs
+    // of each node's failure chain into best[]
+    int head = 0, tail = 0;
+    fail[0] = 0;
+    for (int c = 0; c < classes; c++) {
+        int child = next[c];
+        if (child < 0) {
+            next[c] = 0;
+        } else {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        int node = queue[head++];
+        int f = fail[node];
+        
+        if (best[f] >= 0 && (best[node] < 0 || best[f] < best[node])) {
+            best[node] = best[f];
+        }
+        for (int c = 0; c < classes; c++) {
+            int child = next[node * classes + c];
+            if (child < 0) {
+                next[node * classes + c] = next[f * classes + c];
+            } else {
+                fail[child] = next[f * classes + c];
+                queue[tail++] = child;
+            }
+        }
+    }
+    
+    free(fail);
+    free(queue);
+    matcher->next = next;
+    matcher->best = best;
+    matcher->node_count = node_count;
+}
+
+// Return the lowest index of a pattern occurring in lib_name, or -1
+int match_library(const LibMatcher *matcher, const char *lib_name) {
+    int state = 0;
+    int found = -1;
+    
+    for (const unsigned char *p = (const unsigned char *)lib_name; *p; p++) {
+        state = matcher->next[state * matcher->class_count + matcher->byte_class[*p]];
+        
+        int lib = matcher->best[state];
+        if (lib >= 0 && (found < 0 || lib < found)) {
+            found = lib;
+            if (found == 0) {
+                break;
+            }
+        }
+    }
+    
+    return found;
+}
+
+void free_lib_matcher(LibMatcher *matcher) {
+    free(matcher->next);
+    free(matcher->best);
+    memset(matcher, 0, sizeof(*matcher));
+}
+
+void free_elf_info(ElfInfo *info) {
+    free(info->needed);
+    info->needed = NULL;
+    info->needed_count = 0;
+    info->rpath = NULL;
+    info->runpath = NULL;
+}
+
+// Convert a multi-byte field from the file's byte order to host order
+uint16_t elf_u16(const ElfHeader *hdr, const unsigned char *p) {
+    if (hdr->data == ELFDATA2MSB) {
+        return (uint16_t)((p[0] << 8) | p[1]);
+    }
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+uint32_t elf_u32(const ElfHeader *hdr, const unsigned char *p) {
+    if (hdr->data == ELFDATA2MSB) {
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+               ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+    }
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint64_t elf_u64(const ElfHeader *hdr, const unsigned char *p) {
+    if (hdr->data == ELFDATA2MSB) {
+        return ((uint64_t)elf_u32(hdr, p) << 32) | elf_u32(hdr, p + 4);
+    }
+    return ((uint64_t)elf_u32(hdr, p + 4) << 32) | elf_u32(hdr, p);
+}
+
+// Read a word-sized field (32 bits for ELFCLASS32, 64 bits for ELFCLASS64)
+uint64_t elf_word(const ElfHeader *hdr, const unsigned char *p) {
+    return hdr->elf_class == ELFCLASS64 ? elf_u64(hdr, p) : elf_u32(hdr, p);
+}
+
+// Validate the ELF file header at the start of buf, both ELF32 and ELF64 in
+// either byte order
+bool parse_elf_header(const unsigned char *buf, size_t len, ElfHeader *hdr) {
+    if (len < EI_NIDENT || memcmp(buf, ELFMAG, SELFMAG) != 0) {
+        return false;
+    }
+    
+    hdr->elf_class = buf[EI_CLASS];
+    hdr->data = buf[EI_DATA];
+    if (hdr->data != ELFDATA2LSB && hdr->data != ELFDATA2MSB) {
+        return false;
+    }
+    
+    if (hdr->elf_class == ELFCLASS64) {
+        if (len < sizeof(Elf64_Ehdr)) {
+            return false;
+        }
+        hdr->type = elf_u16(hdr, buf + offsetof(Elf64_Ehdr, e_type));
+        hdr->machine = elf_u16(hdr, buf + offsetof(Elf64_Ehdr, e_machine));
+        hdr->phoff = elf_u64(hdr, buf + offsetof(Elf64_Ehdr, e_phoff));
+        hdr->phentsize = elf_u16(hdr, buf + offsetof(Elf64_Ehdr, e_phentsize));
+        hdr->phnum = elf_u16(hdr, buf + offsetof(Elf64_Ehdr, e_phnum));
+        if (hdr->phnum > 0 && hdr->phentsize < sizeof(Elf64_Phdr)) {
+            return false;
+        }
+    } else if (hdr->elf_class == ELFCLASS32) {
+        if (len < sizeof(Elf32_Ehdr)) {
+            return false;
+        }
+        hdr->type = elf_u16(hdr, buf + offsetof(Elf32_Ehdr, e_type));
+        hdr->machine = elf_u16(hdr, buf + offsetof(Elf32_Ehdr, e_machine));
+        hdr->phoff = elf_u32(hdr, buf + offsetof(Elf32_Ehdr, e_phoff));
+        hdr->phentsize = elf_u16(hdr, buf + offsetof(Elf32_Ehdr, e_phentsize));
+        hdr->phnum = elf_u16(hdr, buf + offsetof(Elf32_Ehdr, e_phnum));
+        if (hdr->phnum > 0 && hdr->phentsize < sizeof(Elf32_Phdr)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    
+    // Object files and core dumps are never loaded, so they have no NEEDED
+    // entries of interest even when some build leaves them executable
+    if (hdr->type != ET_EXEC && hdr->type != ET_DYN) {
+        return false;
+    }
+    
+    return true;
+}
+
+// Look up a machine, class and byte order in one table. Only
+// combinations that exist on Linux are filled in, so an x86_64 file with
+// a 32-bit header is x32, while a big-endian x86 file is nobody's.
+// parse_elf_header() has already checked class and data.
+const ArchInfo *elf_arch(uint16_t machine, unsigned char elf_class, unsigned char data) {
+#define ARCH(m, c, d) [m][ELFCLASS##c - 1][ELFDATA2##d - 1]
+    static const ArchInfo arch_table[ELF_MACHINE_COUNT][2][2] = {
+        ARCH(EM_386, 32, LSB) = { "x86", "i386-linux-gnu" },
+        ARCH(EM_X86_64, 64, LSB) = { "x86_64", "x86_64-linux-gnu" },
+        ARCH(EM_X86_64, 32, LSB) = { "x32", "x86_64-linux-gnux32" },
+        ARCH(EM_AARCH64, 64, LSB) = { "aarch64", "aarch64-linux-gnu" },
+        ARCH(EM_AARCH64, 64, MSB) = { "aarch64_be", "aarch64_be-linux-gnu" },
+        ARCH(EM_ARM, 32, LSB) = { "armv7", "arm-linux-gnueabihf" },
+        ARCH(EM_ARM, 32, MSB) = { "armeb", NULL },
+        ARCH(EM_RISCV, 64, LSB) = { "riscv64", "riscv64-linux-gnu" },
+        ARCH(EM_RISCV, 32, LSB) = { "riscv32", NULL },
+        ARCH(EM_PPC64, 64, LSB) = { "ppc64le", "powerpc64le-linux-gnu" },
+        ARCH(EM_PPC64, 64, MSB) = { "ppc64", "powerpc64-linux-gnu" },
+        ARCH(EM_PPC, 32, MSB) = { "ppc", "powerpc-linux-gnu" },
+        ARCH(EM_S390, 64, MSB) = { "s390x", "s390x-linux-gnu" },
+        ARCH(EM_S390, 32, MSB) = { "s390", NULL },
+        ARCH(EM_MIPS, 32, MSB) = { "mips", "mips-linux-gnu" },
+        ARCH(EM_MIPS, 32, LSB) = { "mipsel", "mipsel-linux-gnu" },
+        ARCH(EM_MIPS, 64, MSB) = { "mips64", "mips64-linux-gnuabi64" },
+        ARCH(EM_MIPS, 64, LSB) = { "mips64el", "mips64el-linux-gnuabi64" },
+        ARCH(EM_LOONGARCH, 64, LSB) = { "loongarch64", "loongarch64-linux-gnu" },
+        ARCH(EM_SPARCV9, 64, MSB) = { "sparc64", "sparc64-linux-gnu" },
+        ARCH(EM_IA_64, 64, LSB) = { "ia64", "ia64-linux-gnu" },
+        ARCH(EM_PARISC, 32, MSB) = { "hppa", "hppa-linux-gnu" },
+        ARCH(EM_68K, 32, MSB) = { "m68k", "m68k-linux-gnu" },
+        ARCH(EM_SH, 32, LSB) = { "sh4", "sh4-linux-gnu" },
+    };
+#undef ARCH
+    
+    if (machine >= ELF_MACHINE_COUNT || elf_class < ELFCLASS32 || elf_class > ELFCLASS64 ||
+        data < ELFDATA2LSB || data > ELFDATA2MSB) {
+        return NULL;
+    }
+    const ArchInfo *arch = &arch_table[machine][elf_class - 1][data - 1];
+    return arch->name ? arch : NULL;
+}
+
+const char *elf_arch_name(uint16_t machine, unsigned char elf_class, unsigned char data) {
+    const ArchInfo *arch = elf_arch(machine, elf_class, data);
+    
+    return arch ? arch->name : "unknown";
+}
+
+const char *elf_kind_name(unsigned char kind) {
+    switch (kind) {
+        case ELF_KIND_EXEC:
+            return "exec";
+        case ELF_KIND_PIE:
+            return "pie";
+        default:
+            return "shared";
+    }
+}
+
+// Return a view of len bytes at offset. Ranges inside the initial header
+// block are served from it. Anything else is read with a single pread into
+// a buffer owned by ef or, if large, mapped read-only with readahead turned
+// off. Views past the end of the file are refused, so a mapping can never
+// fault on a page the file does not have.
+const unsigned char *elf_view(ElfFile *ef, uint64_t offset, uint64_t len) {
+    ElfBuffer *buf;
+    ssize_t got;
+    
+    if (len == 0 || len > MAX_ELF_TABLE || offset > ef->size || len > ef->size - offset) {
+        return NULL;
+    }
+    
+    if (offset + len <= ef->head_len) {
+        return ef->head + offset;
+    }
+    
+    if (ef->nbufs == ELF_MAX_VIEWS) {
+        return NULL;
+    }
+    buf = &ef->bufs[ef->nbufs];
+    
+    // Large ranges are mapped so only the pages actually touched are read
+    if (len >= ELF_MMAP_THRESHOLD) {
+        long page = sysconf(_SC_PAGESIZE);
+        uint64_t start = offset & ~(uint64_t)(page - 1);
+        
+        buf->len = len + (offset - start);
+        buf->base = mmap(NULL, buf->len, PROT_READ, MAP_PRIVATE, ef->fd, (off_t)start);
+        if (buf->base == MAP_FAILED) {
+            ef->failed = true;
+            return NULL;
+        }
+        madvise(buf->base, buf->len, MADV_RANDOM);
+        buf->mapped = true;
+        ef->bytes_mapped += buf->len;
+        ef->nbufs++;
+        return (const unsigned char *)buf->base + (offset - start);
+    }
+    
+    buf->base = malloc(len);
+    if (buf->base == NULL) {
+        ef->failed = true;
+        return NULL;
+    }
+    
+    // A short read means the file shrank since it was stat'ed, and its
+    // cache entry will not match the new size anyway
+    do {
+        got = pread(ef->fd, buf->base, len, (off_t)offset);
+    } while (got == -1 && errno == EINTR);
+    if (got != (ssize_t)len) {
+        ef->failed = got == -1;
+        free(buf->base);
+        return NULL;
+    }
+    buf->len = len;
+    buf->mapped = false;
+    ef->bytes_read += len;
+    ef->nbufs++;
+    return buf->base;
+}
+
+// Collect the DT_NEEDED entries of an ELF file. On success *needed is a single
+// allocation holding both the pointer array and the strings; free it with free().
+bool read_elf_needed(ElfFile *ef, ElfInfo *info, bool want_paths) {
+    const ElfHeader *hdr = &ef->hdr;
+    bool is64 = (hdr->elf_class == ELFCLASS64);
+    const unsigned char *phdrs;
+    const unsigned char *dynamic;
+    const unsigned char *strtab = NULL;
+    uint64_t dyn_offset = 0, dyn_size = 0;
+    uint64_t strtab_addr = 0, strtab_size = 0, strtab_offset = 0;
+    bool have_dynamic = false, have_strtab = false;
+    int count = 0;
+    size_t dyn_entsize = is64 ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+    uint64_t rpath_val = UINT64_MAX, runpath_val = UINT64_MAX;
+    bool have_interp = false, have_soname = false;
+    uint64_t flags_1 = 0;
+    
+    info->needed = NULL;
+    info->needed_count = 0;
+    info->rpath = NULL;
+    info->runpath = NULL;
+    
+    // Statically linked files have no program headers worth looking at
+    if (hdr->phnum == 0) {
+        return true;
+    }
+    
+    phdrs = elf_view(ef, hdr->phoff, (uint64_t)hdr->phnum * hdr->phentsize);
+    if (phdrs == NULL) {
+        return false;
+    }
+    
+    // Find PT_DYNAMIC, and PT_INTERP for telling PIEs from libraries
+    for (int i = 0; i < hdr->phnum; i++) {
+        const unsigned char *ph = phdrs + (size_t)i * hdr->phentsize;
+        uint32_t type = elf_u32(hdr, ph);
+        
+        if (type == PT_INTERP) {
+            have_interp = true;
+        }
+        if (type != PT_DYNAMIC || have_dynamic) {
+            continue;
+        }
+        if (is64) {
+            dyn_offset = elf_u64(hdr, ph + offsetof(Elf64_Phdr, p_offset));
+            dyn_size = elf_u64(hdr, ph + offsetof(Elf64_Phdr, p_filesz));
+        } else {
+            dyn_offset = elf_u32(hdr, ph + offsetof(Elf32_Phdr, p_offset));
+            dyn_size = elf_u32(hdr, ph + offsetof(Elf32_Phdr, p_filesz));
+        }
+        have_dynamic = true;
+    }
+    
+    if (!have_dynamic) {
+        if (hdr->type == ET_DYN && have_interp) {
+            info->kind = ELF_KIND_PIE;
+        }
+        return true;
+    }
+    
+    dynamic = elf_view(ef, dyn_offset, dyn_size);
+    if (dynamic == NULL) {
+        return false;
+    }
+    
+    // First pass: locate the dynamic string table and count DT_NEEDED entries
+    for (uint64_t off = 0; off + dyn_entsize <= dyn_size; off += dyn_entsize) {
+        uint64_t tag = elf_word(hdr, dynamic + off);
+        uint64_t val = elf_word(hdr, dynamic + off + dyn_entsize / 2);
+        
+        if (tag == DT_NULL) {
+            dyn_size = off;
+            break;
+        } else if (tag == DT_NEEDED) {
+            count++;
+        } else if (tag == DT_STRTAB) {
+            strtab_addr = val;
+            have_strtab = true;
+        } else if (tag == DT_STRSZ) {
+            strtab_size = val;
+        } else if (tag == DT_RPATH && want_paths) {
+            rpath_val = val;
+        } else if (tag == DT_RUNPATH && want_paths) {
+            runpath_val = val;
+        } else if (tag == DT_SONAME) {
+            have_soname = true;
+        } else if (tag == DT_FLAGS_1) {
+            flags_1 = val;
+        }
+    }
+    
+    // Current linkers mark PIEs with DF_1_PIE. Older ones did not, but a
+    // PIE has an interpreter and, unlike libc.so.6, which also has one, no
+    // soname.
+    if (hdr->type == ET_DYN && ((flags_1 & DF_1_PIE) || (have_interp && !have_soname))) {
+        info->kind = ELF_KIND_PIE;
+    }
+    
+    if (count == 0 || !have_strtab) {
+        return true;
+    }
+    
+    // The program headers place the string table and the dynamic section
+    // indexes it, so a file matching both (and the size) of one already
+    // parsed is taken to have the same NEEDED strings
+    DedupeKey content;
+    if (content_table != NULL) {
+        ElfInfo seen;
+        bool seen_elf;
+        
+        content.a = ef->size;
+        content.b = hash_bytes(phdrs, (size_t)hdr->phnum * hdr->phentsize, hdr->machine);
+        content.c = hash_bytes(dynamic, dyn_size, want_paths);
+        if (dedupe_lookup(content_table, &content, &seen, &seen_elf)) {
+            info->needed = seen.needed;
+            info->needed_count = seen.needed_count;
+            info->rpath = seen.rpath;
+            info->runpath = seen.runpath;
+            info->deduped = true;
+            return true;
+        }
+    }
+    
+    // DT_STRTAB is a virtual address; translate it through the PT_LOAD segments
+    have_strtab = false;
+    for (int i = 0; i < hdr->phnum; i++) {
+        const unsigned char *ph = phdrs + (size_t)i * hdr->phentsize;
+        uint64_t p_offset, p_vaddr, p_filesz;
+        
+        if (elf_u32(hdr, ph) != PT_LOAD) {
+            continue;
+        }
+        if (is64) {
+            p_offset = elf_u64(hdr, ph + offsetof(Elf64_Phdr, p_offset));
+            p_vaddr = elf_u64(hdr, ph + offsetof(Elf64_Phdr, p_vaddr));
+            p_filesz = elf_u64(hdr, ph + offsetof(Elf64_Phdr, p_filesz));
+        } else {
+            p_offset = elf_u32(hdr, ph + offsetof(Elf32_Phdr, p_offset));
+            p_vaddr = elf_u32(hdr, ph + offsetof(Elf32_Phdr, p_vaddr));
+            p_filesz = elf_u32(hdr, ph + offsetof(Elf32_Phdr, p_filesz));
+        }
+        if (strtab_addr >= p_vaddr && strtab_addr - p_vaddr < p_filesz) {
+            strtab_offset = p_offset + (strtab_addr - p_vaddr);
+            if (strtab_size == 0 || strtab_size > p_filesz - (strtab_addr - p_vaddr)) {
+                strtab_size = p_filesz - (strtab_addr - p_vaddr);
+            }
+            have_strtab = true;
+            break;
+        }
+    }
+    
+    if (!have_strtab) {
+        return false;
+    }
+    
+    // Only read the part of the string table the NEEDED names live in. The
+    // window covers the lowest to the highest NEEDED offset plus some slack
+    // for the last string; if that string turns out to be longer, the
+    // window is widened to the rest of the table.
+    uint64_t min_val = UINT64_MAX, max_val = 0;
+    for (uint64_t off = 0; off + dyn_entsize <= dyn_size; off += dyn_entsize) {
+        uint64_t val = elf_word(hdr, dynamic + off + dyn_entsize / 2);
+        if (elf_word(hdr, dynamic + off) == DT_NEEDED && val < strtab_size) {
+            min_val = val < min_val ? val : min_val;
+            max_val = val > max_val ? val : max_val;
+        }
+    }
+    if (min_val == UINT64_MAX) {
+        return true;
+    }
+    if (rpath_val >= strtab_size) {
+        rpath_val = UINT64_MAX;
+    }
+    if (runpath_val >= strtab_size) {
+        runpath_val = UINT64_MAX;
+    }
+    for (int i = 0; i < 2; i++) {
+        uint64_t val = i == 0 ? rpath_val : runpath_val;
+        if (val != UINT64_MAX) {
+            min_val = val < min_val ? val : min_val;
+            max_val = val > max_val ? val : max_val;
+        }
+    }
+    
+    uint64_t window = max_val - min_val + ELF_SONAME_SLACK;
+    if (window > strtab_size - min_val) {
+        window = strtab_size - min_val;
+    }
+    strtab = elf_view(ef, strtab_offset + min_val, window);
+    if (strtab != NULL && window < strtab_size - min_val &&
+        memchr(strtab + (max_val - min_val), '\0', window - (max_val - min_val)) == NULL) {
+        window = strtab_size - min_val;
+        strtab = elf_view(ef, strtab_offset + min_val, window);
+    }
+    if (strtab == NULL) {
+        return false;
+    }
+    
+    // Second pass: copy the NEEDED strings, and the search paths if asked
+    // for, into one block
+    size_t strings_len = 0;
+    for (uint64_t off = 0; off + dyn_entsize <= dyn_size; off += dyn_entsize) {
+        uint64_t val = elf_word(hdr, dynamic + off + dyn_entsize / 2);
+        if (elf_word(hdr, dynamic + off) == DT_NEEDED && val < strtab_size) {
+            strings_len += strnlen((const char *)strtab + (val - min_val), window - (val - min_val)) + 1;
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        uint64_t val = i == 0 ? rpath_val : runpath_val;
+        if (val != UINT64_MAX) {
+            strings_len += strnlen((const char *)strtab + (val - min_val), window - (val - min_val)) + 1;
+        }
+    }
+    
+    char **list = malloc(count * sizeof(char *) + strings_len);
+    if (list == NULL) {
+        return false;
+    }
+    
+    char *dst = (char *)(list + count);
+    int n = 0;
+    for (uint64_t off = 0; off + dyn_entsize <= dyn_size; off += dyn_entsize) {
+        uint64_t val = elf_word(hdr, dynamic + off + dyn_entsize / 2);
+        if (elf_word(hdr, dynamic + off) == DT_NEEDED && val < strtab_size) {
+            const unsigned char *name = strtab + (val - min_val);
+            size_t len = strnlen((const char *)name, window - (val - min_val));
+            memcpy(dst, name, len);
+            dst[len] = '\0';
+            list[n++] = dst;
+            dst += len + 1;
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        uint64_t val = i == 0 ? rpath_val : runpath_val;
+        if (val != UINT64_MAX) {
+            const unsigned char *path = strtab + (val - min_val);
+            size_t len = strnlen((const char *)path, window - (val - min_val));
+            memcpy(dst, path, len);
+            dst[len] = '\0';
+            *(i == 0 ? &info->rpath : &info->runpath) = dst;
+            dst += len + 1;
+        }
+    }
+    
+    info->needed = list;
+    info->needed_count = n;
+    if (content_table != NULL) {
+        dedupe_insert(content_table, &content, info, true);
+    }
+    return true;
+}
+
+int find_or_add_architecture(const char *arch) {
+    uint64_t hash = hash_bytes(arch, strlen(arch), 0);
+    uint32_t found = hash_index_find(&arch_map, hash, arch_equals, arch);
+    
+    if (found != HASH_EMPTY) {
+        return (int)found;
+    }
+    
+    // Add new architecture
+    if (arch_count == arch_cap) {
+        arch_cap = arch_cap ? arch_cap * 2 : 4;
+        archs = xrealloc(archs, arch_cap * sizeof(Architecture));
+    }
+    memset(&archs[arch_count], 0, sizeof(Architecture));
+    strncpy(archs[arch_count].name, arch, sizeof(archs[arch_count].name) - 1);
+    hash_index_insert(&arch_map, hash, arch_count);
+    return arch_count++;
+}
+
+int find_or_add_library(int arch_index, const char *lib_name) {
+    Architecture *arch = &archs[arch_index];
+    LibKey key = { arch_index, lib_name };
+    uint64_t hash = hash_bytes(lib_name, strlen(lib_name), (uint64_t)arch_index + 1);
+    uint32_t found = hash_index_find(&library_map, hash, library_equals, &key);
+    
+    if (found != HASH_EMPTY) {
+        return lib_refs[found].lib;
+    }
+    
+    // Add new library
+    if (arch->lib_count == arch->lib_cap) {
+        arch->lib_cap = arch->lib_cap ? arch->lib_cap * 2 : 8;
+        arch->libraries = xrealloc(arch->libraries, arch->lib_cap * sizeof(Library));
+    }
+    if (lib_ref_count == lib_ref_cap) {
+        lib_ref_cap = lib_ref_cap ? lib_ref_cap * 2 : 16;
+        lib_refs = xrealloc(lib_refs, lib_ref_cap * sizeof(LibRef));
+    }
+    
+    Library *lib = &arch->libraries[arch->lib_count];
+    memset(lib, 0, sizeof(Library));
+    lib->name = arena_strdup(&result_arena, lib_name);
+    lib->uid = lib_ref_count;
+    lib_refs[lib_ref_count].arch = arch_index;
+    lib_refs[lib_ref_count].lib = arch->lib_count;
+    hash_index_insert(&library_map, hash, lib_ref_count++);
+    return arch->lib_count++;
+}
+
+void add_executable(int arch_index, int lib_index, const char *exec_path, unsigned char kind) {
+    Library *lib = &archs[arch_index].libraries[lib_index];
+    uint32_t path_id = intern_path(exec_path);
+    
+    path_pool.kinds[path_id] = kind;
+    
+    // Check if executable is already in the list
+    if (!key_set_add(&exec_set, ((uint64_t)lib->uid << 32) | path_id)) {
+        return;  // Already added
+    }
+    
+    // Add new executable
+    if (lib->exec_count == lib->exec_cap) {
+        lib->exec_cap = lib->exec_cap ? lib->exec_cap * 2 : 16;
+        lib->execs = xrealloc(lib->execs, lib->exec_cap * sizeof(uint32_t));
+    }
+    lib->execs[lib->exec_count++] = path_id;
+    total_execs++;
+}
+
+// Return the pool index of a path, HASH_EMPTY if it was never interned
+uint32_t find_path(const char *path) {
+    const char *base;
+    uint32_t dir = path_dir(path, &base, false);
+    PathKey key = { dir, base };
+    
+    if (dir == HASH_EMPTY) {
+        return HASH_EMPTY;
+    }
+    return hash_index_find(&path_map, hash_bytes(base, strlen(base), (uint64_t)dir + 1), path_equals, &key);
+}
+
+// Return the pool index of a path, adding it if it is not there yet
+uint32_t intern_path(const char *path) {
+    size_t len = strlen(path);
+    const char *base;
+    
+    if (len >= MAX_PATH) {
+        fprintf(stderr, "Error: Path too long: %.64s...\n", path);
+        exit(1);
+    }
+    
+    uint32_t dir = path_dir(path, &base, true);
+    PathKey key = { dir, base };
+    size_t base_len = len - (base - path);
+    uint64_t hash = hash_bytes(base, base_len, (uint64_t)dir + 1);
+    uint32_t found = hash_index_find(&path_map, hash, path_equals, &key);
+    
+    if (found != HASH_EMPTY) {
+        return found;
+    }
+    
+    if (path_pool.count == path_pool.cap) {
+        path_pool.cap = path_pool.cap ? path_pool.cap * 2 : 1024;
+        path_pool.files = xrealloc(path_pool.files, path_pool.cap * sizeof(PathNode));
+        path_pool.kinds = xrealloc(path_pool.kinds, path_pool.cap);
+    }
+    
+    PathNode *node = &path_pool.files[path_pool.count];
+    node->parent = dir;
+    node->len = (uint32_t)len;
+    node->name = add_path_name(base, base_len);
+    path_pool.kinds[path_pool.count] = ELF_KIND_EXEC;
+    hash_index_insert(&path_map, hash, path_pool.count);
+    
+    return path_pool.count++;
+}
+
+// Split a path into its directory node, PATH_NO_DIR if it has no slash,
+// and its file name. Paths come in directory order, so the directory of
+// the previous call is tried before the tree. With add unset, HASH_EMPTY
+// means the directory holds no interned path.
+uint32_t path_dir(const char *path, const char **base, bool add) {
+    const char *slash = strrchr(path, '/');
+    size_t len;
+    uint32_t dir;
+    
+    if (slash == NULL) {
+        *base = path;
+        return PATH_NO_DIR;
+    }
+    len = slash - path;
+    *base = slash + 1;
+    
+    if (path_pool.dir_count > 0 && len == path_pool.hint_len && memcmp(path, path_pool.hint, len) == 0) {
+        return path_pool.hint_dir;
+    }
+    dir = intern_dir(path, len, add);
+    if (dir != HASH_EMPTY) {
+        memcpy(path_pool.hint, path, len);
+        path_pool.hint_len = len;
+        path_pool.hint_dir = dir;
+    }
+    return dir;
+}
+
+// Return the node of the directory in the first len bytes of dir, adding
+// it and any missing parents when add is set
+uint32_t intern_dir(const char *dir, size_t len, bool add) {
+    uint32_t parent = PATH_NO_DIR;
+    const char *name = dir;
+    size_t name_len = len;
+    
+    for (size_t i = len; i > 0; i--) {
+        if (dir[i - 1] == '/') {
+            parent = intern_dir(dir, i - 1, add);
+            if (parent == HASH_EMPTY) {
+                return HASH_EMPTY;
+            }
+            name = dir + i;
+            name_len = len - i;
+            break;
+        }
+    }
+    
+    DirKey key = { parent, name, name_len };
+    uint64_t hash = hash_bytes(name, name_len, (uint64_t)parent + 1);
+    uint32_t found = hash_index_find(&dir_map, hash, dir_equals, &key);
+    
+    if (found != HASH_EMPTY || !add) {
+        return found;
+    }
+    
+    if (path_pool.dir_count == path_pool.dir_cap) {
+        path_pool.dir_cap = path_pool.dir_cap ? path_pool.dir_cap * 2 : 256;
+        path_pool.dirs = xrealloc(path_pool.dirs, path_pool.dir_cap * sizeof(PathNode));
+    }
+    
+    PathNode *node = &path_pool.dirs[path_pool.dir_count];
+    node->parent = parent;
+    node->len = (uint32_t)len;
+    node->name = add_path_name(name, name_len);
+    hash_index_insert(&dir_map, hash, path_pool.dir_count);
+    
+    return path_pool.dir_count++;
+}
+
+// Append a component to path_pool.names and return its offset
+size_t add_path_name(const char *name, size_t len) {
+    size_t offset = path_pool.names_len;
+    
+    if (path_pool.names_len + len + 1 > path_pool.names_cap) {
+        while (path_pool.names_len + len + 1 > path_pool.names_cap) {
+            path_pool.names_cap = path_pool.names_cap ? path_pool.names_cap * 2 : 64 * 1024;
+        }
+        path_pool.names = xrealloc(path_pool.names, path_pool.names_cap);
+    }
+    memcpy(path_pool.names + offset, name, len);
+    path_pool.names[offset + len] = '\0';
+    path_pool.names_len += len + 1;
+    
+    return offset;
+}
+
+// Put an interned path together in buf, which holds MAX_PATH bytes
+const char *path_at(uint32_t id, char *buf) {
+    return pool_path(&path_pool, id, buf);
+}
+
+// Same for a pool that is not path_pool. Components are copied from the
+// file name up, each one ending where its node's length says.
+const char *pool_path(const PathPool *pool, uint32_t id, char *buf) {
+    const PathNode *node = &pool->files[id];
+    
+    buf[node->len] = '\0';
+    for (;;) {
+        uint32_t start = node->parent == PATH_NO_DIR ? 0 : pool->dirs[node->parent].len + 1;
+        
+        memcpy(buf + start, pool->names + node->name, node->len - start);
+        if (node->parent == PATH_NO_DIR) {
+            return buf;
+        }
+        buf[start - 1] = '/';
+        node = &pool->dirs[node->parent];
+    }
+}
+
+// FNV-1a over the bytes, finished with hash_mix() so that the low bits
+// used for slot selection depend on every input byte
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL ^ hash_mix(seed);
+    
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return hash_mix(h);
+}
+
+// splitmix64 finalizer
+uint64_t hash_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+uint32_t hash_index_find(const HashIndex *index, uint64_t hash, HashKeyEquals equals, const void *key) {
+    if (index->cap == 0) {
+        return HASH_EMPTY;
+    }
+    
+    for (uint32_t slot = (uint32_t)hash & (index->cap - 1); ; slot = (slot + 1) & (index->cap - 1)) {
+        uint32_t value = index->values[slot];
+        
+        if (value == HASH_EMPTY) {
+            return HASH_EMPTY;
+        }
+        if (index->hashes[slot] == hash && equals(value, key)) {
+            return value;
+        }
+    }
+}
+
+// Insert a value known not to be present yet, growing at 50% load
+void hash_index_insert(HashIndex *index, uint64_t hash, uint32_t value) {
+    if ((index->count + 1) * 2 > index->cap) {
+        uint32_t old_cap = index->cap;
+        uint64_t *old_hashes = index->hashes;
+        uint32_t *old_values = index->values;
+        
+        index->cap = old_cap ? old_cap * 2 : 64;
+        index->hashes = xrealloc(NULL, index->cap * sizeof(uint64_t));
+        index->values = xrealloc(NULL, index->cap * sizeof(uint32_t));
+        memset(index->values, 0xff, index->cap * sizeof(uint32_t));
+        index->count = 0;
+        
+        for (uint32_t i = 0; i < old_cap; i++) {
+            if (old_values[i] != HASH_EMPTY) {
+                hash_index_insert(index, old_hashes[i], old_values[i]);
+            }
+        }
+        free(old_hashes);
+        free(old_values);
+    }
+    
+    uint32_t slot = (uint32_t)hash & (index->cap - 1);
+    while (index->values[slot] != HASH_EMPTY) {
+        slot = (slot + 1) & (index->cap - 1);
+    }
+    index->hashes[slot] = hash;
+    index->values[slot] = value;
+    index->count++;
+}
+
+// Add key to the set. Returns false if it was already present.
+bool key_set_add(KeySet *set, uint64_t key) {
+    if ((set->count + 1) * 2 > set->cap) {
+        uint32_t old_cap = set->cap;
+        uint64_t *old_keys = set->keys;
+        
+        set->cap = old_cap ? old_cap * 2 : 1024;
+        set->keys = xrealloc(NULL, set->cap * sizeof(uint64_t));
+        memset(set->keys, 0xff, set->cap * sizeof(uint64_t));
+        set->count = 0;
+        
+        for (uint32_t i = 0; i < old_cap; i++) {
+            if (old_keys[i] != UINT64_MAX) {
+                key_set_add(set, old_keys[i]);
+            }
+        }
+        free(old_keys);
+    }
+    
+    uint32_t slot = (uint32_t)hash_mix(key) & (set->cap - 1);
+    while (set->keys[slot] != UINT64_MAX) {
+        if (set->keys[slot] == key) {
+            return false;
+        }
+        slot = (slot + 1) & (set->cap - 1);
+    }
+    set->keys[slot] = key;
+    set->count++;
+    return true;
+}
+
+bool key_set_has(const KeySet *set, uint64_t key) {
+    if (set->cap == 0) {
+        return false;
+    }
+    
+    uint32_t slot = (uint32_t)hash_mix(key) & (set->cap - 1);
+    while (set->keys[slot] != UINT64_MAX) {
+        if (set->keys[slot] == key) {
+            return true;
+        }
+        slot = (slot + 1) & (set->cap - 1);
+    }
+    return false;
+}
+
+// Remove a key, if present. The keys after it in the same probe run are
+// moved back over the hole unless that would put one before its home slot,
+// so every key stays reachable without tombstones.
+void key_set_remove(KeySet *set, uint64_t key) {
+    uint32_t mask = set->cap - 1;
+    
+    if (set->cap == 0) {
+        return;
+    }
+    
+    uint32_t hole = (uint32_t)hash_mix(key) & mask;
+    while (set->keys[hole] != key) {
+        if (set->keys[hole] == UINT64_MAX) {
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+    for (uint32_t slot = (hole + 1) & mask; set->keys[slot] != UINT64_MAX; slot = (slot + 1) & mask) {
+        uint32_t home = (uint32_t)hash_mix(set->keys[slot]) & mask;
+        
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            set->keys[hole] = set->keys[slot];
+            hole = slot;
+        }
+    }
+    set->keys[hole] = UINT64_MAX;
+    set->count--;
+}
+
+bool arch_equals(uint32_t value, const void *key) {
+    return strcmp(archs[value].name, (const char *)key) == 0;
+}
+
+bool library_equals(uint32_t value, const void *key) {
+    const LibKey *lib_key = key;
+    const LibRef *ref = &lib_refs[value];
+    
+    return ref->arch == lib_key->arch &&
+           strcmp(archs[ref->arch].libraries[ref->lib].name, lib_key->name) == 0;
+}
+
+bool path_equals(uint32_t value, const void *key) {
+    const PathKey *path_key = key;
+    const PathNode *node = &path_pool.files[value];
+    
+    return node->parent == path_key->dir && strcmp(path_pool.names + node->name, path_key->name) == 0;
+}
+
+bool dir_equals(uint32_t value, const void *key) {
+    const DirKey *dir_key = key;
+    const PathNode *node = &path_pool.dirs[value];
+    const char *name = path_pool.names + node->name;
+    
+    return node->parent == dir_key->parent && strncmp(name, dir_key->name, dir_key->len) == 0 &&
+           name[dir_key->len] == '\0';
+}
+
+void *xrealloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    
+    if (p == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return p;
+}
+
+char *xstrdup(const char *s) {
+    char *p = strdup(s);
+    
+    if (p == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return p;
+}
+
+// Carve size bytes from the arena. A request too large for a usual block
+// gets a block of its own behind the current one, whose free space stays
+// in use.
+void *arena_alloc(Arena *arena, size_t size) {
+    ArenaBlock *block = arena->head;
+    size_t offset = block ? (block->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1) : 0;
+    
+    if (block == NULL || offset + size > block->size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE / 4 ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock *fresh = xrealloc(NULL, sizeof(ArenaBlock) + block_size);
+        
+        fresh->size = block_size;
+        if (block != NULL && block_size != ARENA_BLOCK_SIZE) {
+            fresh->next = block->next;
+            fresh->used = size;
+            block->next = fresh;
+            return fresh + 1;
+        }
+        fresh->next = block;
+        arena->head = fresh;
+        block = fresh;
+        offset = 0;
+    }
+    block->used = offset + size;
+    return (char *)(block + 1) + offset;
+}
+
+char *arena_strdup(Arena *arena, const char *s) {
+    size_t len = strlen(s) + 1;
+    
+    return memcpy(arena_alloc(arena, len), s, len);
+}
+
+void arena_free(Arena *arena) {
+    while (arena->head != NULL) {
+        ArenaBlock *next = arena->head->next;
+        
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
+// Put the results in report order once, for every report backend to share.
+// Architectures are sorted by name, libraries by exec count (high to low)
+// and then name, and executables by path, so the reports are the same
+// whatever order the scan threads found things in. Only pointer arrays are
+// sorted; archs[] and the libraries themselves stay where they are.
+void build_report_order(void) {
+    if (merged_run == NULL) {
+        rank_paths();
+    }
+    sorted_archs = xrealloc(sorted_archs, (arch_count + 1) * sizeof(Architecture *));
+    sorted_arch_count = 0;
+    for (int a = 0; a < arch_count; a++) {
+        Architecture *arch = &archs[a];
+        
+        arch->sorted = xrealloc(arch->sorted, (arch->lib_count + 1) * sizeof(Library *));
+        arch->sorted_count = 0;
+        for (int l = 0; l < arch->lib_count; l++) {
+            Library *lib = &arch->libraries[l];
+            
+            // Only --watch leaves libraries without executables
+            if (lib->exec_count == 0) {
+                continue;
+            }
+            arch->sorted[arch->sorted_count++] = lib;
+            // Merged runs come out in path order already
+            if (merged_run == NULL) {
+                qsort(lib->execs, lib->exec_count, sizeof(uint32_t), compare_paths);
             }
         }
+        qsort(arch->sorted, arch->sorted_count, sizeof(Library *), compare_libraries);
+        if (arch->sorted_count > 0) {
+            sorted_archs[sorted_arch_count++] = arch;
+        }
     }
+    qsort(sorted_archs, sorted_arch_count, sizeof(Architecture *), compare_architectures);
+}
+
+int compare_architectures(const void *a, const void *b) {
+    const Architecture *arch_a = *(Architecture * const *)a;
+    const Architecture *arch_b = *(Architecture * const *)b;
     
-    closedir(dir);
+    return strcmp(arch_a->name, arch_b->name);
 }
 
-bool is_executable(const char *file_path) {
-    char cmd[MAX_PATH * 2];
+// Sort libraries by exec count in descending order
+int compare_libraries(const void *a, const void *b) {
+    const Library *lib_a = *(Library * const *)a;
+    const Library *lib_b = *(Library * const *)b;
     
-    // Check if file is accessible and executable
-    if (access(file_path, X_OK) != 0) {
-        return false;
+    if (lib_a->exec_count != lib_b->exec_count) {
+        return lib_b->exec_count - lib_a->exec_count;
     }
+    return strcmp(lib_a->name, lib_b->name);
+}
+
+int compare_paths(const void *a, const void *b) {
+    uint32_t rank_a = path_ranks[*(const uint32_t *)a];
+    uint32_t rank_b = path_ranks[*(const uint32_t *)b];
     
-    snprintf(cmd, sizeof(cmd), "readelf -h \"%s\" >/dev/null 2>&1", file_path);
-    int result = system(cmd);
-    
-    return (result == 0);
+    return rank_a < rank_b ? -1 : rank_a > rank_b;
 }
 
-const char *get_architecture(const char *file_path) {
-    FILE *fp;
-    char cmd[MAX_PATH * 2];
-    char line[MAX_LINE];
+// Number every path in string order into path_ranks[], without putting
+// any together. Below one directory, the paths under a child come before
+// those under another if the child's name followed by '/' (a directory) or
+// '\0' (a file) sorts first: that is where their strings first differ.
+// So the nodes are sorted by parent and that key, and a walk of the tree
+// in this order meets the files in string order. The files below each
+// directory get consecutive ranks, recorded in dir_ranks[] for --watch to
+// find them again through ranked_paths[].
+void rank_paths(void) {
+    uint32_t dir_count = path_pool.dir_count;
+    uint32_t total = dir_count + path_pool.count;
+    uint32_t *order = xrealloc(NULL, (total + 1) * sizeof(uint32_t));
+    uint32_t *first = xrealloc(NULL, (dir_count + 1) * sizeof(uint32_t));
+    uint32_t *stack = xrealloc(NULL, 3 * (dir_count + 1) * sizeof(uint32_t));
+    uint32_t depth = 0, rank = 0, p = 0;
     
-    snprintf(cmd, sizeof(cmd), "readelf -h \"%s\" 2>/dev/null", file_path);
-    fp = popen(cmd, "r");
-    if (fp == NULL) {
-        return "unknown";
+    path_ranks = xrealloc(path_ranks, (path_pool.count + 1) * sizeof(uint32_t));
+    ranked_paths = xrealloc(ranked_paths, (path_pool.count + 1) * sizeof(uint32_t));
+    dir_ranks = xrealloc(dir_ranks, 2 * (dir_count + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < total; i++) {
+        order[i] = i;
     }
+    qsort(order, total, sizeof(uint32_t), compare_siblings);
     
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        if (strstr(line, "Machine:") != NULL) {
-            if (strstr(line, "Advanced Micro Devices X86-64") != NULL ||
-                strstr(line, "AMD x86-64") != NULL) {
-                pclose(fp);
-                return "x86_64";
-            } else if (strstr(line, "Intel 80386") != NULL) {
-                pclose(fp);
-                return "x86";
-            } else if (strstr(line, "ARM aarch64") != NULL ||
-                       strstr(line, "AArch64") != NULL) {
-                pclose(fp);
-                return "aarch64";
-            } else if (strstr(line, "ARM") != NULL) {
-                pclose(fp);
-                return "armv7";
+    // Children of directory d are order[first[d]] .. order[first[d + 1] - 1];
+    // first components have no parent and sort last
+    for (uint32_t d = 0; d < dir_count; d++) {
+        first[d] = p;
+        while (p < total && path_node(order[p])->parent == d) {
+            p++;
+        }
+    }
+    first[dir_count] = p;
+    
+    // The stack holds a (next, end) range of order[] and the directory, per
+    // directory being walked
+    stack[depth++] = first[dir_count];
+    stack[depth++] = total;
+    stack[depth++] = PATH_NO_DIR;
+    while (depth > 0) {
+        uint32_t next = stack[depth - 3];
+        uint32_t end = stack[depth - 2];
+        
+        if (next == end) {
+            if (stack[depth - 1] != PATH_NO_DIR) {
+                dir_ranks[2 * stack[depth - 1] + 1] = rank;
             }
+            depth -= 3;
+            continue;
+        }
+        stack[depth - 3]++;
+        uint32_t id = order[next];
+        if (id >= dir_count) {
+            ranked_paths[rank] = id - dir_count;
+            path_ranks[id - dir_count] = rank++;
+        } else {
+            dir_ranks[2 * id] = rank;
+            stack[depth++] = first[id];
+            stack[depth++] = first[id + 1];
+            stack[depth++] = id;
         }
     }
     
-    pclose(fp);
-    return "unknown";
+    free(order);
+    free(first);
+    free(stack);
 }
 
-void get_dependencies(const char *file_path, char **libs, int lib_count, const char *arch) {
-    FILE *fp;
-    char cmd[MAX_PATH * 2];
-    char line[MAX_LINE];
+// Order rank_paths() nodes, directories first then files, by parent and key
+int compare_siblings(const void *a, const void *b) {
+    uint32_t id_a = *(const uint32_t *)a;
+    uint32_t id_b = *(const uint32_t *)b;
+    const PathNode *node_a = path_node(id_a);
+    const PathNode *node_b = path_node(id_b);
     
-    snprintf(cmd, sizeof(cmd), "readelf -d \"%s\" 2>/dev/null", file_path);
-    fp = popen(cmd, "r");
-    if (fp == NULL) {
-        fprintf(stderr, "Failed to run readelf on %s\n", file_path);
-        return;
+    if (node_a->parent != node_b->parent) {
+        return node_a->parent < node_b->parent ? -1 : 1;
     }
     
-    bool has_needed_section = false;
+    const unsigned char *name_a = (const unsigned char *)path_pool.names + node_a->name;
+    const unsigned char *name_b = (const unsigned char *)path_pool.names + node_b->name;
     
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        if (strstr(line, "(NEEDED)") != NULL) {
-            has_needed_section = true;
-            char lib_name[256] = {0};
-            
-            char *start = strstr(line, "[");
-            char *end = strstr(line, "]");
-            
-            if (start && end && (end > start)) {
-                start++;
-                strncpy(lib_name, start, end - start);
-                lib_name[end - start] = '\0';
-                
-                for (int i = 0; i < lib_count; i++) {
-                    char lib_pattern[256];
-                    const char *lib_search = libs[i];
-                    
-                    if (strstr(lib_search, ".so") == NULL) {
-                        if (strncmp(lib_search, "lib", 3) != 0) {
-                            snprintf(lib_pattern, sizeof(lib_pattern), "lib%s.so", lib_search);
-                        } else {
-                            snprintf(lib_pattern, sizeof(lib_pattern), "%s.so", lib_search);
-                        }
-                    } else {
-                        strcpy(lib_pattern, lib_search);
-                    }
-                    
-                    if (strstr(lib_name, lib_pattern) != NULL) {
-                        int arch_index = find_or_add_architecture(arch);
-                        int lib_index = find_or_add_library(arch_index, lib_pattern);
-                        add_executable(arch_index, lib_index, file_path);
-                        break;
-                    }
-                }
-            }
-        }
+    while (*name_a != '\0' && *name_a == *name_b) {
+        name_a++;
+        name_b++;
     }
+    int end_a = *name_a ? *name_a : id_a < path_pool.dir_count ? '/' : '\0';
+    int end_b = *name_b ? *name_b : id_b < path_pool.dir_count ? '/' : '\0';
     
-    pclose(fp);
-    
-    if (!has_needed_section) {
-        return;
-    }
+    return end_a - end_b;
 }
 
-int find_or_add_architecture(const char *arch) {
-    // Look for existing architecture
-    for (int i = 0; i < arch_count; i++) {
-        if (strcmp(archs[i].name, arch) == 0) {
-            return i;
-        }
-    }
-    
-    // Add new architecture
-    if (arch_count < MAX_ARCH) {
-        strncpy(archs[arch_count].name, arch, sizeof(archs[arch_count].name) - 1);
-        archs[arch_count].lib_count = 0;
-        return arch_count++;
-    }
-    
-    fprintf(stderr, "Error: Too many architectures\n");
-    return -1;
+// Node id of rank_paths(): directories, then files after them
+const PathNode *path_node(uint32_t id) {
+    return id < path_pool.dir_count ? &path_pool.dirs[id] : &path_pool.files[id - path_pool.dir_count];
 }
 
-int find_or_add_library(int arch_index, const char *lib_name) {
-    Architecture *arch = &archs[arch_index];
-    
-    // Look for existing library
-    for (int i = 0; i < arch->lib_count; i++) {
-        if (strcmp(arch->libraries[i].name, lib_name) == 0) {
-            return i;
+// Start reading a library's executables, in report order
+void open_execs(ExecCursor *cursor, const Library *lib) {
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->lib = lib;
+    if (merged_run != NULL) {
+        cursor->run.fp = merged_run;
+        if (fseeko(merged_run, lib->run_offset, SEEK_SET) != 0) {
+            fprintf(stderr, "Error: Cannot read spill file: %s\n", strerror(errno));
+            exit(1);
         }
     }
-    
-    // Add new library
-    if (arch->lib_count < MAX_LIBS) {
-        strncpy(arch->libraries[arch->lib_count].name, lib_name, sizeof(arch->libraries[0].name) - 1);
-        arch->libraries[arch->lib_count].exec_count = 0;
-        return arch->lib_count++;
-    }
-    
-    fprintf(stderr, "Error: Too many libraries for architecture %s\n", arch->name);
-    return -1;
 }
 
-void add_executable(int arch_index, int lib_index, const char *exec_path) {
-    Library *lib = &archs[arch_index].libraries[lib_index];
+// Return the next executable's path and kind, false after the last one.
+// A path read from merged_run stays valid until the next call.
+bool next_exec(ExecCursor *cursor, const char **path, unsigned char *kind) {
+    if (cursor->next == cursor->lib->exec_count) {
+        return false;
+    }
+    cursor->next++;
     
-    // Check if executable is already in the list
-    for (int i = 0; i < lib->exec_count; i++) {
-        if (strcmp(lib->execs[i], exec_path) == 0) {
-            return;  // Already added
-        }
+    if (cursor->run.fp == NULL) {
+        uint32_t id = cursor->lib->execs[cursor->next - 1];
+        
+        *path = path_at(id, cursor->path);
+        *kind = path_pool.kinds[id];
+        return true;
     }
     
-    // Add new executable
-    if (lib->exec_count < MAX_EXECS) {
-        lib->execs[lib->exec_count] = strdup(exec_path);
-        lib->exec_count++;
-        total_execs++;
-    } else {
-        fprintf(stderr, "Error: Too many executables for library %s\n", lib->name);
+    if (!read_run_record(&cursor->run)) {
+        fprintf(stderr, "Error: Spill file is truncated\n");
+        exit(1);
     }
+    // The path is the last of the key's three fields
+    const char *key = cursor->run.key;
+    key += strlen(key) + 1;
+    key += strlen(key) + 1;
+    *path = key;
+    *kind = cursor->run.kind;
+    return true;
 }
 
-// Sort libraries by exec count in descending order
-int compare_libraries(const void *a, const void *b) {
-    Library *lib_a = (Library *)a;
-    Library *lib_b = (Library *)b;
-    
-    return lib_b->exec_count - lib_a->exec_count;
+void close_execs(ExecCursor *cursor) {
+    free(cursor->run.key);
 }
 
 void generate_txt_report(Options *options) {
     FILE *fp;
     char output_file[MAX_PATH];
+    char tmp_file[MAX_PATH + 4];
     
     if (strlen(options->output) + 5 > MAX_PATH) {  // 5 = ".txt\0"
         fprintf(stderr, "Error: Output filename too long\n");
@@ -468,17 +6943,18 @@ void generate_txt_report(Options *options) {
     }
     
     snprintf(output_file, sizeof(output_file), "%s.txt", options->output);
-    fp = fopen(output_file, "w");
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", output_file);
+    fp = fopen(tmp_file, "w");
     if (fp == NULL) {
-        fprintf(stderr, "Error: Cannot create output file %s\n", output_file);
+        fprintf(stderr, "Error: Cannot create output file %s\n", tmp_file);
         return;
     }
     
     fprintf(fp, "Report on dynamic used libraries by ELF executables\n");
     fprintf(fp, "%s\n", "------------------------------------------------------------");
     
-    for (int a = 0; a < arch_count; a++) {
-        Architecture *arch = &archs[a];
+    for (int a = 0; a < sorted_arch_count; a++) {
+        Architecture *arch = sorted_archs[a];
         
         // Make sure the architecture name doesn't exceed buffer size
         char safe_arch_name[32]; // Same size as in Architecture struct
@@ -487,22 +6963,33 @@ void generate_txt_report(Options *options) {
         
         fprintf(fp, "%s %s %s\n", SEPARATOR, safe_arch_name, SEPARATOR);
         
-        // Sort libraries by exec count
-        qsort(arch->libraries, arch->lib_count, sizeof(Library), compare_libraries);
-        
-        for (int l = 0; l < arch->lib_count; l++) {
-            Library *lib = &arch->libraries[l];
+        for (int l = 0; l < arch->sorted_count; l++) {
+            Library *lib = arch->sorted[l];
+            ExecCursor execs;
+            const char *path;
+            unsigned char kind;
             
             fprintf(fp, "%s (%d execs)\n", lib->name, lib->exec_count);
-            for (int e = 0; e < lib->exec_count; e++) {
-                fprintf(fp, "-> %s\n", lib->execs[e]);
+            open_execs(&execs, lib);
+            while (next_exec(&execs, &path, &kind)) {
+                if (options->include_shared) {
+                    fprintf(fp, "-> %s (%s)\n", path, elf_kind_name(kind));
+                } else {
+                    fprintf(fp, "-> %s\n", path);
+                }
             }
+            close_execs(&execs);
             
             fprintf(fp, "\n");
         }
     }
     
-    fclose(fp);
+    // Written aside and renamed, so a reader never sees half a report
+    if (ferror(fp) | fclose(fp) || rename(tmp_file, output_file) != 0) {
+        fprintf(stderr, "Error: Cannot write output file %s\n", output_file);
+        unlink(tmp_file);
+        return;
+    }
     printf("Text report saved to %s\n", output_file);
 }
 
@@ -517,11 +7004,11 @@ void error_handler(HPDF_STATUS error_no, HPDF_STATUS detail_no, void *user_data)
 
 void generate_pdf_report(Options *options) {
 #if PDF_SUPPORT
-    HPDF_Doc pdf;
-    HPDF_Page page;
-    HPDF_Font font;
-    HPDF_Font bold_font;
+    PdfWriter w;
     char output_file[MAX_PATH];
+    char truncated[MAX_PATH];
+    char tagged[MAX_PATH + 16];
+    char tmp_file[MAX_PATH + 4];
     float y_position;
     float margin = 50;
     
@@ -532,48 +7019,56 @@ void generate_pdf_report(Options *options) {
     
     snprintf(output_file, sizeof(output_file), "%s.pdf", options->output);
     
-    pdf = HPDF_New(error_handler, NULL);
-    if (!pdf) {
+    memset(&w, 0, sizeof(w));
+    w.pdf = HPDF_New(error_handler, NULL);
+    if (!w.pdf) {
         fprintf(stderr, "Error: Cannot create PDF document\n");
         return;
     }
     
-    // Add a new page
-    page = HPDF_AddPage(pdf);
-    HPDF_Page_SetSize(page, HPDF_PAGE_SIZE_A4, HPDF_PAGE_PORTRAIT);
+    // Set fonts
+    w.font = HPDF_GetFont(w.pdf, "Helvetica", NULL);
+    w.bold_font = HPDF_GetFont(w.pdf, "Helvetica-Bold", NULL);
     
-    // Get page dimensions
-    float page_height = HPDF_Page_GetHeight(page);
-    float page_width = HPDF_Page_GetWidth(page);
+    // Exec lines are the bulk of the report: measure them with a per-byte
+    // width table instead of asking the library for every path
+    w.min_char_width = -1;
+    for (int c = 1; c < 256; c++) {
+        HPDF_BYTE b = (HPDF_BYTE)c;
+        HPDF_TextWidth tw = HPDF_Font_TextWidth(w.font, &b, 1);
+        
+        w.char_width[c] = tw.width * PDF_EXEC_FONT_SIZE / 1000.0f;
+        if (w.min_char_width < 0 || w.char_width[c] < w.min_char_width) {
+            w.min_char_width = w.char_width[c];
+        }
+        if (w.char_width[c] > w.max_char_width) {
+            w.max_char_width = w.char_width[c];
+        }
+    }
     
-    // Set fonts
-    font = HPDF_GetFont(pdf, "Helvetica", NULL);
-    bold_font = HPDF_GetFont(pdf, "Helvetica-Bold", NULL);
+    // Add a new page
+    pdf_new_page(&w);
+    float page_height = w.page_height;
+    float max_path_width = w.page_width - margin * 2 - 20;
     
     // Set initial y position
     y_position = page_height - margin;
     
     // Add title
-    HPDF_Page_SetFontAndSize(page, bold_font, 16);
-    HPDF_Page_BeginText(page);
-    HPDF_Page_TextOut(page, margin, y_position, "Report on dynamic used libraries by ELF executables");
-    HPDF_Page_EndText(page);
+    pdf_text(&w, w.bold_font, 16, margin, y_position, "Report on dynamic used libraries by ELF executables");
     
     y_position -= 30;
     
-    for (int a = 0; a < arch_count; a++) {
-        Architecture *arch = &archs[a];
+    for (int a = 0; a < sorted_arch_count; a++) {
+        Architecture *arch = sorted_archs[a];
         
         // Check if we need a new page
         if (y_position < margin + 50) {
-            page = HPDF_AddPage(pdf);
-            HPDF_Page_SetSize(page, HPDF_PAGE_SIZE_A4, HPDF_PAGE_PORTRAIT);
+            pdf_new_page(&w);
             y_position = page_height - margin;
         }
         
         // Add architecture header - safely construct the header string
-        HPDF_Page_SetFontAndSize(page, bold_font, 14);
-        HPDF_Page_BeginText(page);
         char arch_header[MAX_HEADER_SIZE];
         
         // Make sure the architecture name doesn't exceed buffer size
@@ -583,74 +7078,71 @@ void generate_pdf_report(Options *options) {
         
         // Build the header safely
         snprintf(arch_header, MAX_HEADER_SIZE, "%s %s %s", SEPARATOR, safe_arch_name, SEPARATOR);
-        HPDF_Page_TextOut(page, margin, y_position, arch_header);
-        HPDF_Page_EndText(page);
+        pdf_text(&w, w.bold_font, 14, margin, y_position, arch_header);
         
         y_position -= 20;
         
-        // Sort libraries by exec count
-        qsort(arch->libraries, arch->lib_count, sizeof(Library), compare_libraries);
-        
-        for (int l = 0; l < arch->lib_count; l++) {
-            Library *lib = &arch->libraries[l];
+        for (int l = 0; l < arch->sorted_count; l++) {
+            Library *lib = arch->sorted[l];
+            ExecCursor execs;
+            const char *path;
+            unsigned char kind;
             
             // Check if we need a new page
             if (y_position < margin + 50) {
-                page = HPDF_AddPage(pdf);
-                HPDF_Page_SetSize(page, HPDF_PAGE_SIZE_A4, HPDF_PAGE_PORTRAIT);
+                pdf_new_page(&w);
                 y_position = page_height - margin;
             }
             
             // Add library header
-            HPDF_Page_SetFontAndSize(page, bold_font, 12);
-            HPDF_Page_BeginText(page);
             char lib_header[MAX_HEADER_SIZE];
             snprintf(lib_header, MAX_HEADER_SIZE, "%s (%d execs)", lib->name, lib->exec_count);
-            HPDF_Page_TextOut(page, margin, y_position, lib_header);
-            HPDF_Page_EndText(page);
+            pdf_text(&w, w.bold_font, 12, margin, y_position, lib_header);
             
             y_position -= 15;
             
             // Add executables
-            HPDF_Page_SetFontAndSize(page, font, 10);
-            for (int e = 0; e < lib->exec_count; e++) {
+            open_execs(&execs, lib);
+            while (next_exec(&execs, &path, &kind)) {
                 if (y_position < margin) {
-                    page = HPDF_AddPage(pdf);
-                    HPDF_Page_SetSize(page, HPDF_PAGE_SIZE_A4, HPDF_PAGE_PORTRAIT);
+                    pdf_new_page(&w);
                     y_position = page_height - margin;
                 }
                 
-                HPDF_Page_BeginText(page);
-                HPDF_Page_TextOut(page, margin + 10, y_position, "-> ");
-
-                char *path = lib->execs[e];
-                if (HPDF_Page_TextWidth(page, path) > page_width - margin * 2 - 20) {
-                    char *base = basename(strdup(path));
-                    char truncated[MAX_PATH];
-                    snprintf(truncated, sizeof(truncated), ".../%s", base);
-                    HPDF_Page_TextOut(page, margin + 30, y_position, truncated);
-                    free(base);
-                } else {
-                    HPDF_Page_TextOut(page, margin + 30, y_position, path);
+                pdf_text(&w, w.font, PDF_EXEC_FONT_SIZE, margin + 10, y_position, "-> ");
+                
+                // Paths too wide for the page are shortened to their file name
+                if (options->include_shared) {
+                    snprintf(tagged, sizeof(tagged), "%s (%s)", path, elf_kind_name(kind));
+                    path = tagged;
                 }
-                HPDF_Page_EndText(page);
+                if (!pdf_path_fits(&w, path, max_path_width)) {
+                    const char *slash = strrchr(path, '/');
+                    snprintf(truncated, sizeof(truncated), ".../%s", slash ? slash + 1 : path);
+                    path = truncated;
+                }
+                pdf_text(&w, w.font, PDF_EXEC_FONT_SIZE, margin + 30, y_position, path);
                 
                 y_position -= 12;
             }
+            close_execs(&execs);
             
             y_position -= 10;
         }
     }
+    HPDF_Page_EndText(w.page);
     
     // Save the PDF
-    if (HPDF_SaveToFile(pdf, output_file) != HPDF_OK) {
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", output_file);
+    if (HPDF_SaveToFile(w.pdf, tmp_file) != HPDF_OK || rename(tmp_file, output_file) != 0) {
         fprintf(stderr, "Error: Cannot save PDF to %s\n", output_file);
+        unlink(tmp_file);
     } else {
         printf("PDF report saved to %s\n", output_file);
     }
     
     // Clean up
-    HPDF_Free(pdf);
+    HPDF_Free(w.pdf);
 #else
     /* Suppress unused parameter warning */
     (void)options;
@@ -658,13 +7150,510 @@ void generate_pdf_report(Options *options) {
 #endif
 }
 
+#if PDF_SUPPORT
+// Close the text object of the current page, if any, and start a new page
+// with a fresh one. Fonts do not carry over between pages.
+void pdf_new_page(PdfWriter *w) {
+    if (w->page != NULL) {
+        HPDF_Page_EndText(w->page);
+    }
+    
+    w->page = HPDF_AddPage(w->pdf);
+    HPDF_Page_SetSize(w->page, HPDF_PAGE_SIZE_A4, HPDF_PAGE_PORTRAIT);
+    w->page_height = HPDF_Page_GetHeight(w->page);
+    w->page_width = HPDF_Page_GetWidth(w->page);
+    
+    HPDF_Page_BeginText(w->page);
+    w->current_font = NULL;
+    w->x = 0;
+    w->y = 0;
+}
+
+// Show text at (x, y) in the page's text object
+void pdf_text(PdfWriter *w, HPDF_Font font, float size, float x, float y, const char *text) {
+    if (font != w->current_font || size != w->current_size) {
+        HPDF_Page_SetFontAndSize(w->page, font, size);
+        w->current_font = font;
+        w->current_size = size;
+    }
+    
+    HPDF_Page_MoveTextPos(w->page, x - w->x, y - w->y);
+    HPDF_Page_ShowText(w->page, text);
+    w->x = x;
+    w->y = y;
+}
+
+// Whether path fits in max_width in the exec line font. The length alone
+// settles most paths; only those in between are measured byte by byte.
+bool pdf_path_fits(const PdfWriter *w, const char *path, float max_width) {
+    size_t len = strlen(path);
+    float width = 0;
+    
+    if (len * w->max_char_width <= max_width) {
+        return true;
+    }
+    if (len * w->min_char_width > max_width) {
+        return false;
+    }
+    
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        width += w->char_width[*p];
+    }
+    return width <= max_width;
+}
+#endif
+
+void generate_json_report(Options *options) {
+    FILE *fp;
+    char output_file[MAX_PATH];
+    char tmp_file[MAX_PATH + 4];
+    char *escaped = NULL;
+    size_t escaped_cap = 0;
+    
+    if (strlen(options->output) + 6 > MAX_PATH) {  // 6 = ".json\0"
+        fprintf(stderr, "Error: Output filename too long\n");
+        return;
+    }
+    
+    snprintf(output_file, sizeof(output_file), "%s.json", options->output);
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", output_file);
+    fp = fopen(tmp_file, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Cannot create output file %s\n", tmp_file);
+        return;
+    }
+    
+    fprintf(fp, "{\n  \"architectures\": [");
+    for (int a = 0; a < sorted_arch_count; a++) {
+        Architecture *arch = sorted_archs[a];
+        
+        fprintf(fp, "%s\n    {\n      \"name\": \"%s\",\n      \"libraries\": [",
+                a > 0 ? "," : "", json_escape(&escaped, &escaped_cap, arch->name));
+        
+        for (int l = 0; l < arch->sorted_count; l++) {
+            Library *lib = arch->sorted[l];
+            ExecCursor execs;
+            const char *path;
+            unsigned char kind;
+            
+            fprintf(fp, "%s\n        {\n          \"name\": \"%s\",\n          \"exec_count\": %d,\n          \"execs\": [",
+                    l > 0 ? "," : "", json_escape(&escaped, &escaped_cap, lib->name), lib->exec_count);
+            open_execs(&execs, lib);
+            for (int e = 0; next_exec(&execs, &path, &kind); e++) {
+                if (options->include_shared) {
+                    fprintf(fp, "%s\n            { \"path\": \"%s\", \"kind\": \"%s\" }", e > 0 ? "," : "",
+                            json_escape(&escaped, &escaped_cap, path), elf_kind_name(kind));
+                } else {
+                    fprintf(fp, "%s\n            \"%s\"", e > 0 ? "," : "",
+                            json_escape(&escaped, &escaped_cap, path));
+                }
+            }
+            close_execs(&execs);
+            fprintf(fp, "%s]\n        }", lib->exec_count > 0 ? "\n          " : "");
+        }
+        fprintf(fp, "%s]\n    }", arch->sorted_count > 0 ? "\n      " : "");
+    }
+    fprintf(fp, "%s]\n}\n", sorted_arch_count > 0 ? "\n  " : "");
+    
+    free(escaped);
+    if (ferror(fp) | fclose(fp) || rename(tmp_file, output_file) != 0) {
+        fprintf(stderr, "Error: Cannot write output file %s\n", output_file);
+        unlink(tmp_file);
+        return;
+    }
+    printf("JSON report saved to %s\n", output_file);
+}
+
+// Escape s as the body of a JSON string into *buf, growing it as needed
+const char *json_escape(char **buf, size_t *cap, const char *s) {
+    size_t need = 6 * strlen(s) + 1;
+    
+    if (need > *cap) {
+        *cap = need;
+        *buf = xrealloc(*buf, need);
+    }
+    (*buf)[stream_escape(*buf, s, STREAM_NDJSON)] = '\0';
+    
+    return *buf;
+}
+
+void generate_bin_report(Options *options) {
+    char output_file[MAX_PATH];
+    
+    if (strlen(options->output) + 5 > MAX_PATH) {  // 5 = ".bin\0"
+        fprintf(stderr, "Error: Output filename too long\n");
+        return;
+    }
+    
+    snprintf(output_file, sizeof(output_file), "%s.bin", options->output);
+    if (write_bin_report(output_file, options->include_shared ? REPORT_SHARED : 0)) {
+        printf("Binary report saved to %s\n", output_file);
+    }
+}
+
+// Write archs[] to output_file with write_report_image(), for --format bin
+// and --build-index
+bool write_bin_report(const char *output_file, uint32_t flags) {
+    FILE *fp;
+    char tmp_file[MAX_PATH + 4];
+    
+    // A --query running against the index meanwhile keeps the old file
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", output_file);
+    fp = fopen(tmp_file, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Cannot create output file %s\n", tmp_file);
+        return false;
+    }
+    
+    write_report_image(fp, flags);
+    
+    if (ferror(fp) | fclose(fp) || rename(tmp_file, output_file) != 0) {
+        fprintf(stderr, "Error: Cannot write output file %s\n", output_file);
+        unlink(tmp_file);
+        return false;
+    }
+    return true;
+}
+
+// Write archs[] in report order to fp in the ReportHeader layout
+void write_report_image(FILE *fp, uint32_t flags) {
+    ReportHeader hdr;
+    uint32_t lib_total = 0, exec_total = 0;
+    
+    for (int a = 0; a < sorted_arch_count; a++) {
+        lib_total += sorted_archs[a]->sorted_count;
+        for (int l = 0; l < sorted_archs[a]->sorted_count; l++) {
+            exec_total += sorted_archs[a]->sorted[l]->exec_count;
+        }
+    }
+    
+    uint64_t *arch_name = xrealloc(NULL, (sorted_arch_count + 1) * sizeof(uint64_t));
+    uint32_t *arch_libs = xrealloc(NULL, (sorted_arch_count + 1) * sizeof(uint32_t));
+    uint64_t *lib_name = xrealloc(NULL, (lib_total + 1) * sizeof(uint64_t));
+    uint32_t *lib_execs = xrealloc(NULL, (lib_total + 1) * sizeof(uint32_t));
+    uint32_t *exec_path = xrealloc(NULL, (exec_total + 1) * sizeof(uint32_t));
+    uint64_t *path_string = xrealloc(NULL, (path_pool.count + 1) * sizeof(uint64_t));
+    uint8_t *path_kind = xrealloc(NULL, path_pool.count + 1);
+    uint32_t *path_id = xrealloc(NULL, (path_pool.count + 1) * sizeof(uint32_t));
+    uint32_t *path_order = xrealloc(NULL, (path_pool.count + 1) * sizeof(uint32_t));
+    
+    // Paths are renumbered in the order the report first lists them, so the
+    // file does not depend on which scan thread interned a path first. The
+    // string table holds the paths in that order, then the architecture and
+    // library names.
+    uint64_t path_bytes = 0, name_bytes = 0;
+    uint32_t path_total = 0, lib = 0, exec = 0;
+    
+    memset(path_id, 0xff, path_pool.count * sizeof(uint32_t));
+    for (int a = 0; a < sorted_arch_count; a++) {
+        Architecture *arch = sorted_archs[a];
+        
+        arch_name[a] = name_bytes;
+        name_bytes += strlen(arch->name) + 1;
+        arch_libs[a] = lib;
+        for (int l = 0; l < arch->sorted_count; l++, lib++) {
+            Library *library = arch->sorted[l];
+            
+            lib_name[lib] = name_bytes;
+            name_bytes += strlen(library->name) + 1;
+            lib_execs[lib] = exec;
+            for (int e = 0; e < library->exec_count; e++) {
+                uint32_t id = library->execs[e];
+                
+                if (path_id[id] == HASH_EMPTY) {
+                    path_id[id] = path_total;
+                    path_order[path_total] = id;
+                    path_kind[path_total] = path_pool.kinds[id];
+                    path_string[path_total++] = path_bytes;
+                    path_bytes += path_pool.files[id].len + 1;
+                }
+                exec_path[exec++] = path_id[id];
+            }
+        }
+    }
+    arch_libs[sorted_arch_count] = lib;
+    lib_execs[lib_total] = exec;
+    for (int a = 0; a < sorted_arch_count; a++) {
+        arch_name[a] += path_bytes;
+    }
+    for (uint32_t l = 0; l < lib_total; l++) {
+        lib_name[l] += path_bytes;
+    }
+    uint64_t strings_size = path_bytes + name_bytes;
+    
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, REPORT_MAGIC, sizeof(hdr.magic));
+    hdr.version = REPORT_VERSION;
+    hdr.byte_order = REPORT_BYTE_ORDER;
+    hdr.arch_count = sorted_arch_count;
+    hdr.lib_count = lib_total;
+    hdr.exec_count = exec_total;
+    hdr.path_count = path_total;
+    report_path_count = path_total;
+    hdr.flags = flags;
+    hdr.strings_size = strings_size;
+    
+    // Every column starts on an 8-byte boundary
+    uint64_t offset = sizeof(ReportHeader);
+    hdr.arch_name_offset = offset;
+    offset += ((uint64_t)sorted_arch_count * sizeof(uint64_t) + 7) & ~7ULL;
+    hdr.arch_libs_offset = offset;
+    offset += ((uint64_t)(sorted_arch_count + 1) * sizeof(uint32_t) + 7) & ~7ULL;
+    hdr.lib_name_offset = offset;
+    offset += ((uint64_t)lib_total * sizeof(uint64_t) + 7) & ~7ULL;
+    hdr.lib_execs_offset = offset;
+    offset += ((uint64_t)(lib_total + 1) * sizeof(uint32_t) + 7) & ~7ULL;
+    hdr.exec_path_offset = offset;
+    offset += ((uint64_t)exec_total * sizeof(uint32_t) + 7) & ~7ULL;
+    hdr.path_string_offset = offset;
+    offset += ((uint64_t)path_total * sizeof(uint64_t) + 7) & ~7ULL;
+    hdr.path_kind_offset = offset;
+    offset += ((uint64_t)path_total + 7) & ~7ULL;
+    hdr.strings_offset = offset;
+    
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    write_report_column(fp, arch_name, sorted_arch_count * sizeof(uint64_t));
+    write_report_column(fp, arch_libs, (sorted_arch_count + 1) * sizeof(uint32_t));
+    write_report_column(fp, lib_name, lib_total * sizeof(uint64_t));
+    write_report_column(fp, lib_execs, (lib_total + 1) * sizeof(uint32_t));
+    write_report_column(fp, exec_path, exec_total * sizeof(uint32_t));
+    write_report_column(fp, path_string, path_total * sizeof(uint64_t));
+    write_report_column(fp, path_kind, path_total);
+    for (uint32_t p = 0; p < path_total; p++) {
+        char path[MAX_PATH];
+        
+        fwrite(path_at(path_order[p], path), 1, path_pool.files[path_order[p]].len + 1, fp);
+    }
+    for (int a = 0; a < sorted_arch_count; a++) {
+        Architecture *arch = sorted_archs[a];
+        
+        fwrite(arch->name, 1, strlen(arch->name) + 1, fp);
+        for (int l = 0; l < arch->sorted_count; l++) {
+            fwrite(arch->sorted[l]->name, 1, strlen(arch->sorted[l]->name) + 1, fp);
+        }
+    }
+    
+    free(arch_name);
+    free(arch_libs);
+    free(lib_name);
+    free(lib_execs);
+    free(exec_path);
+    free(path_string);
+    free(path_kind);
+    free(path_id);
+    free(path_order);
+}
+
+// Write one column of the binary report, padded to the next 8-byte boundary
+void write_report_column(FILE *fp, const void *data, size_t size) {
+    static const char zeros[8] = { 0 };
+    
+    fwrite(data, 1, size, fp);
+    fwrite(zeros, 1, (8 - (size & 7)) & 7, fp);
+}
+
+uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Phases are timed for --stats only; both calls are no-ops otherwise
+void phase_start(Phase phase) {
+    if (!stats_enabled) {
+        return;
+    }
+    phase_times[phase].wall_start = clock_ns(CLOCK_MONOTONIC);
+    phase_times[phase].cpu_start = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void phase_stop(Phase phase) {
+    PhaseTime *t = &phase_times[phase];
+    
+    if (!stats_enabled || t->wall_start == 0) {
+        return;
+    }
+    t->wall_ns += clock_ns(CLOCK_MONOTONIC) - t->wall_start;
+    t->cpu_ns += clock_ns(CLOCK_PROCESS_CPUTIME_ID) - t->cpu_start;
+    t->wall_start = 0;
+}
+
+// Log-linear histogram: values below 8 get a bucket each, every power of
+// two above that is split into 8 buckets, so any value is within 12.5%
+// of its bucket's limit.
+int latency_bucket(uint64_t ns) {
+    if (ns < 8) {
+        return (int)ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    return (msb - 2) * 8 + (int)((ns >> (msb - 3)) & 7);
+}
+
+// Smallest value above every value in bucket
+uint64_t latency_bucket_limit(int bucket) {
+    if (bucket < 8) {
+        return (uint64_t)bucket + 1;
+    }
+    int msb = bucket / 8 + 2;
+    return (uint64_t)(9 + bucket % 8) << (msb - 3);
+}
+
+void record_latency(ScanStats *stats, uint64_t start_ns) {
+    if (start_ns == 0) {
+        return;
+    }
+    uint64_t ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+    
+    stats->latency[latency_bucket(ns)]++;
+    stats->latency_count++;
+    if (ns > stats->latency_max) {
+        stats->latency_max = ns;
+    }
+}
+
+void add_scan_stats(ScanStats *total, const ScanStats *stats) {
+    total->dirs += stats->dirs;
+    total->pruned += stats->pruned;
+    total->entries += stats->entries;
+    total->rejected += stats->rejected;
+    total->opened += stats->opened;
+    total->unreadable += stats->unreadable;
+    total->elf_files += stats->elf_files;
+    total->cache_hits += stats->cache_hits;
+    total->inode_hits += stats->inode_hits;
+    total->content_hits += stats->content_hits;
+    total->bytes_read += stats->bytes_read;
+    total->bytes_mapped += stats->bytes_mapped;
+    total->traverse_ns += stats->traverse_ns;
+    total->classify_ns += stats->classify_ns;
+    total->match_ns += stats->match_ns;
+    total->wait_ns += stats->wait_ns;
+    total->cpu_ns += stats->cpu_ns;
+    total->spilled_runs += stats->spilled_runs;
+    total->spilled_bytes += stats->spilled_bytes;
+    total->reuse_skipped += stats->reuse_skipped;
+    total->latency_count += stats->latency_count;
+    if (stats->latency_max > total->latency_max) {
+        total->latency_max = stats->latency_max;
+    }
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        total->latency[i] += stats->latency[i];
+    }
+}
+
+// Upper bound of the bucket holding the given fraction of the files
+uint64_t latency_percentile(const ScanStats *stats, double fraction) {
+    uint64_t want = (uint64_t)(fraction * stats->latency_count + 0.5);
+    uint64_t seen = 0;
+    
+    if (want == 0) {
+        want = 1;
+    }
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += stats->latency[i];
+        if (seen >= want) {
+            uint64_t limit = latency_bucket_limit(i);
+            return limit < stats->latency_max ? limit : stats->latency_max;
+        }
+    }
+    return stats->latency_max;
+}
+
+// Written to progress_out so a --stream consumer on stdout never sees it
+void print_stats(const Options *options) {
+    static const char *phase_names[PHASE_COUNT] = { "scan", "resolve", "merge", "order", "report" };
+    const ScanStats *s = &scan_stats;
+    FILE *out = progress_out;
+    
+    fprintf(out, "\nStatistics:\n");
+    fprintf(out, "  %-10s %12s %12s\n", "phase", "wall (ms)", "cpu (ms)");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        if ((p == PHASE_RESOLVE && !options->transitive) || (p == PHASE_MERGE && !options->mem_limit)) {
+            continue;
+        }
+        fprintf(out, "  %-10s %12.3f %12.3f\n", phase_names[p],
+                phase_times[p].wall_ns / 1e6, phase_times[p].cpu_ns / 1e6);
+    }
+    
+    // A --query run reads no files, so there is nothing else to show
+    if (thread_count == 0) {
+        return;
+    }
+    
+    fprintf(out, "  directories %llu, entries %llu, rejected %llu, opened %llu, cache hits %llu, ELF files %llu\n",
+            (unsigned long long)s->dirs, (unsigned long long)s->entries,
+            (unsigned long long)s->rejected, (unsigned long long)s->opened,
+            (unsigned long long)s->cache_hits, (unsigned long long)s->elf_files);
+    if (s->pruned) {
+        fprintf(out, "  pruned: %llu directories and files\n", (unsigned long long)s->pruned);
+    }
+    if (s->unreadable) {
+        fprintf(out, "  unreadable: %llu files, not cached\n", (unsigned long long)s->unreadable);
+    }
+    fprintf(out, "  reused: hardlinks %llu, same content %llu\n",
+            (unsigned long long)s->inode_hits, (unsigned long long)s->content_hits);
+    fprintf(out, "  bytes read %llu, bytes mapped %llu\n",
+            (unsigned long long)s->bytes_read, (unsigned long long)s->bytes_mapped);
+    if (options->mem_limit) {
+        fprintf(out, "  spilled: runs %llu, bytes %llu, merge passes %d, files not kept for reuse %llu\n",
+                (unsigned long long)s->spilled_runs, (unsigned long long)s->spilled_bytes, merge_passes,
+                (unsigned long long)s->reuse_skipped);
+    }
+    fprintf(out, "  thread time (ms): traverse %.3f, classify %.3f, match %.3f, io wait %.3f, cpu %.3f\n",
+            s->traverse_ns / 1e6, s->classify_ns / 1e6, s->match_ns / 1e6,
+            s->wait_ns / 1e6, s->cpu_ns / 1e6);
+    if (thread_count > 1) {
+        for (int i = 0; i < thread_count; i++) {
+            const ScanStats *t = &thread_stats[i];
+            fprintf(out, "    thread %-3d dirs %-8llu files %-9llu traverse %.3f, classify %.3f, match %.3f, io wait %.3f, cpu %.3f\n",
+                    i, (unsigned long long)t->dirs, (unsigned long long)t->latency_count,
+                    t->traverse_ns / 1e6, t->classify_ns / 1e6, t->match_ns / 1e6,
+                    t->wait_ns / 1e6, t->cpu_ns / 1e6);
+        }
+    }
+    if (s->latency_count > 0) {
+        fprintf(out, "  per-file latency (us): p50 %.1f, p90 %.1f, p99 %.1f, max %.1f over %llu files\n",
+                latency_percentile(s, 0.50) / 1e3, latency_percentile(s, 0.90) / 1e3,
+                latency_percentile(s, 0.99) / 1e3, s->latency_max / 1e3,
+                (unsigned long long)s->latency_count);
+    }
+}
+
 void cleanup() {
-    // Free allocated memory for executables
+    // Free the result tables and the path pool
     for (int a = 0; a < arch_count; a++) {
         for (int l = 0; l < archs[a].lib_count; l++) {
-            for (int e = 0; e < archs[a].libraries[l].exec_count; e++) {
-                free(archs[a].libraries[l].execs[e]);
-            }
+            free(archs[a].libraries[l].execs);
         }
+        free(archs[a].libraries);
+        free(archs[a].sorted);
+    }
+    free(archs);
+    free(sorted_archs);
+    arena_free(&result_arena);
+    free(path_pool.names);
+    free(path_pool.dirs);
+    free(path_pool.files);
+    free(path_pool.kinds);
+    free(path_ranks);
+    free(ranked_paths);
+    free(dir_ranks);
+    free(lib_refs);
+    free(arch_map.hashes);
+    free(arch_map.values);
+    free(library_map.hashes);
+    free(library_map.values);
+    free(path_map.hashes);
+    free(path_map.values);
+    free(dir_map.hashes);
+    free(dir_map.values);
+    free(exec_set.keys);
+    for (int wd = 0; wd < watch_dir_cap; wd++) {
+        free(watch_dirs[wd]);
     }
-} 
\ No newline at end of file
+    free(watch_dirs);
+    if (merged_run != NULL) {
+        fclose(merged_run);
+    }
+}